@@ -0,0 +1,125 @@
+#include "alloc-stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef ALLOC_STATS
+
+// Every block is preceded by its size and category, which frees and
+// reallocations need to update the live bytes
+typedef union AllocHeader {
+  struct {
+    alloc_Category *category;
+    size_t size;
+  };
+  max_align_t align;
+} AllocHeader;
+
+static _Atomic(alloc_Category *) categories;
+static atomic_size_t live_bytes;
+static atomic_size_t peak_live_bytes;
+
+static void alloc_register(alloc_Category *category) {
+  if (atomic_load_explicit(&category->registered, memory_order_acquire))
+    return;
+  if (atomic_exchange(&category->registered, true))
+    return;
+  category->next = atomic_load(&categories);
+  while (!atomic_compare_exchange_weak(&categories, &category->next, category))
+    ;
+}
+
+static void alloc_grow_live(alloc_Category *category, size_t size) {
+  atomic_fetch_add_explicit(&category->live_bytes, size, memory_order_relaxed);
+  size_t live =
+      atomic_fetch_add_explicit(&live_bytes, size, memory_order_relaxed) +
+      size;
+  size_t peak = atomic_load_explicit(&peak_live_bytes, memory_order_relaxed);
+  while (peak < live &&
+         !atomic_compare_exchange_weak_explicit(&peak_live_bytes, &peak, live,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+}
+
+static void alloc_shrink_live(alloc_Category *category, size_t size) {
+  atomic_fetch_sub_explicit(&category->live_bytes, size, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&live_bytes, size, memory_order_relaxed);
+}
+
+static void *alloc_track(alloc_Category *category, AllocHeader *header,
+                         size_t size) {
+  if (!header)
+    return 0;
+  header->category = category;
+  header->size = size;
+  alloc_grow_live(category, size);
+  return header + 1;
+}
+
+void *alloc_stats_malloc(alloc_Category *category, size_t size) {
+  alloc_register(category);
+  atomic_fetch_add_explicit(&category->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&category->bytes, size, memory_order_relaxed);
+  if (size > (size_t)-1 - sizeof(AllocHeader))
+    return 0;
+  return alloc_track(category, malloc(sizeof(AllocHeader) + size), size);
+}
+
+void *alloc_stats_calloc(alloc_Category *category, size_t count, size_t size) {
+  if (size > 0 && count > ((size_t)-1 - sizeof(AllocHeader)) / size)
+    return 0;
+  size *= count;
+  alloc_register(category);
+  atomic_fetch_add_explicit(&category->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&category->bytes, size, memory_order_relaxed);
+  return alloc_track(category, calloc(1, sizeof(AllocHeader) + size), size);
+}
+
+void *alloc_stats_realloc(alloc_Category *category, void *ptr, size_t size) {
+  if (!ptr)
+    return alloc_stats_malloc(category, size);
+  if (size > (size_t)-1 - sizeof(AllocHeader))
+    return 0;
+
+  alloc_register(category);
+  atomic_fetch_add_explicit(&category->reallocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&category->bytes, size, memory_order_relaxed);
+  AllocHeader *header = (AllocHeader *)ptr - 1;
+  alloc_Category *owner = header->category;
+  size_t old_size = header->size;
+  header = realloc(header, sizeof(AllocHeader) + size);
+  if (!header)
+    return 0;
+  alloc_shrink_live(owner, old_size);
+  return alloc_track(owner, header, size);
+}
+
+void alloc_stats_free(void *ptr) {
+  if (!ptr)
+    return;
+  AllocHeader *header = (AllocHeader *)ptr - 1;
+  atomic_fetch_add_explicit(&header->category->frees, 1,
+                            memory_order_relaxed);
+  alloc_shrink_live(header->category, header->size);
+  free(header);
+}
+
+void alloc_stats_print(FILE *out) {
+  fprintf(out, "%-16s %12s %12s %12s %16s %16s\n", "category", "allocs",
+          "reallocs", "frees", "bytes", "live_bytes");
+  for (alloc_Category *c = atomic_load(&categories); c; c = c->next)
+    fprintf(out, "%-16s %12zu %12zu %12zu %16zu %16zu\n", c->name,
+            atomic_load(&c->allocs), atomic_load(&c->reallocs),
+            atomic_load(&c->frees), atomic_load(&c->bytes),
+            atomic_load(&c->live_bytes));
+  fprintf(out, "peak_live_bytes %zu\n", atomic_load(&peak_live_bytes));
+}
+
+#else
+void alloc_stats_print(FILE *out) { (void)out; }
+#endif // ALLOC_STATS
+
+static void alloc_print_to_stderr(void) { alloc_stats_print(stderr); }
+
+void alloc_stats_print_at_exit(void) { atexit(alloc_print_to_stderr); }
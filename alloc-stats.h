@@ -0,0 +1,61 @@
+//===----------------------------------------------------------------------===//
+// alloc-stats - Allocation tracking
+//
+// When ALLOC_STATS is defined, the ALLOC_* macros count the allocations,
+// reallocations, frees and bytes of each category of call sites, along with
+// the peak number of live bytes. Otherwise they expand to the standard
+// allocation functions.
+//
+// Memory obtained from ALLOC_MALLOC, ALLOC_CALLOC or ALLOC_REALLOC must only
+// be released with ALLOC_FREE, which must not be given anything else.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_ALLOC_STATS_H
+#define INCLUDED_ALLOC_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef ALLOC_STATS
+#include <stdatomic.h>
+
+typedef struct alloc_Category {
+  const char *name;
+  struct alloc_Category *next; // Next category used
+  atomic_bool registered;
+  atomic_size_t allocs;
+  atomic_size_t reallocs;
+  atomic_size_t frees;
+  atomic_size_t bytes; // Requested by allocations and reallocations
+  atomic_size_t live_bytes;
+} alloc_Category;
+
+#define ALLOC_CATEGORY(var, label) static alloc_Category var = {.name = label}
+#define ALLOC_MALLOC(category, size) alloc_stats_malloc(&(category), size)
+#define ALLOC_CALLOC(category, count, size)                                    \
+  alloc_stats_calloc(&(category), count, size)
+#define ALLOC_REALLOC(category, ptr, size)                                     \
+  alloc_stats_realloc(&(category), ptr, size)
+#define ALLOC_FREE(ptr) alloc_stats_free(ptr)
+
+void *alloc_stats_malloc(alloc_Category *category, size_t size);
+void *alloc_stats_calloc(alloc_Category *category, size_t count, size_t size);
+void *alloc_stats_realloc(alloc_Category *category, void *ptr, size_t size);
+void alloc_stats_free(void *ptr);
+#else
+#define ALLOC_CATEGORY(var, label) struct alloc_Category
+#define ALLOC_MALLOC(category, size) malloc(size)
+#define ALLOC_CALLOC(category, count, size) calloc(count, size)
+#define ALLOC_REALLOC(category, ptr, size) realloc(ptr, size)
+#define ALLOC_FREE(ptr) free(ptr)
+#endif
+
+// Print the statistics of every category used so far. Nothing is printed
+// unless ALLOC_STATS is defined.
+void alloc_stats_print(FILE *out);
+
+// Print the statistics to stderr when the program exits
+void alloc_stats_print_at_exit(void);
+
+#endif // INCLUDED_ALLOC_STATS_H
@@ -0,0 +1,419 @@
+//===----------------------------------------------------------------------===//
+// arraylist-algorithm - Typed algorithms over arraylists
+//
+// The ARRAYLIST_DEFINE_* macros generate static functions for one element
+// type, with its comparison or key inlined where qsort and bsearch call a
+// comparator through a pointer. They take an array and a length, so they work
+// on lists, slices of lists and plain arrays alike.
+//
+// The arraylist_* macros below dispatch on the element type of a list of int,
+// unsigned, int64_t or uint64_t to the instances defined here. Linear find and
+// count use SSE2 unless ARRAYLIST_NO_SIMD is defined.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_ARRAYLIST_ALGORITHM_H
+#define INCLUDED_ARRAYLIST_ALGORITHM_H
+
+#include "arraylist.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(ARRAYLIST_NO_SIMD) && defined(__SSE2__)
+#define ARRAYLIST_SSE2 1
+#include <emmintrin.h>
+#else
+#define ARRAYLIST_SSE2 0
+#endif
+
+// Slices at most this long are sorted by insertion
+#ifndef ARRAYLIST_INSERTION_THRESHOLD
+#define ARRAYLIST_INSERTION_THRESHOLD 16
+#endif
+
+#define ARRAYLIST_LESS(x, y) ((x) < (y))
+#define ARRAYLIST_EQUAL(x, y) ((x) == (y))
+
+// Keys of radix sorts, ordering unsigned integers like the given integers
+#define arraylist_key_u32(x) ((uint32_t)(x))
+#define arraylist_key_i32(x) ((uint32_t)(x) ^ UINT32_C(0x80000000))
+#define arraylist_key_u64(x) ((uint64_t)(x))
+#define arraylist_key_i64(x) ((uint64_t)(x) ^ UINT64_C(0x8000000000000000))
+
+//===----------------------------------------------------------------------===//
+// Sorting
+//===----------------------------------------------------------------------===//
+
+// Define void name(type *a, size_t n), an introsort ordering a by less(x, y),
+// a macro or function returning whether x goes before y. Like qsort, it is not
+// stable.
+#define ARRAYLIST_DEFINE_SORT(name, type, less)                                \
+  static inline void name##_insertion(type *a, size_t n) {                     \
+    for (size_t i = 1; i < n; ++i) {                                           \
+      type x = a[i];                                                           \
+      size_t j = i;                                                            \
+      for (; j > 0 && less(x, a[j - 1]); --j)                                  \
+        a[j] = a[j - 1];                                                       \
+      a[j] = x;                                                                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline void name##_sift_down(type *a, size_t n, size_t i) {           \
+    type x = a[i];                                                             \
+    for (size_t child; (child = 2 * i + 1) < n; i = child) {                   \
+      if (child + 1 < n && less(a[child], a[child + 1]))                       \
+        ++child;                                                               \
+      if (!less(x, a[child]))                                                  \
+        break;                                                                 \
+      a[i] = a[child];                                                         \
+    }                                                                          \
+    a[i] = x;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline void name##_heapsort(type *a, size_t n) {                      \
+    for (size_t i = n / 2; i > 0; --i)                                         \
+      name##_sift_down(a, n, i - 1);                                           \
+    for (size_t i = n; i > 1; --i) {                                           \
+      type x = a[0];                                                           \
+      a[0] = a[i - 1];                                                         \
+      a[i - 1] = x;                                                            \
+      name##_sift_down(a, i - 1, 0);                                           \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* Hoare partition around the median of the first, middle and last           \
+     elements, falling back to heapsort after depth bad splits */              \
+  static inline void name##_intro(type *a, size_t n, int depth) {              \
+    while (n > ARRAYLIST_INSERTION_THRESHOLD) {                                \
+      if (depth-- == 0) {                                                      \
+        name##_heapsort(a, n);                                                 \
+        return;                                                                \
+      }                                                                        \
+      size_t mid = (n - 1) / 2;                                                \
+      type x;                                                                  \
+      if (less(a[mid], a[0]))                                                  \
+        x = a[mid], a[mid] = a[0], a[0] = x;                                   \
+      if (less(a[n - 1], a[mid]))                                              \
+        x = a[mid], a[mid] = a[n - 1], a[n - 1] = x;                           \
+      if (less(a[mid], a[0]))                                                  \
+        x = a[mid], a[mid] = a[0], a[0] = x;                                   \
+      type pivot = a[mid];                                                     \
+      size_t i = 0, j = n - 1;                                                 \
+      for (;;) {                                                               \
+        while (less(a[i], pivot))                                              \
+          ++i;                                                                 \
+        while (less(pivot, a[j]))                                              \
+          --j;                                                                 \
+        if (i >= j)                                                            \
+          break;                                                               \
+        x = a[i], a[i] = a[j], a[j] = x;                                       \
+        ++i, --j;                                                              \
+      }                                                                        \
+      /* Recurse on the smaller side to bound the stack */                     \
+      if (j + 1 < n - j - 1) {                                                 \
+        name##_intro(a, j + 1, depth);                                         \
+        a += j + 1, n -= j + 1;                                                \
+      } else {                                                                 \
+        name##_intro(a + j + 1, n - j - 1, depth);                             \
+        n = j + 1;                                                             \
+      }                                                                        \
+    }                                                                          \
+    name##_insertion(a, n);                                                    \
+  }                                                                            \
+                                                                               \
+  static inline void name(type *a, size_t n) {                                 \
+    int depth = 0;                                                             \
+    for (size_t m = n; m > 1; m /= 2)                                          \
+      depth += 2;                                                              \
+    name##_intro(a, n, depth);                                                 \
+  }
+
+// Define void name(type *a, size_t n), a stable LSD radix sort ordering a by
+// key(x), a uint32_t or uint64_t as given by key_type, one byte per pass.
+// Passes in which every key has the same byte are skipped. Scratch space for
+// n elements is allocated for the duration of the sort.
+#define ARRAYLIST_DEFINE_RADIX_SORT(name, type, key_type, key)                 \
+  static inline void name(type *a, size_t n) {                                 \
+    enum { PASSES = sizeof(key_type) };                                        \
+    if (n <= ARRAYLIST_INSERTION_THRESHOLD) {                                  \
+      for (size_t i = 1; i < n; ++i) {                                         \
+        type x = a[i];                                                         \
+        size_t j = i;                                                          \
+        for (; j > 0 && key(x) < key(a[j - 1]); --j)                           \
+          a[j] = a[j - 1];                                                     \
+        a[j] = x;                                                              \
+      }                                                                        \
+      return;                                                                  \
+    }                                                                          \
+                                                                               \
+    size_t counts[PASSES][256] = {{0}};                                        \
+    for (size_t i = 0; i < n; ++i) {                                           \
+      key_type k = key(a[i]);                                                  \
+      for (int pass = 0; pass < PASSES; ++pass)                                \
+        ++counts[pass][(k >> (8 * pass)) & 0xff];                              \
+    }                                                                          \
+                                                                               \
+    type *scratch = 0, *from = a, *to;                                         \
+    arraylist_init(scratch, n);                                                \
+    to = scratch;                                                              \
+    for (int pass = 0; pass < PASSES; ++pass) {                                \
+      size_t *count = counts[pass], offset = 0;                                \
+      if (count[(key(a[0]) >> (8 * pass)) & 0xff] == n)                        \
+        continue;                                                              \
+      for (int digit = 0; digit < 256; ++digit) {                              \
+        size_t c = count[digit];                                               \
+        count[digit] = offset;                                                 \
+        offset += c;                                                           \
+      }                                                                        \
+      for (size_t i = 0; i < n; ++i)                                           \
+        to[count[(key(from[i]) >> (8 * pass)) & 0xff]++] = from[i];            \
+      type *swap = from;                                                       \
+      from = to;                                                               \
+      to = swap;                                                               \
+    }                                                                          \
+    if (from != a)                                                             \
+      memcpy(a, from, n * sizeof(type));                                       \
+    arraylist_free(scratch);                                                   \
+  }
+
+//===----------------------------------------------------------------------===//
+// Searching
+//===----------------------------------------------------------------------===//
+
+// Define size_t name_lower_bound(const type *a, size_t n, type value) and
+// name_upper_bound, returning the index of the first element of a, sorted by
+// less, that does not go before value, or that goes after it. The search is
+// branchless so that it does not suffer from mispredictions.
+#define ARRAYLIST_DEFINE_SEARCH(name, type, less)                              \
+  static inline size_t name##_lower_bound(const type *a, size_t n,             \
+                                          type value) {                        \
+    if (n == 0)                                                                \
+      return 0;                                                                \
+    const type *base = a;                                                      \
+    while (n > 1) {                                                            \
+      size_t half = n / 2;                                                     \
+      base = less(base[half], value) ? base + half : base;                     \
+      n -= half;                                                               \
+    }                                                                          \
+    return (base - a) + less(*base, value);                                    \
+  }                                                                            \
+                                                                               \
+  static inline size_t name##_upper_bound(const type *a, size_t n,             \
+                                          type value) {                        \
+    if (n == 0)                                                                \
+      return 0;                                                                \
+    const type *base = a;                                                      \
+    while (n > 1) {                                                            \
+      size_t half = n / 2;                                                     \
+      base = !less(value, base[half]) ? base + half : base;                    \
+      n -= half;                                                               \
+    }                                                                          \
+    return (base - a) + !less(value, *base);                                   \
+  }
+
+// Define size_t name(type *a, size_t n), moving the first of every run of
+// elements equal by equal(x, y) to the front of a and returning their number
+#define ARRAYLIST_DEFINE_DEDUP(name, type, equal)                              \
+  static inline size_t name(type *a, size_t n) {                               \
+    if (n == 0)                                                                \
+      return 0;                                                                \
+    size_t size = 1;                                                           \
+    for (size_t i = 1; i < n; ++i) {                                           \
+      if (!equal(a[i], a[size - 1]))                                           \
+        a[size++] = a[i];                                                      \
+    }                                                                          \
+    return size;                                                               \
+  }
+
+// Define size_t name_find(const type *a, size_t n, type value), returning the
+// index of the first element equal to value by equal(x, y) or n if there is
+// none, and size_t name_count, returning the number of such elements
+#define ARRAYLIST_DEFINE_FIND(name, type, equal)                               \
+  static inline size_t name##_find(const type *a, size_t n, type value) {      \
+    size_t i = 0;                                                              \
+    while (i < n && !equal(a[i], value))                                       \
+      ++i;                                                                     \
+    return i;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline size_t name##_count(const type *a, size_t n, type value) {     \
+    size_t count = 0;                                                          \
+    for (size_t i = 0; i < n; ++i)                                             \
+      count += equal(a[i], value);                                             \
+    return count;                                                              \
+  }
+
+//===----------------------------------------------------------------------===//
+// Primitive types
+//===----------------------------------------------------------------------===//
+
+ARRAYLIST_DEFINE_SORT(arraylist_sort_int, int, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SORT(arraylist_sort_uint, unsigned, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SORT(arraylist_sort_i64, int64_t, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SORT(arraylist_sort_u64, uint64_t, ARRAYLIST_LESS)
+
+ARRAYLIST_DEFINE_RADIX_SORT(arraylist_radix_sort_int, int, uint32_t,
+                            arraylist_key_i32)
+ARRAYLIST_DEFINE_RADIX_SORT(arraylist_radix_sort_uint, unsigned, uint32_t,
+                            arraylist_key_u32)
+ARRAYLIST_DEFINE_RADIX_SORT(arraylist_radix_sort_i64, int64_t, uint64_t,
+                            arraylist_key_i64)
+ARRAYLIST_DEFINE_RADIX_SORT(arraylist_radix_sort_u64, uint64_t, uint64_t,
+                            arraylist_key_u64)
+
+ARRAYLIST_DEFINE_SEARCH(arraylist_int, int, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SEARCH(arraylist_uint, unsigned, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SEARCH(arraylist_i64, int64_t, ARRAYLIST_LESS)
+ARRAYLIST_DEFINE_SEARCH(arraylist_u64, uint64_t, ARRAYLIST_LESS)
+
+ARRAYLIST_DEFINE_DEDUP(arraylist_dedup_u32, uint32_t, ARRAYLIST_EQUAL)
+ARRAYLIST_DEFINE_DEDUP(arraylist_dedup_u64, uint64_t, ARRAYLIST_EQUAL)
+
+// Signed and unsigned elements are equal when their bits are, so find and
+// count work on the unsigned types
+ARRAYLIST_DEFINE_FIND(arraylist_scalar_u32, uint32_t, ARRAYLIST_EQUAL)
+ARRAYLIST_DEFINE_FIND(arraylist_scalar_u64, uint64_t, ARRAYLIST_EQUAL)
+
+#if ARRAYLIST_SSE2
+// Bit i of the result is set when byte i of the 64 bytes at p is part of an
+// element equal to the one broadcast in value. Equal 64-bit elements are those
+// with both of their 32-bit halves equal.
+static inline uint64_t arraylist_match_64(const void *p, __m128i value,
+                                          bool wide) {
+  const __m128i *v = p;
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(v + i), value);
+    if (wide)
+      eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    mask |= (uint64_t)(unsigned)_mm_movemask_epi8(eq) << (16 * i);
+  }
+  return mask;
+}
+#endif
+
+static inline size_t arraylist_find_u32(const void *list, size_t n,
+                                        uint32_t value) {
+  const uint32_t *a = list;
+  size_t i = 0;
+#if ARRAYLIST_SSE2
+  __m128i v = _mm_set1_epi32((int)value);
+  for (; i + 16 <= n; i += 16) {
+    uint64_t mask = arraylist_match_64(a + i, v, false);
+    if (mask)
+      return i + __builtin_ctzll(mask) / 4;
+  }
+#endif
+  return i + arraylist_scalar_u32_find(a + i, n - i, value);
+}
+
+static inline size_t arraylist_find_u64(const void *list, size_t n,
+                                        uint64_t value) {
+  const uint64_t *a = list;
+  size_t i = 0;
+#if ARRAYLIST_SSE2
+  __m128i v = _mm_set1_epi64x((long long)value);
+  for (; i + 8 <= n; i += 8) {
+    uint64_t mask = arraylist_match_64(a + i, v, true);
+    if (mask)
+      return i + __builtin_ctzll(mask) / 8;
+  }
+#endif
+  return i + arraylist_scalar_u64_find(a + i, n - i, value);
+}
+
+static inline size_t arraylist_count_u32(const void *list, size_t n,
+                                         uint32_t value) {
+  const uint32_t *a = list;
+  size_t i = 0, count = 0;
+#if ARRAYLIST_SSE2
+  __m128i v = _mm_set1_epi32((int)value);
+  while (n - i >= 4) {
+    // Lanes count down by one per match, and are added up before they can
+    // overflow
+    size_t block = n - i < ((size_t)1 << 30) ? n - i : (size_t)1 << 30;
+    __m128i counts = _mm_setzero_si128();
+    for (size_t end = i + block / 4 * 4; i < end; i += 4) {
+      __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const void *)(a + i)), v);
+      counts = _mm_sub_epi32(counts, eq);
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((void *)lanes, counts);
+    count += (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+#endif
+  return count + arraylist_scalar_u32_count(a + i, n - i, value);
+}
+
+static inline size_t arraylist_count_u64(const void *list, size_t n,
+                                         uint64_t value) {
+  const uint64_t *a = list;
+  size_t i = 0, count = 0;
+#if ARRAYLIST_SSE2
+  __m128i v = _mm_set1_epi64x((long long)value), counts = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const void *)(a + i)), v);
+    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    counts = _mm_sub_epi64(counts, eq);
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((void *)lanes, counts);
+  count = lanes[0] + lanes[1];
+#endif
+  return count + arraylist_scalar_u64_count(a + i, n - i, value);
+}
+
+//===----------------------------------------------------------------------===//
+// Lists of primitive types
+//===----------------------------------------------------------------------===//
+
+#define arraylist_sort(a)                                                      \
+  _Generic(*(a), int: arraylist_sort_int, unsigned: arraylist_sort_uint,       \
+           int64_t: arraylist_sort_i64, uint64_t: arraylist_sort_u64)(         \
+      (a), arraylist_size((a)))
+
+#define arraylist_radix_sort(a)                                                \
+  _Generic(*(a), int: arraylist_radix_sort_int,                                \
+           unsigned: arraylist_radix_sort_uint,                                \
+           int64_t: arraylist_radix_sort_i64,                                  \
+           uint64_t: arraylist_radix_sort_u64)((a), arraylist_size((a)))
+
+// Index of the first element of a sorted list not less than value
+#define arraylist_lower_bound(a, value)                                        \
+  _Generic(*(a), int: arraylist_int_lower_bound,                               \
+           unsigned: arraylist_uint_lower_bound,                               \
+           int64_t: arraylist_i64_lower_bound,                                 \
+           uint64_t: arraylist_u64_lower_bound)((a), arraylist_size((a)),      \
+                                                (value))
+
+// Index of the first element of a sorted list greater than value
+#define arraylist_upper_bound(a, value)                                        \
+  _Generic(*(a), int: arraylist_int_upper_bound,                               \
+           unsigned: arraylist_uint_upper_bound,                               \
+           int64_t: arraylist_i64_upper_bound,                                 \
+           uint64_t: arraylist_u64_upper_bound)((a), arraylist_size((a)),      \
+                                                (value))
+
+// Remove consecutive duplicates, leaving every element of a sorted list once
+#define arraylist_dedup(a)                                                     \
+  ((a) ? (arraylist_ptr((a))->size = _Generic(*(a),                            \
+          int: arraylist_dedup_u32, unsigned: arraylist_dedup_u32,             \
+          int64_t: arraylist_dedup_u64, uint64_t: arraylist_dedup_u64)(        \
+              (void *)(a), arraylist_size((a))))                               \
+       : 0)
+
+// Index of the first element equal to value, or the size of the list
+#define arraylist_find(a, value)                                               \
+  _Generic(*(a), int: arraylist_find_u32, unsigned: arraylist_find_u32,        \
+           int64_t: arraylist_find_u64, uint64_t: arraylist_find_u64)(         \
+      (a), arraylist_size((a)), (value))
+
+#define arraylist_count(a, value)                                              \
+  _Generic(*(a), int: arraylist_count_u32, unsigned: arraylist_count_u32,      \
+           int64_t: arraylist_count_u64, uint64_t: arraylist_count_u64)(       \
+      (a), arraylist_size((a)), (value))
+
+#endif // INCLUDED_ARRAYLIST_ALGORITHM_H
@@ -0,0 +1,657 @@
+//===----------------------------------------------------------------------===//
+// arraylist-bench - Benchmarks for arraylist
+//
+// Bulk operations are timed against the element-wise loops they replace, and
+// short-lived lists are allocated from the heap, caller storage and an arena.
+// Large lists are grown with realloc and with the default mapped path. The
+// algorithms of arraylist-algorithm.h are timed against qsort, bsearch and
+// plain loops, and concurrent appends against arraylist_push under a mutex.
+// Every benchmark is run repeatedly and reported as one tab-separated line
+// holding the median and 99th percentile of its runs, like calc-bench.
+//
+//===----------------------------------------------------------------------===//
+
+#include "arraylist-algorithm.h"
+#include "arraylist-concurrent.h"
+#include "arraylist.h"
+#include "bench.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#define DEFAULT_SIZE 1000000
+#define DEFAULT_RUNS 50
+
+// Elements inserted or erased one at a time, which is quadratic
+#define RANGE_COUNT 1000
+
+// Elements of the short-lived lists, created and freed by the thousands
+#define SHORT_LIST_SIZE 16
+
+#define DEFAULT_LARGE_MB 512
+#define LARGE_CHUNK (64 * 1024) // Elements appended at once to large lists
+#define LARGE_RUNS 5
+
+#define SEARCH_QUERIES 1000000
+
+#define DEFAULT_THREADS 4
+
+//===----------------------------------------------------------------------===//
+// Appending
+//===----------------------------------------------------------------------===//
+
+static void bench_append(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *list = 0;
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j)
+      arraylist_push(list, source[j]);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "append.push");
+    arraylist_free(list);
+  }
+  bench_report("append.push", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    arraylist_reserve(list, n);
+    for (size_t j = 0; j < n; ++j)
+      arraylist_push(list, source[j]);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "append.reserve_push");
+    arraylist_free(list);
+  }
+  bench_report("append.reserve_push", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    arraylist_push_n(list, source, n);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n && list[n - 1] == source[n - 1],
+                "append.push_n");
+    arraylist_free(list);
+  }
+  bench_report("append.push_n", "elements", n, samples);
+  arraylist_free(samples);
+}
+
+// Concatenate two lists, which is what growing a list by another one costs
+static void bench_extend(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *half = 0;
+  arraylist_push_n(half, source, n / 2);
+  int *list = 0;
+
+  for (size_t i = 0; i < runs; ++i) {
+    arraylist_push_n(list, source, n - n / 2);
+    double start = bench_now_ns();
+    for (size_t j = 0; j < arraylist_size(half); ++j)
+      arraylist_push(list, half[j]);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "extend.push");
+    arraylist_free(list);
+  }
+  bench_report("extend.push", "elements", n / 2, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    arraylist_push_n(list, source, n - n / 2);
+    double start = bench_now_ns();
+    arraylist_extend(list, half);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "extend.extend");
+    arraylist_free(list);
+  }
+  bench_report("extend.extend", "elements", n / 2, samples);
+  arraylist_free(half);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Ranges
+//===----------------------------------------------------------------------===//
+
+// Insert then erase RANGE_COUNT elements in the middle of a list of n
+static void bench_ranges(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *list = 0;
+  arraylist_push_n(list, source, n);
+  size_t middle = n / 2, count = RANGE_COUNT;
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j)
+      arraylist_insert_range(list, middle + j, &source[j], 1);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(list[middle + count - 1] == source[count - 1],
+                "insert.one_by_one");
+    arraylist_erase_range(list, middle, count);
+  }
+  bench_report("insert.one_by_one", "elements", count, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    arraylist_insert_range(list, middle, source, count);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(list[middle + count - 1] == source[count - 1], "insert.range");
+    arraylist_erase_range(list, middle, count);
+  }
+  bench_report("insert.range", "elements", count, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    arraylist_insert_range(list, middle, source, count);
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j)
+      arraylist_erase_range(list, middle, 1);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "erase.one_by_one");
+  }
+  bench_report("erase.one_by_one", "elements", count, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    arraylist_insert_range(list, middle, source, count);
+    double start = bench_now_ns();
+    arraylist_erase_range(list, middle, count);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "erase.range");
+  }
+  bench_report("erase.range", "elements", count, samples);
+  arraylist_free(list);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Allocators
+//===----------------------------------------------------------------------===//
+
+// Bump allocator released all at once, standing for an arena
+typedef struct Bump {
+  char *data;
+  size_t used;
+  size_t capacity;
+} Bump;
+
+static void *bump_resize(void *context, void *ptr, size_t old_size,
+                         size_t size) {
+  Bump *bump = context;
+  size = (size + 15) & ~(size_t)15;
+  if (bump->capacity - bump->used < size)
+    return 0;
+  void *result = bump->data + bump->used;
+  bump->used += size;
+  if (ptr)
+    memcpy(result, ptr, old_size);
+  return result;
+}
+
+// Sum the elements of a list after filling it, so that the work is not
+// optimized away
+static long long fill_and_sum(int *list, const int *source) {
+  for (size_t i = 0; i < SHORT_LIST_SIZE; ++i)
+    arraylist_push(list, source[i]);
+  long long sum = 0;
+  for (size_t i = 0; i < arraylist_size(list); ++i)
+    sum += list[i];
+  arraylist_free(list);
+  return sum;
+}
+
+// Create, fill and free many short lists from each source of memory
+static void bench_allocators(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  size_t count = n / SHORT_LIST_SIZE;
+  long long expected = 0;
+  for (size_t i = 0; i < count; ++i)
+    for (size_t j = 0; j < SHORT_LIST_SIZE; ++j)
+      expected += source[i * SHORT_LIST_SIZE + j];
+
+  for (size_t i = 0; i < runs; ++i) {
+    long long sum = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j)
+      sum += fill_and_sum(0, source + j * SHORT_LIST_SIZE);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(sum == expected, "short.heap");
+  }
+  bench_report("short.heap", "lists", count, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    long long sum = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j) {
+      int *list = 0;
+      arraylist_init(list, SHORT_LIST_SIZE);
+      sum += fill_and_sum(list, source + j * SHORT_LIST_SIZE);
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(sum == expected, "short.heap_init");
+  }
+  bench_report("short.heap_init", "lists", count, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    long long sum = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j) {
+      arraylist_storage(int, SHORT_LIST_SIZE) storage;
+      int *list = 0;
+      arraylist_init_storage(list, storage);
+      sum += fill_and_sum(list, source + j * SHORT_LIST_SIZE);
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(sum == expected, "short.storage");
+  }
+  bench_report("short.storage", "lists", count, samples);
+
+  // Lists too small for their storage spill to the heap
+  for (size_t i = 0; i < runs; ++i) {
+    long long sum = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j) {
+      arraylist_storage(int, SHORT_LIST_SIZE / 2) storage;
+      int *list = 0;
+      arraylist_init_storage(list, storage);
+      sum += fill_and_sum(list, source + j * SHORT_LIST_SIZE);
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(sum == expected, "short.storage_spill");
+  }
+  bench_report("short.storage_spill", "lists", count, samples);
+
+  size_t list_bytes = sizeof(ArrayList) + SHORT_LIST_SIZE * sizeof(int);
+  Bump bump = {.data = malloc(count * (list_bytes + 16)),
+               .capacity = count * (list_bytes + 16)};
+  ArrayListAllocator allocator = {.resize = bump_resize, .context = &bump};
+  bench_check(bump.data != 0, "short.arena");
+  for (size_t i = 0; i < runs; ++i) {
+    long long sum = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < count; ++j) {
+      int *list = 0;
+      arraylist_init_with(list, SHORT_LIST_SIZE, &allocator);
+      sum += fill_and_sum(list, source + j * SHORT_LIST_SIZE);
+    }
+    bump.used = 0;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(sum == expected, "short.arena");
+  }
+  bench_report("short.arena", "lists", count, samples);
+  free(bump.data);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Large lists
+//===----------------------------------------------------------------------===//
+
+static void *heap_resize(void *context, void *ptr, size_t old_size,
+                         size_t size) {
+  (void)context, (void)old_size;
+  return realloc(ptr, size);
+}
+
+static void heap_release(void *context, void *ptr, size_t size) {
+  (void)context, (void)size;
+  free(ptr);
+}
+
+// Reset the peak resident set size of the process, returning false where it
+// cannot be measured
+static bool reset_peak_rss(void) {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (!f)
+    return false;
+  bool ok = fputs("5", f) >= 0;
+  return fclose(f) == 0 && ok;
+}
+
+static size_t peak_rss_kb(void) {
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  size_t kb = 0;
+  while (f && fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "VmHWM: %zu kB", &kb) == 1)
+      break;
+  }
+  if (f)
+    fclose(f);
+  return kb;
+}
+
+// Grow a list of the given number of megabytes chunk by chunk, the allocator
+// being null for the default path, which maps large lists
+static void bench_large_one(const char *name,
+                            const ArrayListAllocator *allocator,
+                            const int *source, size_t mb, size_t runs) {
+  double *samples = 0;
+  size_t n = mb * 1024 * 1024 / sizeof(int), peak = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    bool measured = reset_peak_rss();
+    size_t base = peak_rss_kb();
+    double start = bench_now_ns();
+    int *list = 0;
+    if (allocator)
+      arraylist_init_with(list, 0, allocator);
+    while (arraylist_size(list) < n)
+      arraylist_push_n(list, source, LARGE_CHUNK);
+    arraylist_free(list);
+    arraylist_push(samples, bench_now_ns() - start);
+    if (measured && peak_rss_kb() - base > peak)
+      peak = peak_rss_kb() - base;
+  }
+  bench_report(name, "elements", n, samples);
+  printf("# %s peak_rss_mb=%zu\n", name, peak / 1024);
+  arraylist_free(samples);
+}
+
+static void bench_large(const int *source, size_t mb, size_t runs) {
+  if (mb == 0)
+    return;
+  ArrayListAllocator heap = {.resize = heap_resize, .release = heap_release};
+  runs = runs < LARGE_RUNS ? runs : LARGE_RUNS;
+  bench_large_one("large.realloc", &heap, source, mb, runs);
+  bench_large_one("large.default", 0, source, mb, runs);
+}
+
+//===----------------------------------------------------------------------===//
+// Algorithms
+//===----------------------------------------------------------------------===//
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static bool is_sorted(const int *a, size_t n) {
+  for (size_t i = 1; i < n; ++i) {
+    if (a[i] < a[i - 1])
+      return false;
+  }
+  return true;
+}
+
+static void bench_sort(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *list = 0;
+  arraylist_push_n(list, source, n);
+
+  for (size_t i = 0; i < runs; ++i) {
+    memcpy(list, source, n * sizeof(int));
+    double start = bench_now_ns();
+    qsort(list, n, sizeof(int), compare_ints);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(is_sorted(list, n), "sort.qsort");
+  }
+  bench_report("sort.qsort", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    memcpy(list, source, n * sizeof(int));
+    double start = bench_now_ns();
+    arraylist_sort(list);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(is_sorted(list, n), "sort.introsort");
+  }
+  bench_report("sort.introsort", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    memcpy(list, source, n * sizeof(int));
+    double start = bench_now_ns();
+    arraylist_radix_sort(list);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(is_sorted(list, n), "sort.radix");
+  }
+  bench_report("sort.radix", "elements", n, samples);
+  arraylist_free(list);
+  arraylist_free(samples);
+}
+
+// Look up elements of the source, present or not, in a sorted copy of it
+static void bench_search(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *sorted = 0;
+  arraylist_push_n(sorted, source, n);
+  arraylist_radix_sort(sorted);
+  size_t expected = 0;
+  for (size_t i = 0; i < SEARCH_QUERIES; ++i)
+    expected += bsearch(&source[i % n], sorted, n, sizeof(int),
+                        compare_ints) != 0;
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < SEARCH_QUERIES; ++j)
+      found += bsearch(&source[j % n], sorted, n, sizeof(int),
+                       compare_ints) != 0;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == expected, "search.bsearch");
+  }
+  bench_report("search.bsearch", "queries", SEARCH_QUERIES, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < SEARCH_QUERIES; ++j) {
+      size_t k = arraylist_lower_bound(sorted, source[j % n]);
+      found += k < n && sorted[k] == source[j % n];
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == expected, "search.lower_bound");
+  }
+  bench_report("search.lower_bound", "queries", SEARCH_QUERIES, samples);
+  arraylist_free(sorted);
+  arraylist_free(samples);
+}
+
+// Scan the whole list for a value it does not hold, then count a value
+static void bench_find(const int *source, size_t n, size_t runs) {
+  double *samples = 0;
+  int *list = 0;
+  arraylist_push_n(list, source, n);
+  int missing = -1, value = source[n / 2];
+  size_t expected = 0;
+  for (size_t i = 0; i < n; ++i)
+    expected += list[i] == value;
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    size_t j = 0;
+    while (j < n && list[j] != missing)
+      ++j;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(j == n, "find.loop");
+  }
+  bench_report("find.loop", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    size_t j = arraylist_find(list, missing);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(j == n, "find.simd");
+  }
+  bench_report("find.simd", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    size_t count = 0;
+    for (size_t j = 0; j < n; ++j)
+      count += list[j] == value;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(count == expected, "count.loop");
+  }
+  bench_report("count.loop", "elements", n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    size_t count = arraylist_count(list, value);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(count == expected, "count.simd");
+  }
+  bench_report("count.simd", "elements", n, samples);
+  arraylist_free(list);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Concurrency
+//===----------------------------------------------------------------------===//
+
+typedef struct Appender {
+  const int *source;
+  size_t count;
+  ConcurrentArrayList *concurrent; // Null to append to list under lock
+  int **list;
+  mtx_t *lock;
+} Appender;
+
+static int appender_run(void *data) {
+  Appender *a = data;
+  if (a->concurrent) {
+    for (size_t i = 0; i < a->count; ++i)
+      concurrent_arraylist_push(a->concurrent, &a->source[i]);
+  } else {
+    for (size_t i = 0; i < a->count; ++i) {
+      mtx_lock(a->lock);
+      arraylist_push(*a->list, a->source[i]);
+      mtx_unlock(a->lock);
+    }
+  }
+  return 0;
+}
+
+// Append n elements split between the given number of threads, either to a
+// concurrent list or to a list guarded by a mutex
+static double append_threaded(const int *source, size_t n, size_t threads,
+                              bool concurrent) {
+  thrd_t handles[threads];
+  Appender appenders[threads];
+  ConcurrentArrayList clist;
+  concurrent_arraylist_init(&clist, sizeof(int));
+  int *list = 0;
+  mtx_t lock;
+  mtx_init(&lock, mtx_plain);
+
+  double start = bench_now_ns();
+  for (size_t i = 0; i < threads; ++i) {
+    size_t begin = n * i / threads, end = n * (i + 1) / threads;
+    appenders[i] = (Appender){.source = source + begin,
+                              .count = end - begin,
+                              .concurrent = concurrent ? &clist : 0,
+                              .list = &list,
+                              .lock = &lock};
+    bench_check(thrd_create(&handles[i], appender_run, &appenders[i]) ==
+                    thrd_success,
+                "thrd_create");
+  }
+  for (size_t i = 0; i < threads; ++i)
+    thrd_join(handles[i], 0);
+  double elapsed = bench_now_ns() - start;
+
+  long long sum = 0, expected = 0;
+  size_t size = concurrent ? concurrent_arraylist_size(&clist)
+                           : arraylist_size(list);
+  for (size_t i = 0; i < size; ++i) {
+    sum += concurrent ? concurrent_arraylist_get(&clist, int, i) : list[i];
+    expected += source[i];
+  }
+  bench_check(size == n && sum == expected,
+              concurrent ? "append_threads.lock_free"
+                         : "append_threads.mutex");
+  concurrent_arraylist_free(&clist);
+  arraylist_free(list);
+  mtx_destroy(&lock);
+  return elapsed;
+}
+
+static void bench_threads(const int *source, size_t n, size_t runs,
+                          size_t max_threads) {
+  double *samples = 0;
+  char name[64];
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    for (size_t i = 0; i < runs; ++i)
+      arraylist_push(samples, append_threaded(source, n, threads, false));
+    snprintf(name, sizeof(name), "append_threads.mutex.%zu", threads);
+    bench_report(name, "elements", n, samples);
+
+    for (size_t i = 0; i < runs; ++i)
+      arraylist_push(samples, append_threaded(source, n, threads, true));
+    snprintf(name, sizeof(name), "append_threads.lock_free.%zu", threads);
+    bench_report(name, "elements", n, samples);
+  }
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Driver
+//===----------------------------------------------------------------------===//
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --size N       elements of the lists (default %d)\n"
+          "  --runs N       runs of each benchmark (default %d)\n"
+          "  --large-mb N   megabytes of the large lists, 0 to skip (default "
+          "%d)\n"
+          "  --threads N    most appending threads, doubling from 1 (default "
+          "%d)\n",
+          program, DEFAULT_SIZE, DEFAULT_RUNS, DEFAULT_LARGE_MB,
+          DEFAULT_THREADS);
+  exit(1);
+}
+
+static size_t parse_count(const char *program, const char *arg) {
+  char *end;
+  if (!arg || !isdigit((unsigned char)*arg))
+    usage(program);
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (*end != '\0')
+    usage(program);
+  return value;
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = DEFAULT_SIZE, runs = DEFAULT_RUNS, large_mb = DEFAULT_LARGE_MB,
+         threads = DEFAULT_THREADS;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : 0;
+    if (strcmp(arg, "--size") == 0) {
+      size = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--runs") == 0) {
+      runs = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--large-mb") == 0) {
+      large_mb = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--threads") == 0) {
+      threads = parse_count(argv[0], value), ++i;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (size < RANGE_COUNT || size < LARGE_CHUNK || runs == 0)
+    usage(argv[0]);
+
+  int *source = 0;
+  arraylist_init(source, size);
+  unsigned state = 1;
+  for (size_t i = 0; i < size; ++i) {
+    state = state * 1103515245u + 12345u;
+    arraylist_push(source, (int)(state >> 8));
+  }
+
+  printf("# size=%zu runs=%zu\n", size, runs);
+  bench_report_header();
+  bench_append(source, size, runs);
+  bench_extend(source, size, runs);
+  bench_ranges(source, size, runs);
+  bench_allocators(source, size, runs);
+  bench_sort(source, size, runs);
+  bench_search(source, size, runs);
+  bench_find(source, size, runs);
+  bench_threads(source, size, runs, threads);
+  bench_large(source, large_mb, runs);
+
+  arraylist_free(source);
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include "arraylist-concurrent.h"
+
+#include "alloc-stats.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef ARRAYLIST_ABORT
+#define ARRAYLIST_ABORT() abort()
+#endif
+
+ALLOC_CATEGORY(concurrent_allocs, "arraylist.concurrent");
+
+_Static_assert((CONCURRENT_ARRAYLIST_FIRST_SEGMENT &
+                (CONCURRENT_ARRAYLIST_FIRST_SEGMENT - 1)) == 0,
+               "The first segment size must be a power of two");
+
+static int first_segment_bit(void) {
+  return __builtin_ctzll(CONCURRENT_ARRAYLIST_FIRST_SEGMENT);
+}
+
+// Segment k holds the FIRST << k elements starting at FIRST * (2^k - 1), so
+// adding FIRST to an index gives a number whose highest bit is the segment
+static size_t segment_of(size_t index, size_t *offset) {
+  size_t j = index + CONCURRENT_ARRAYLIST_FIRST_SEGMENT;
+  int high = 63 - __builtin_clzll(j);
+  *offset = j - ((size_t)1 << high);
+  return high - first_segment_bit();
+}
+
+static size_t segment_capacity(size_t segment) {
+  return (size_t)CONCURRENT_ARRAYLIST_FIRST_SEGMENT << segment;
+}
+
+static atomic_bool *segment_flags(const ConcurrentArrayList *list,
+                                  char *segment, size_t k) {
+  return (atomic_bool *)(segment + segment_capacity(k) * list->elem_size);
+}
+
+// Return segment k, allocating it if this thread is the first to need it. The
+// threads racing to install one keep the first and free their own.
+static char *segment_get(ConcurrentArrayList *list, size_t k) {
+  if (k >= CONCURRENT_ARRAYLIST_SEGMENTS)
+    ARRAYLIST_ABORT();
+  char *segment =
+      atomic_load_explicit(&list->segments[k], memory_order_acquire);
+  if (segment)
+    return segment;
+
+  size_t capacity = segment_capacity(k);
+  if (capacity > (SIZE_MAX - capacity * sizeof(atomic_bool)) / list->elem_size)
+    ARRAYLIST_ABORT(); // overflow
+  char *created = ALLOC_CALLOC(
+      concurrent_allocs, 1,
+      capacity * list->elem_size + capacity * sizeof(atomic_bool));
+  if (!created)
+    ARRAYLIST_ABORT();
+  if (atomic_compare_exchange_strong_explicit(&list->segments[k], &segment,
+                                              created, memory_order_acq_rel,
+                                              memory_order_acquire))
+    return created;
+  ALLOC_FREE(created);
+  return segment;
+}
+
+void concurrent_arraylist_init(ConcurrentArrayList *list, size_t elem_size) {
+  list->elem_size = elem_size;
+  atomic_init(&list->reserved, 0);
+  atomic_init(&list->published, 0);
+  for (size_t k = 0; k < CONCURRENT_ARRAYLIST_SEGMENTS; ++k)
+    atomic_init(&list->segments[k], 0);
+}
+
+void concurrent_arraylist_free(ConcurrentArrayList *list) {
+  for (size_t k = 0; k < CONCURRENT_ARRAYLIST_SEGMENTS; ++k) {
+    ALLOC_FREE(atomic_load_explicit(&list->segments[k], memory_order_relaxed));
+    atomic_store_explicit(&list->segments[k], 0, memory_order_relaxed);
+  }
+  atomic_store_explicit(&list->reserved, 0, memory_order_relaxed);
+  atomic_store_explicit(&list->published, 0, memory_order_relaxed);
+}
+
+void *concurrent_arraylist_reserve(ConcurrentArrayList *list, size_t *index) {
+  *index = atomic_fetch_add_explicit(&list->reserved, 1, memory_order_relaxed);
+  size_t offset, k = segment_of(*index, &offset);
+  return segment_get(list, k) + offset * list->elem_size;
+}
+
+void concurrent_arraylist_publish(ConcurrentArrayList *list, size_t index) {
+  size_t offset, k = segment_of(index, &offset);
+  char *segment =
+      atomic_load_explicit(&list->segments[k], memory_order_relaxed);
+  atomic_store_explicit(&segment_flags(list, segment, k)[offset], true,
+                        memory_order_release);
+}
+
+size_t concurrent_arraylist_push(ConcurrentArrayList *list, const void *elem) {
+  size_t index;
+  memcpy(concurrent_arraylist_reserve(list, &index), elem, list->elem_size);
+  concurrent_arraylist_publish(list, index);
+  return index;
+}
+
+// Readers move the published prefix over the elements found ready, so that
+// writers only pay for their own flag
+size_t concurrent_arraylist_size(ConcurrentArrayList *list) {
+  size_t published =
+      atomic_load_explicit(&list->published, memory_order_acquire);
+  size_t end = published, offset, k = segment_of(end, &offset);
+  char *segment =
+      atomic_load_explicit(&list->segments[k], memory_order_acquire);
+  while (segment && atomic_load_explicit(
+                        &segment_flags(list, segment, k)[offset],
+                        memory_order_acquire)) {
+    if (++offset == segment_capacity(k)) {
+      offset = 0;
+      segment = ++k < CONCURRENT_ARRAYLIST_SEGMENTS
+                    ? atomic_load_explicit(&list->segments[k],
+                                           memory_order_acquire)
+                    : 0;
+    }
+    ++end;
+  }
+  // Losing the race to another reader is fine, as long as the prefix grows
+  while (end > published &&
+         !atomic_compare_exchange_weak_explicit(&list->published, &published,
+                                                end, memory_order_release,
+                                                memory_order_acquire))
+    ;
+  return end > published ? end : published;
+}
+
+void *concurrent_arraylist_at(ConcurrentArrayList *list, size_t index) {
+  size_t offset, k = segment_of(index, &offset);
+  char *segment =
+      atomic_load_explicit(&list->segments[k], memory_order_acquire);
+  return segment + offset * list->elem_size;
+}
@@ -0,0 +1,60 @@
+//===----------------------------------------------------------------------===//
+// arraylist-concurrent - Lock-free append-only list
+//
+// Any number of threads may append to a ConcurrentArrayList at once while
+// others read it, without a mutex. Elements live in segments of exponentially
+// growing size that are never moved, so their addresses stay valid until the
+// list is freed.
+//
+// An append reserves a slot with an atomic increment, writes the element and
+// publishes it by setting its ready flag. The size of the list covers the
+// prefix of published elements, which readers may access without further
+// synchronization. Readers move that prefix forward as they find the flags of
+// the elements after it set, sparing writers any other atomic operation.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_ARRAYLIST_CONCURRENT_H
+#define INCLUDED_ARRAYLIST_CONCURRENT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Elements of the first segment, each of the next ones being twice as large.
+// Must be a power of two.
+#ifndef CONCURRENT_ARRAYLIST_FIRST_SEGMENT
+#define CONCURRENT_ARRAYLIST_FIRST_SEGMENT 64
+#endif
+
+#define CONCURRENT_ARRAYLIST_SEGMENTS 48
+
+typedef struct ConcurrentArrayList {
+  size_t elem_size;
+  atomic_size_t reserved;  // Slots handed out to writers
+  atomic_size_t published; // Slots below which every element is published
+  // Elements followed by one ready flag per element, allocated on first use
+  _Atomic(char *) segments[CONCURRENT_ARRAYLIST_SEGMENTS];
+} ConcurrentArrayList;
+
+void concurrent_arraylist_init(ConcurrentArrayList *list, size_t elem_size);
+// Must not be called while other threads use the list
+void concurrent_arraylist_free(ConcurrentArrayList *list);
+
+// Reserve the slot of a new element and return its address, storing its index
+// in index. The element must then be written and published.
+void *concurrent_arraylist_reserve(ConcurrentArrayList *list, size_t *index);
+void concurrent_arraylist_publish(ConcurrentArrayList *list, size_t index);
+
+// Append a copy of the element at elem and return its index
+size_t concurrent_arraylist_push(ConcurrentArrayList *list, const void *elem);
+
+// Number of elements up to the first one not published yet, all of which may
+// be read from any thread
+size_t concurrent_arraylist_size(ConcurrentArrayList *list);
+// Address of the element at index, which must have been reserved
+void *concurrent_arraylist_at(ConcurrentArrayList *list, size_t index);
+
+#define concurrent_arraylist_get(list, type, index)                            \
+  (*(type *)concurrent_arraylist_at((list), (index)))
+
+#endif // INCLUDED_ARRAYLIST_CONCURRENT_H
@@ -1,6 +1,93 @@
+#ifdef __linux__
+#define _GNU_SOURCE // mremap
+#endif
+
 #include "arraylist.h"
 
-void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n) {
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Heap lists reaching this many bytes are moved to anonymous mappings, which
+// grow with mremap without copying their contents and are returned to the
+// system as soon as they are freed. 0 disables mappings. Mapped lists are not
+// counted by ALLOC_STATS.
+#ifndef ARRAYLIST_MMAP_THRESHOLD
+#ifdef __linux__
+#define ARRAYLIST_MMAP_THRESHOLD (64 * 1024 * 1024)
+#else
+#define ARRAYLIST_MMAP_THRESHOLD 0
+#endif
+#endif
+
+// Ask for transparent huge pages on mapped lists, which saves TLB misses on
+// large lists at the cost of memory being committed 2 MiB at a time
+#ifndef ARRAYLIST_HUGE_PAGES
+#define ARRAYLIST_HUGE_PAGES 0
+#endif
+
+ALLOC_CATEGORY(arraylist_allocs, "arraylist");
+
+#if ARRAYLIST_MMAP_THRESHOLD
+static size_t arraylist_map_size(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) & ~(page - 1);
+}
+
+// Move or resize a list to a mapping of at least size bytes
+static ArrayList *arraylist_map(ArrayList *ptr, size_t old_size, size_t size) {
+  void *result;
+  bool moved = ptr && !ptr->mapped;
+  if (ptr && !moved) {
+    result = mremap(ptr, arraylist_map_size(old_size), arraylist_map_size(size),
+                    MREMAP_MAYMOVE);
+  } else {
+    result = mmap(0, arraylist_map_size(size), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (result == MAP_FAILED)
+    return 0;
+#if ARRAYLIST_HUGE_PAGES
+  madvise(result, arraylist_map_size(size), MADV_HUGEPAGE);
+#endif
+  if (moved) {
+    memcpy(result, ptr, old_size < size ? old_size : size);
+    ALLOC_FREE(ptr);
+  }
+  return result;
+}
+#endif
+
+// Resize the block of a list, ptr being null for a new list
+static ArrayList *arraylist_resize(const ArrayListAllocator *allocator,
+                                   ArrayList *ptr, size_t old_size,
+                                   size_t size) {
+  ArrayList *result;
+  bool mapped = false;
+  if (allocator) {
+    result = allocator->resize(allocator->context, ptr, old_size, size);
+#if ARRAYLIST_MMAP_THRESHOLD
+  } else if (size >= ARRAYLIST_MMAP_THRESHOLD || (ptr && ptr->mapped)) {
+    result = arraylist_map(ptr, old_size, size);
+    mapped = true;
+#endif
+  } else if (ptr) {
+    result = ALLOC_REALLOC(arraylist_allocs, ptr, size);
+  } else {
+    result = ALLOC_MALLOC(arraylist_allocs, size);
+  }
+  if (result)
+    result->mapped = mapped;
+  return result;
+}
+
+void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n,
+                          const ArrayListAllocator *allocator) {
   ArrayList *ptr = 0;
   size_t max = (size_t)-1 - sizeof(ArrayList);
 
@@ -9,11 +96,26 @@ void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n) {
     if (n > 0 && ptr->capacity + n > max / elem_size)
       goto fail; // overflow
 
-    ptr = realloc(ptr, sizeof(ArrayList) + elem_size * (ptr->capacity + n));
-    if (!ptr)
-      goto fail;
-
-    ptr->capacity += n;
+    size_t capacity = ptr->capacity + n;
+    if (ptr->in_storage && capacity > ptr->capacity) {
+      // Spill out of the storage of the caller
+      ArrayList *list = arraylist_resize(
+          ptr->allocator, 0, 0, sizeof(ArrayList) + elem_size * capacity);
+      if (!list)
+        goto fail;
+      memcpy(list->buffer, ptr->buffer, elem_size * ptr->size);
+      list->size = ptr->size;
+      list->allocator = ptr->allocator;
+      list->in_storage = false;
+      ptr = list;
+    } else if (!ptr->in_storage) {
+      ptr = arraylist_resize(ptr->allocator, ptr,
+                             sizeof(ArrayList) + elem_size * ptr->capacity,
+                             sizeof(ArrayList) + elem_size * capacity);
+      if (!ptr)
+        goto fail;
+    }
+    ptr->capacity = capacity;
 
     // Clamp the size to the capacity
     if (ptr->size > ptr->capacity)
@@ -22,15 +124,105 @@ void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n) {
     if ((size_t)n > max / elem_size)
       goto fail; // overflow
 
-    ptr = malloc(sizeof(ArrayList) + elem_size * n);
+    ptr = arraylist_resize(allocator, 0, 0, sizeof(ArrayList) + elem_size * n);
     if (!ptr)
       goto fail;
 
     ptr->capacity = n;
     ptr->size = 0;
+    ptr->allocator = allocator;
+    ptr->in_storage = false;
   }
   return ptr->buffer;
 fail:
   ARRAYLIST_ABORT();
   return 0;
-}
\ No newline at end of file
+}
+
+void *arraylist_storage_impl(void *storage, size_t size, size_t elem_size,
+                             const ArrayListAllocator *allocator) {
+  ArrayList *ptr = storage;
+  *ptr = (ArrayList){.capacity = (size - sizeof(ArrayList)) / elem_size,
+                     .allocator = allocator,
+                     .in_storage = true};
+  return ptr->buffer;
+}
+
+void arraylist_free_impl(void *a, size_t elem_size) {
+  ArrayList *ptr = arraylist_ptr(a);
+  if (ptr->in_storage)
+    return;
+#if ARRAYLIST_MMAP_THRESHOLD
+  if (ptr->mapped) {
+    size_t size = sizeof(ArrayList) + elem_size * ptr->capacity;
+    munmap(ptr, arraylist_map_size(size));
+    return;
+  }
+#endif
+  if (!ptr->allocator)
+    ALLOC_FREE(ptr);
+  else if (ptr->allocator->release)
+    ptr->allocator->release(ptr->allocator->context, ptr,
+                            sizeof(ArrayList) + elem_size * ptr->capacity);
+}
+
+void *arraylist_reserve_impl(void *a, size_t elem_size, size_t capacity,
+                             const ArrayListAllocator *allocator) {
+  size_t current = arraylist_capacity(a);
+  if (capacity <= current)
+    return a;
+
+  // Grow geometrically so that a sequence of reservations stays linear
+  size_t target = current > (size_t)PTRDIFF_MAX / 2 ? capacity : current * 2;
+  if (target < capacity)
+    target = capacity;
+  if (target - current > PTRDIFF_MAX)
+    ARRAYLIST_ABORT();
+  return arraylist_grow_impl(a, elem_size, (ptrdiff_t)(target - current),
+                             allocator);
+}
+
+void *arraylist_insert_impl(void *a, size_t elem_size, size_t index,
+                            const void *src, size_t n,
+                            const ArrayListAllocator *allocator) {
+  if (n == 0)
+    return a;
+  size_t size = arraylist_size(a);
+  if (index > size || size + n < size)
+    ARRAYLIST_ABORT();
+
+  // Elements copied from the list itself are found again after growing it
+  const char *buffer = a;
+  bool inside = a && src && (const char *)src >= buffer &&
+                (const char *)src < buffer + size * elem_size;
+  size_t offset = inside ? (size_t)((const char *)src - buffer) : 0;
+
+  a = arraylist_reserve_impl(a, elem_size, size + n, allocator);
+  char *at = (char *)a + index * elem_size;
+  memmove(at + n * elem_size, at, (size - index) * elem_size);
+  if (inside) {
+    // The part of the source after the insertion point was moved with it
+    size_t split = index * elem_size, bytes = n * elem_size;
+    const char *from = (char *)a + offset;
+    size_t before = offset < split ? split - offset : 0;
+    if (before > bytes)
+      before = bytes;
+    memcpy(at, from, before);
+    memcpy(at + before, from + before + bytes, bytes - before);
+  } else if (src) {
+    memcpy(at, src, n * elem_size);
+  }
+  arraylist_ptr(a)->size = size + n;
+  return a;
+}
+
+void arraylist_erase_impl(void *a, size_t elem_size, size_t index, size_t n) {
+  size_t size = arraylist_size(a);
+  if (index > size || n > size - index)
+    ARRAYLIST_ABORT();
+  if (n == 0)
+    return;
+  char *at = (char *)a + index * elem_size;
+  memmove(at, at + n * elem_size, (size - index - n) * elem_size);
+  arraylist_ptr(a)->size = size - n;
+}
@@ -6,6 +6,9 @@
 #ifndef INCLUDED_ARRAYLIST_H
 #define INCLUDED_ARRAYLIST_H
 
+#include "alloc-stats.h"
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 
@@ -17,10 +20,29 @@
 #define ARRAYLIST_ABORT() abort()
 #endif
 
+// Source of the memory of lists. resize changes the size of a block from
+// old_size to size bytes, ptr being null for a new block, and returns null on
+// failure. release may be null when blocks need not be released one by one,
+// as with an arena.
+typedef struct ArrayListAllocator {
+  void *(*resize)(void *context, void *ptr, size_t old_size, size_t size);
+  void (*release)(void *context, void *ptr, size_t size);
+  void *context;
+} ArrayListAllocator;
+
+// Allocator of the lists created in a translation unit, null standing for the
+// heap. Lists keep the allocator they were created with.
+#ifndef ARRAYLIST_ALLOCATOR
+#define ARRAYLIST_ALLOCATOR 0
+#endif
+
 typedef struct ArrayList {
   size_t capacity;
   size_t size;
-  char buffer[];
+  const ArrayListAllocator *allocator; // Null for the heap
+  bool in_storage; // Still in storage provided by arraylist_init_storage
+  bool mapped;     // Large list mapped from the system, see arraylist.c
+  _Alignas(max_align_t) char buffer[];
 } ArrayList;
 
 #define arraylist_ptr(a)                                                       \
@@ -29,7 +51,7 @@ typedef struct ArrayList {
 #define arraylist_free(a)                                                      \
   do {                                                                         \
     if ((a)) {                                                                 \
-      free(arraylist_ptr((a)));                                                \
+      arraylist_free_impl((a), sizeof(*(a)));                                  \
       (a) = 0;                                                                 \
     }                                                                          \
   } while (0)
@@ -44,20 +66,80 @@ typedef struct ArrayList {
       (a) = arraylist_grow_impl((a), sizeof(*(a)),                             \
                                 !arraylist_capacity((a))                       \
                                     ? ARRAYLIST_INIT_CAPACITY                  \
-                                    : arraylist_capacity((a)));                \
+                                    : arraylist_capacity((a)),                 \
+                                ARRAYLIST_ALLOCATOR);                          \
     }                                                                          \
     (a)[arraylist_ptr((a))->size++] = (e);                                     \
   } while (0)
 
 #define arraylist_pop(a) (a)[--arraylist_ptr((a))->size]
 
-#define arraylist_grow(a, n) ((a) = arraylist_grow_impl((a), sizeof(*(a)), n))
+#define arraylist_grow(a, n)                                                   \
+  ((a) = arraylist_grow_impl((a), sizeof(*(a)), n, ARRAYLIST_ALLOCATOR))
 
 #define arraylist_trunc(a, n)                                                  \
-  ((a) = arraylist_grow_impl((a), sizeof(*(a)), n - arraylist_capacity((a))))
+  ((a) = arraylist_grow_impl((a), sizeof(*(a)), n - arraylist_capacity((a)),   \
+                             ARRAYLIST_ALLOCATOR))
 
 #define arraylist_clear(a) ((a) ? (arraylist_ptr((a))->size = 0) : 0)
 
-void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n);
+// Allocate a list with room for exactly n elements. a must be null.
+#define arraylist_init(a, n) arraylist_init_with((a), (n), ARRAYLIST_ALLOCATOR)
+
+// Allocate a list with room for n elements from the given allocator, which
+// must outlive the list. a must be null.
+#define arraylist_init_with(a, n, allocator)                                   \
+  ((a) = arraylist_grow_impl(0, sizeof(*(a)), (n), (allocator)))
+
+// Storage for a list of up to n elements of the given type, typically declared
+// on the stack by the function owning the list
+#define arraylist_storage(type, n)                                             \
+  union {                                                                      \
+    max_align_t align;                                                         \
+    char bytes[sizeof(ArrayList) + (n) * sizeof(type)];                        \
+  }
+
+// Make a, which must be null, an empty list kept in storage until it outgrows
+// it, then moved to the allocator of the translation unit. The list must still
+// be freed, and not be used once storage goes out of scope.
+#define arraylist_init_storage(a, storage)                                     \
+  ((a) = arraylist_storage_impl(&(storage), sizeof(storage), sizeof(*(a)),     \
+                                ARRAYLIST_ALLOCATOR))
+
+// Make room for n elements in total, growing at most once
+#define arraylist_reserve(a, n)                                                \
+  ((a) = arraylist_reserve_impl((a), sizeof(*(a)), (n), ARRAYLIST_ALLOCATOR))
+
+#define arraylist_shrink_to_fit(a)                                             \
+  ((a) ? arraylist_trunc((a), arraylist_size((a))) : 0)
+
+// Insert n elements copied from src before index i, or leave them
+// uninitialized if src is null. src may point into the list itself.
+#define arraylist_insert_range(a, i, src, n)                                   \
+  ((a) = arraylist_insert_impl((a), sizeof(*(a)), (i), (src), (n),            \
+                               ARRAYLIST_ALLOCATOR))
+
+#define arraylist_push_n(a, src, n)                                            \
+  arraylist_insert_range((a), arraylist_size((a)), (src), (n))
+
+// Append the elements of the list b
+#define arraylist_extend(a, b) arraylist_push_n((a), (b), arraylist_size((b)))
+
+// Remove the n elements starting at index i
+#define arraylist_erase_range(a, i, n)                                         \
+  arraylist_erase_impl((a), sizeof(*(a)), (i), (n))
+
+// The allocator given to these functions is only used when a is null
+void *arraylist_grow_impl(void *a, size_t elem_size, ptrdiff_t n,
+                          const ArrayListAllocator *allocator);
+void *arraylist_reserve_impl(void *a, size_t elem_size, size_t capacity,
+                             const ArrayListAllocator *allocator);
+void *arraylist_insert_impl(void *a, size_t elem_size, size_t index,
+                            const void *src, size_t n,
+                            const ArrayListAllocator *allocator);
+void *arraylist_storage_impl(void *storage, size_t size, size_t elem_size,
+                             const ArrayListAllocator *allocator);
+void arraylist_free_impl(void *a, size_t elem_size);
+void arraylist_erase_impl(void *a, size_t elem_size, size_t index, size_t n);
 
 #endif // INCLUDED_ARRAYLIST_H
\ No newline at end of file
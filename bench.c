@@ -0,0 +1,45 @@
+#include "bench.h"
+
+#include "arraylist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double bench_now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void bench_report_header(void) {
+  printf("benchmark\tunit\titems\truns\tmedian_ns\tp99_ns\titems_per_s\t"
+         "ns_per_item\n");
+}
+
+void bench_report(const char *name, const char *unit, size_t items,
+                  double *samples) {
+  size_t n = arraylist_size(samples);
+  if (n == 0)
+    return;
+  qsort(samples, n, sizeof(double), compare_doubles);
+  double median =
+      n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  double p99 = samples[(99 * n + 99) / 100 - 1];
+  printf("%s\t%s\t%zu\t%zu\t%.0f\t%.0f\t%.6g\t%.4g\n", name, unit, items, n,
+         median, p99, median > 0 ? items / median * 1e9 : 0, median / items);
+  fflush(stdout);
+  arraylist_clear(samples);
+}
+
+void bench_check(bool ok, const char *name) {
+  if (!ok) {
+    fprintf(stderr, "%s produced a wrong result\n", name);
+    exit(1);
+  }
+}
@@ -0,0 +1,28 @@
+//===----------------------------------------------------------------------===//
+// bench - Timing and reporting shared by the benchmarks
+//
+// Every benchmark is run repeatedly and reported as one tab-separated line
+// holding the median and 99th percentile of its runs, so that the output of
+// two builds can be compared by a script.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_BENCH_H
+#define INCLUDED_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Wall-clock time in nanoseconds
+double bench_now_ns(void);
+
+void bench_report_header(void);
+// Print one line for a benchmark processing the given number of items in each
+// of the sampled runs, and clear the samples, an arraylist, for the next one
+void bench_report(const char *name, const char *unit, size_t items,
+                  double *samples);
+
+// Exit with an error naming the benchmark unless ok
+void bench_check(bool ok, const char *name);
+
+#endif // INCLUDED_BENCH_H
@@ -0,0 +1,929 @@
+//===----------------------------------------------------------------------===//
+// calc-bench - Benchmarks for the calc pipeline
+//
+// The calculator is included directly so that its internal functions can be
+// measured in isolation. Every benchmark is run repeatedly and reported as one
+// tab-separated line holding the median and 99th percentile of its runs, so
+// that the output of two builds can be compared by a script.
+//
+//===----------------------------------------------------------------------===//
+
+#define CALC_NO_MAIN
+#include "calc.c"
+
+#include "bench.h"
+
+#define DEFAULT_SEED 1
+#define DEFAULT_SIZE 10000
+#define DEFAULT_DEPTH 4
+#define DEFAULT_RUNS 50
+#define STREAM_CHUNK_SIZE 4096
+
+// Parse an expression that does not refer to any variable
+static Expression *parse(const char *input, size_t size, Arena *arena,
+                         Diagnostic **diagnostics) {
+  MemoryInput memory = {.data = input, .size = size};
+  Lexer lexer;
+  lexer_init(&lexer, memory_source(&memory), arena);
+  Expression *expr = parse_statement(&lexer, arena, 0, diagnostics).expr;
+  free_lexer(&lexer);
+  return expr;
+}
+
+static size_t count_nodes(const Expression *expr) {
+  ExprWalk walk = {0};
+  size_t count = 0;
+  expr_walk_start(&walk, expr);
+  while (expr_walk_next(&walk))
+    ++count;
+  free_expr_walk(&walk);
+  return count;
+}
+
+//===----------------------------------------------------------------------===//
+// Expression generator
+//===----------------------------------------------------------------------===//
+
+// Largest magnitude of any value computed by a generated expression, which
+// keeps every evaluator on its machine integer path
+#define GEN_BOUND (1 << 20)
+#define GEN_PAREN_PERCENT 20 // Chance of an operand being parenthesized
+#define GEN_MAX_GROUP 16     // Most operands inside a pair of parentheses
+
+enum { MIX_ADD, MIX_SUB, MIX_MUL, MIX_DIV, MIX_NEG, MIX_COUNT };
+
+typedef struct Generator {
+  uint64_t state;
+  unsigned mix[MIX_COUNT]; // Relative weights of the operators
+  char *text;
+} Generator;
+
+// splitmix64, so that a seed gives the same expressions everywhere
+static uint64_t gen_next(Generator *g) {
+  uint64_t z = (g->state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static size_t gen_below(Generator *g, size_t n) { return gen_next(g) % n; }
+
+static bool gen_chance(Generator *g, unsigned weight, unsigned total) {
+  return total > 0 && gen_below(g, total) < weight;
+}
+
+static void gen_emit(Generator *g, const char *s) {
+  for (; *s; ++s)
+    arraylist_push(g->text, *s);
+}
+
+static int64_t gen_sum(Generator *g, size_t depth, size_t count);
+
+// Emit an integer literal or a parenthesized sum using at most the available
+// number of operands, and return its value
+static int64_t gen_factor(Generator *g, size_t depth, size_t available,
+                          size_t *used) {
+  if (depth > 0 && available >= 2 && gen_below(g, 100) < GEN_PAREN_PERCENT) {
+    size_t max = available < GEN_MAX_GROUP ? available : GEN_MAX_GROUP;
+    *used = 2 + gen_below(g, max - 1);
+    gen_emit(g, "(");
+    int64_t value = gen_sum(g, depth - 1, *used);
+    gen_emit(g, ")");
+    return value;
+  }
+  char buf[12]; // Room for any int
+  int value = 1 + (int)gen_below(g, 99);
+  snprintf(buf, sizeof(buf), "%d", value);
+  gen_emit(g, buf);
+  *used = 1;
+  return value;
+}
+
+// Emit a product. Negation only ever starts one, since -a*b is -(a*b). The
+// product ends early rather than leave the bounds, and only divides by
+// literals that divide it exactly.
+static int64_t gen_term(Generator *g, size_t depth, size_t available,
+                        size_t *used) {
+  const unsigned *w = g->mix;
+  unsigned binary = w[MIX_ADD] + w[MIX_SUB] + w[MIX_MUL] + w[MIX_DIV];
+  bool negate = gen_chance(g, w[MIX_NEG], binary + w[MIX_NEG]);
+  if (negate)
+    gen_emit(g, "-");
+
+  int64_t value = gen_factor(g, depth, available, used);
+  while (*used < available &&
+         gen_chance(g, w[MIX_MUL] + w[MIX_DIV], binary)) {
+    if (gen_chance(g, w[MIX_DIV], w[MIX_MUL] + w[MIX_DIV])) {
+      int divisors[9], count = 0;
+      for (int d = 1; d <= 9; ++d) {
+        if (value % d == 0)
+          divisors[count++] = d;
+      }
+      int divisor = divisors[gen_below(g, count)];
+      char buf[4];
+      snprintf(buf, sizeof(buf), "/%d", divisor);
+      gen_emit(g, buf);
+      value /= divisor;
+      *used += 1;
+      continue;
+    }
+
+    size_t mark = arraylist_size(g->text), n;
+    gen_emit(g, "*");
+    int64_t factor = gen_factor(g, depth, available - *used, &n);
+    if (llabs(value * factor) > GEN_BOUND) {
+      arraylist_ptr(g->text)->size = mark;
+      break;
+    }
+    value *= factor;
+    *used += n;
+  }
+  return negate ? -value : value;
+}
+
+// Emit a sum of exactly count operands. The operator before each term is
+// flipped whenever it would take the sum out of bounds.
+static int64_t gen_sum(Generator *g, size_t depth, size_t count) {
+  int64_t value = 0;
+  size_t used = 0;
+  while (used < count) {
+    size_t op = arraylist_size(g->text), n;
+    if (used > 0)
+      gen_emit(g, "+");
+    bool subtract =
+        gen_chance(g, g->mix[MIX_SUB], g->mix[MIX_ADD] + g->mix[MIX_SUB]);
+    int64_t term = gen_term(g, depth, count - used, &n);
+    if (used == 0) {
+      value = term;
+    } else {
+      if (llabs(subtract ? value - term : value + term) > GEN_BOUND)
+        subtract = !subtract;
+      g->text[op] = subtract ? '-' : '+';
+      value = subtract ? value - term : value + term;
+    }
+    used += n;
+  }
+  return value;
+}
+
+// Generate a NUL-terminated expression with the given number of operands and
+// nesting depth of parentheses, storing its value in expected
+static char *generate_expression(uint64_t seed, size_t size, size_t depth,
+                                 const unsigned mix[MIX_COUNT],
+                                 int64_t *expected) {
+  Generator g = {.state = seed};
+  memcpy(g.mix, mix, sizeof(g.mix));
+  *expected = gen_sum(&g, depth, size);
+  arraylist_push(g.text, '\0');
+  return g.text;
+}
+
+// Parse "add,sub,mul,div,neg" weights into mix
+static bool parse_mix(const char *s, unsigned mix[MIX_COUNT]) {
+  unsigned total = 0;
+  for (size_t i = 0; i < MIX_COUNT; ++i) {
+    char *end;
+    unsigned long weight = strtoul(s, &end, 10);
+    if (end == s || weight > 1000 || *end != (i + 1 < MIX_COUNT ? ',' : '\0'))
+      return false;
+    mix[i] = (unsigned)weight;
+    total += mix[i];
+    s = end + 1;
+  }
+  return total > mix[MIX_NEG];
+}
+
+//===----------------------------------------------------------------------===//
+// Pipeline
+//===----------------------------------------------------------------------===//
+
+// Lex the whole line, which is what parsing costs on top of building the tree
+static size_t bench_tokenize(const char *line, const Classifier *classifier,
+                             size_t runs, double **samples) {
+  Arena arena = {0};
+  size_t count = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    MemoryInput input = {.data = line, .size = strlen(line)};
+    double start = bench_now_ns();
+    Lexer lexer;
+    lexer_init(&lexer, memory_source(&input), &arena);
+    lexer.classifier = classifier;
+    for (count = 0; lexer.token.type != TOKEN_EOF; ++count)
+      lexer_next(&lexer);
+    free_lexer(&lexer);
+    arraylist_push(*samples, bench_now_ns() - start);
+    arena_reset(&arena);
+  }
+  arena_free(&arena);
+  return count;
+}
+
+// Time parsing, which includes lexing, and freeing the tree, either reusing a
+// single arena across runs like the REPL does or starting from a fresh one
+static void bench_parse(const char *line, size_t node_count, size_t runs,
+                        double **samples) {
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  double *free_samples = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    parse(line, strlen(line), &arena, &diagnostics);
+    double middle = bench_now_ns();
+    arena_reset(&arena);
+    arraylist_push(*samples, middle - start);
+    arraylist_push(free_samples, bench_now_ns() - middle);
+  }
+  bench_report("parse", "nodes", node_count, *samples);
+  bench_report("free", "nodes", node_count, free_samples);
+
+  arena_free(&arena);
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    parse(line, strlen(line), &arena, &diagnostics);
+    double middle = bench_now_ns();
+    arena_free(&arena);
+    arraylist_push(*samples, middle - start);
+    arraylist_push(free_samples, bench_now_ns() - middle);
+  }
+  bench_report("parse.fresh_arena", "nodes", node_count, *samples);
+  bench_report("free.fresh_arena", "nodes", node_count, free_samples);
+
+  arraylist_free(free_samples);
+  arraylist_free(diagnostics);
+}
+
+// Streams are read a chunk at a time, unlike the lines of calc which are
+// always read whole before being lexed
+typedef struct FileInput {
+  FILE *file;
+  char buffer[STREAM_CHUNK_SIZE];
+} FileInput;
+
+static bool file_next_chunk(void *context, const char **data, size_t *size) {
+  FileInput *input = context;
+  size_t n = fread(input->buffer, 1, sizeof(input->buffer), input->file);
+  if (n == 0)
+    return false;
+  *data = input->buffer;
+  *size = n;
+  return true;
+}
+
+static InputSource file_source(FileInput *input) {
+  return (InputSource){.next_chunk = file_next_chunk, .context = input};
+}
+
+// Time parsing the line when it is read from a stream in small chunks, as
+// opposed to being handed to the lexer as a whole
+static void bench_stream(const char *line, size_t runs, double **samples) {
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  FileInput *input = malloc(sizeof(FileInput));
+  if (!input)
+    die("Failed to allocate memory");
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    input->file = fmemopen((char *)line, strlen(line), "r");
+    if (!input->file)
+      die("Failed to open the line as a stream");
+    Lexer lexer;
+    lexer_init(&lexer, file_source(input), &arena);
+    parse_statement(&lexer, &arena, 0, &diagnostics);
+    free_lexer(&lexer);
+    fclose(input->file);
+    arraylist_push(*samples, bench_now_ns() - start);
+    arena_reset(&arena);
+  }
+  free(input);
+  arena_free(&arena);
+  arraylist_free(diagnostics);
+}
+
+// Time evaluation alone, the tree being built once beforehand
+static void bench_tree(const Expression *expr, int64_t expected, size_t runs,
+                       double **samples) {
+  Evaluator ev = {0};
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    Number n = eval(&ev, expr);
+    arraylist_push(*samples, bench_now_ns() - start);
+    if (n.type != NUMBER_INTEGER || n.integer != expected) {
+      fprintf(stderr, "The evaluator disagrees with the generator\n");
+      exit(1);
+    }
+  }
+  free_evaluator(&ev);
+}
+
+// Time the parallel evaluator with 1 to max_threads threads, doubling the
+// count each time
+static void bench_parallel(const char *prefix, const Expression *expr,
+                           int64_t expected, size_t node_count,
+                           size_t max_threads, size_t runs, double **samples) {
+  for (size_t threads = 1;; threads *= 2) {
+    if (threads > max_threads)
+      threads = max_threads;
+    ForkPool *pool = fork_pool_create(threads);
+    for (size_t i = 0; i < runs; ++i) {
+      const char *error;
+      double start = bench_now_ns();
+      Number n = parallel_eval(pool, expr, 0, &error);
+      arraylist_push(*samples, bench_now_ns() - start);
+      if (error || n.type != NUMBER_INTEGER || n.integer != expected) {
+        fprintf(stderr, "Parallel evaluation disagrees with the generator\n");
+        exit(1);
+      }
+    }
+    fork_pool_free(pool);
+    char name[32];
+    snprintf(name, sizeof(name), "%seval.parallel.%zu", prefix, threads);
+    bench_report(name, "nodes", node_count, *samples);
+    if (threads == max_threads)
+      break;
+  }
+}
+
+// Return the memory used by the nodes of a flat tree, in bytes
+static size_t flat_size(const FlatTree *t) {
+  return arraylist_size(t->ops) *
+             (sizeof(*t->ops) + sizeof(*t->lhs) + sizeof(*t->rhs) +
+              sizeof(*t->values)) +
+         arraylist_size(t->elements) * sizeof(*t->elements) +
+         arraylist_size(t->extras) * sizeof(*t->extras);
+}
+
+// Time flattening and evaluating the flat tree, then report the memory taken
+// by both forms, that of the tree being what its arena holds
+static void bench_flat(const Expression *expr, const Arena *arena,
+                       int64_t expected, size_t node_count, size_t runs,
+                       double **samples) {
+  FlatTree flat = {0};
+  Evaluator ev = {0};
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    if (!flat_build(&flat, &ev.walk, expr, 0))
+      die("Failed to flatten the generated expression");
+    arraylist_push(*samples, bench_now_ns() - start);
+  }
+  bench_report("flatten", "nodes", node_count, *samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    Number n = flat_eval(&ev, &flat);
+    arraylist_push(*samples, bench_now_ns() - start);
+    if (n.type != NUMBER_INTEGER || n.integer != expected) {
+      fprintf(stderr, "The flat evaluator disagrees with the generator\n");
+      exit(1);
+    }
+  }
+  bench_report("eval.flat", "nodes", node_count, *samples);
+
+  size_t tree_bytes = 0;
+  for (ArenaBlock *b = arena->first; b; b = b->next) {
+    tree_bytes += b->used;
+    if (b == arena->curr)
+      break;
+  }
+  size_t flat_bytes = flat_size(&flat);
+  printf("# memory nodes=%zu tree_bytes=%zu flat_bytes=%zu "
+         "tree_bytes_per_node=%.2f flat_bytes_per_node=%.2f\n",
+         node_count, tree_bytes, flat_bytes, (double)tree_bytes / node_count,
+         (double)flat_bytes / node_count);
+  free_flat_tree(&flat);
+  free_evaluator(&ev);
+}
+
+// Time the optimizer, each run allocating its rewritten nodes in a fresh arena,
+// then check the flat evaluation of the result and report how much it shrank
+static void bench_optimize(const Expression *expr, int64_t expected,
+                           size_t node_count, size_t runs, double **samples) {
+  Optimizer opt = {0};
+  Arena arena = {0};
+  Expression *result = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    arena_reset(&arena);
+    double start = bench_now_ns();
+    result = optimize(&opt, &arena, expr);
+    arraylist_push(*samples, bench_now_ns() - start);
+  }
+  bench_report("optimize", "nodes", node_count, *samples);
+
+  FlatTree flat = {0};
+  Evaluator ev = {0};
+  if (!flat_build(&flat, &ev.walk, result, &opt.nodes))
+    die("Failed to flatten the optimized expression");
+  Number n = flat_eval(&ev, &flat);
+  if (n.type != NUMBER_INTEGER || n.integer != expected) {
+    fprintf(stderr, "The optimized expression disagrees with the generator\n");
+    exit(1);
+  }
+  printf("# optimize nodes=%zu optimized_nodes=%zu\n", node_count,
+         opt_count_nodes(&opt, result));
+  free_flat_tree(&flat);
+  free_evaluator(&ev);
+  free_optimizer(&opt);
+  arena_free(&arena);
+}
+
+static void bench_vm(const Program *program, int64_t expected, size_t runs,
+                     double **samples) {
+  int *stack = 0;
+  arraylist_grow(stack, program->max_stack);
+  for (size_t i = 0; i < runs; ++i) {
+    int value = 0;
+    double start = bench_now_ns();
+    bool ok = run(program, stack, 0, &value);
+    arraylist_push(*samples, bench_now_ns() - start);
+    if (!ok || value != expected) {
+      fprintf(stderr, "The interpreter disagrees with the generator\n");
+      exit(1);
+    }
+  }
+  arraylist_free(stack);
+}
+
+static void bench_jit(const JitCode *jit, size_t max_stack, int64_t expected,
+                      size_t runs, double **samples) {
+  int *stack = 0;
+  arraylist_grow(stack, max_stack);
+  for (size_t i = 0; i < runs; ++i) {
+    int value = 0;
+    double start = bench_now_ns();
+    bool ok = jit->function(0, stack, &value);
+    arraylist_push(*samples, bench_now_ns() - start);
+    if (!ok || value != expected) {
+      fprintf(stderr, "Native code disagrees with the generator\n");
+      exit(1);
+    }
+  }
+  arraylist_free(stack);
+}
+
+static void bench_pipeline(const char *line, int64_t expected,
+                           size_t max_threads, size_t runs) {
+  double *samples = 0;
+  size_t token_count =
+      bench_tokenize(line, char_classifier(), runs, &samples);
+  bench_report("tokenize", "tokens", token_count, samples);
+
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  Expression *expr = parse(line, strlen(line), &arena, &diagnostics);
+  if (arraylist_size(diagnostics) > 0)
+    die("Failed to parse the generated expression");
+  size_t node_count = count_nodes(expr);
+
+  bench_parse(line, node_count, runs, &samples);
+  bench_stream(line, runs, &samples);
+  bench_report("parse.stream", "nodes", node_count, samples);
+
+  bench_tree(expr, expected, runs, &samples);
+  bench_report("eval.tree", "nodes", node_count, samples);
+  bench_parallel("", expr, expected, node_count, max_threads, runs, &samples);
+  bench_flat(expr, &arena, expected, node_count, runs, &samples);
+  bench_optimize(expr, expected, node_count, runs, &samples);
+
+  Program program = {0};
+  ExprWalk walk = {0};
+  for (size_t i = 0; i < runs; ++i) {
+    free_program(&program);
+    double start = bench_now_ns();
+    if (!compile(&program, &walk, expr))
+      die("Failed to compile the generated expression");
+    arraylist_push(samples, bench_now_ns() - start);
+  }
+  bench_report("compile", "nodes", node_count, samples);
+  bench_vm(&program, expected, runs, &samples);
+  bench_report("eval.vm", "nodes", node_count, samples);
+
+  JitCode jit;
+  if (jit_compile(&jit, &program)) {
+    bench_jit(&jit, program.max_stack, expected, runs, &samples);
+    bench_report("eval.jit", "nodes", node_count, samples);
+    jit_free(&jit);
+  }
+
+  free_program(&program);
+  free_expr_walk(&walk);
+  arena_free(&arena);
+  arraylist_free(diagnostics);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Balanced trees
+//===----------------------------------------------------------------------===//
+
+// Expressions generated from the command line are long chains of terms, which
+// leave the parallel evaluator little to split. A balanced tree is the other
+// extreme.
+#define BALANCED_BENCH_RUNS 10
+#define BALANCED_BENCH_LEVELS 20
+
+// Append a tree of 2^levels products of two digits joined by alternating
+// sums and differences, returning its value
+static int64_t generate_balanced(char **line, size_t levels, size_t *index) {
+  char buf[8];
+  if (levels == 0) {
+    int a = *index % 9 + 1, b = *index / 9 % 9 + 1;
+    ++*index;
+    snprintf(buf, sizeof(buf), "%d*%d", a, b);
+    for (const char *c = buf; *c; ++c)
+      arraylist_push(*line, *c);
+    return a * b;
+  }
+  bool subtract = levels % 2;
+  arraylist_push(*line, '(');
+  int64_t lhs = generate_balanced(line, levels - 1, index);
+  arraylist_push(*line, ')');
+  arraylist_push(*line, subtract ? '-' : '+');
+  arraylist_push(*line, '(');
+  int64_t rhs = generate_balanced(line, levels - 1, index);
+  arraylist_push(*line, ')');
+  return subtract ? lhs - rhs : lhs + rhs;
+}
+
+static void bench_balanced(size_t max_threads, size_t runs) {
+  if (runs > BALANCED_BENCH_RUNS)
+    runs = BALANCED_BENCH_RUNS;
+  char *line = 0;
+  size_t index = 0;
+  int64_t expected = generate_balanced(&line, BALANCED_BENCH_LEVELS, &index);
+  arraylist_push(line, '\0');
+
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  Expression *expr = parse(line, strlen(line), &arena, &diagnostics);
+  size_t node_count = count_nodes(expr);
+  double *samples = 0;
+  bench_tree(expr, expected, runs, &samples);
+  bench_report("balanced.eval.tree", "nodes", node_count, samples);
+  bench_parallel("balanced.", expr, expected, node_count, max_threads, runs,
+                 &samples);
+
+  arraylist_free(samples);
+  arena_free(&arena);
+  arraylist_free(diagnostics);
+  arraylist_free(line);
+}
+
+//===----------------------------------------------------------------------===//
+// Vector kernels
+//===----------------------------------------------------------------------===//
+
+#define VECTOR_BENCH_SIZE (1 << 20)
+
+// Time a * b + c - 7 over whole columns with the given kernels, checking the
+// result against the scalar ones
+static void bench_kernels(const char *name, const VectorKernels *kernels,
+                          const int *a, const int *b, const int *c, int *dst,
+                          const int *expected, size_t n, size_t runs) {
+  double *samples = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    kernels->vector[BINARY_OP_MUL](dst, a, b, n);
+    kernels->vector[BINARY_OP_ADD](dst, dst, c, n);
+    kernels->left[BINARY_OP_SUB](dst, dst, 7, n);
+    arraylist_push(samples, bench_now_ns() - start);
+  }
+  if (expected && memcmp(dst, expected, n * sizeof(int)) != 0) {
+    fprintf(stderr, "%s kernels disagree with scalar ones\n", kernels->name);
+    exit(1);
+  }
+  bench_report(name, "elements", n, samples);
+  arraylist_free(samples);
+}
+
+static void bench_vectors(size_t runs) {
+  size_t n = VECTOR_BENCH_SIZE;
+  int *buffers = malloc(5 * n * sizeof(int));
+  if (!buffers)
+    die("Failed to allocate memory");
+  int *a = buffers, *b = a + n, *c = b + n, *dst = c + n, *expected = dst + n;
+  unsigned state = 1;
+  for (size_t i = 0; i < 3 * n; ++i) {
+    state = state * 1103515245u + 12345u;
+    buffers[i] = (int)(state >> 8);
+  }
+
+  bench_kernels("kernels.scalar", &scalar_kernels, a, b, c, expected, 0, n,
+                runs);
+#if CALC_SSE2
+  bench_kernels("kernels.sse2", &sse2_kernels, a, b, c, dst, expected, n,
+                runs);
+#if CALC_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    bench_kernels("kernels.avx2", &avx2_kernels, a, b, c, dst, expected, n,
+                  runs);
+#endif
+#endif
+  free(buffers);
+}
+
+//===----------------------------------------------------------------------===//
+// Big numbers
+//===----------------------------------------------------------------------===//
+
+#define BIGNUM_BENCH_RUNS 20
+#define BIGNUM_BENCH_LIMBS 4096
+
+// Time parsing and evaluating a line made of the given number of items
+static void bench_line(const char *name, const char *line, const char *unit,
+                       size_t items, size_t runs) {
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  Evaluator ev = {0};
+  double *samples = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    Number n = eval(&ev, parse(line, strlen(line), &arena, &diagnostics));
+    free_number(&n);
+    arena_reset(&arena);
+    arraylist_push(samples, bench_now_ns() - start);
+  }
+  bench_report(name, unit, items, samples);
+  arraylist_free(samples);
+  arena_free(&arena);
+  arraylist_free(diagnostics);
+  free_evaluator(&ev);
+}
+
+// Join the given number of operands produced by format, which is passed the
+// index of each one, starting from 1
+static char *generate_join(const char *format, size_t count) {
+  char *line = 0;
+  for (size_t i = 1; i <= count; ++i) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), format, i);
+    for (int j = i > 1 ? 0 : 1; j < len; ++j)
+      arraylist_push(line, buf[j]);
+  }
+  arraylist_push(line, '\0');
+  return line;
+}
+
+static void bench_mul(const char *name, const uint32_t *a, const uint32_t *b,
+                      size_t n, bool karatsuba, size_t runs) {
+  uint32_t *r = mag_alloc(2 * n);
+  double *samples = 0;
+  for (size_t i = 0; i < runs; ++i) {
+    double start = bench_now_ns();
+    if (karatsuba)
+      mag_mul(r, a, n, b, n);
+    else
+      mag_mul_schoolbook(r, a, n, b, n);
+    arraylist_push(samples, bench_now_ns() - start);
+  }
+  bench_report(name, "products", 1, samples);
+  arraylist_free(samples);
+  ALLOC_FREE(r);
+}
+
+static void bench_bignums(size_t runs) {
+  if (runs > BIGNUM_BENCH_RUNS)
+    runs = BIGNUM_BENCH_RUNS;
+  char *factorial = generate_join("*%zu", 1000);
+  bench_line("bignum.factorial_1000", factorial, "lines", 1, runs);
+  arraylist_free(factorial);
+  char *harmonic = generate_join("+1/%zu", 200);
+  bench_line("bignum.harmonic_200", harmonic, "lines", 1, runs);
+  arraylist_free(harmonic);
+
+  size_t n = BIGNUM_BENCH_LIMBS;
+  uint32_t *a = mag_alloc(2 * n), *b = a + n;
+  unsigned state = 1;
+  for (size_t i = 0; i < 2 * n; ++i) {
+    state = state * 1103515245u + 12345u;
+    a[i] = state;
+  }
+  bench_mul("bignum.mul_4096.schoolbook", a, b, n, false, runs);
+  bench_mul("bignum.mul_4096.karatsuba", a, b, n, true, runs);
+  ALLOC_FREE(a);
+}
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+#define LEXER_BENCH_OPERANDS 100000
+
+static void bench_classifier(const char *prefix, const char *line,
+                             const Classifier *classifier, size_t runs) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%s", prefix, classifier->name);
+  double *samples = 0;
+  size_t token_count = bench_tokenize(line, classifier, runs, &samples);
+  bench_report(name, "tokens", token_count, samples);
+  arraylist_free(samples);
+}
+
+// Time tokenizing with each classifier supported by the CPU, both on the
+// generated line and on one made of wide numbers separated by runs of spaces
+static void bench_lexers(const char *line, size_t runs) {
+  char *wide = generate_join("+    %09zu", LEXER_BENCH_OPERANDS);
+  const char *const prefixes[] = {"tokenize.generated", "tokenize.wide"};
+  const char *const lines[] = {line, wide};
+  for (size_t i = 0; i < 2; ++i) {
+    bench_classifier(prefixes[i], lines[i], &scalar_classifier, runs);
+#if CALC_SSE2
+    bench_classifier(prefixes[i], lines[i], &sse2_classifier, runs);
+#if CALC_AVX2
+    if (__builtin_cpu_supports("avx2"))
+      bench_classifier(prefixes[i], lines[i], &avx2_classifier, runs);
+#endif
+#endif
+  }
+  arraylist_free(wide);
+}
+
+//===----------------------------------------------------------------------===//
+// Deep nesting
+//===----------------------------------------------------------------------===//
+
+#define DEEP_BENCH_RUNS 3
+#define DEEP_BENCH_LEVELS 1000000
+
+// Build a line nesting the given number of levels, each made of prefix before
+// the innermost operand and suffix after it
+static char *generate_nested(const char *prefix, const char *suffix,
+                             size_t levels) {
+  char *line = 0;
+  for (size_t i = 0; i < levels; ++i) {
+    for (const char *c = prefix; *c; ++c)
+      arraylist_push(line, *c);
+  }
+  arraylist_push(line, '1');
+  for (size_t i = 0; i < levels; ++i) {
+    for (const char *c = suffix; *c; ++c)
+      arraylist_push(line, *c);
+  }
+  arraylist_push(line, '\0');
+  return line;
+}
+
+// Time evaluating a nested line once parsed, with the tree walker, the
+// interpreter and native code, each reported under name suffixed with the
+// evaluator
+static void bench_deep_eval(const char *name, const char *line, size_t runs) {
+  Arena arena = {0};
+  Diagnostic *diagnostics = 0;
+  Expression *expr = parse(line, strlen(line), &arena, &diagnostics);
+  if (arraylist_size(diagnostics) > 0)
+    die("Failed to parse the nested expression");
+  Evaluator ev = {0};
+  Number n = eval(&ev, expr);
+  if (n.type != NUMBER_INTEGER)
+    die("Failed to evaluate the nested expression");
+  int64_t expected = n.integer;
+  free_evaluator(&ev);
+
+  char full_name[64];
+  double *samples = 0;
+  bench_tree(expr, expected, runs, &samples);
+  snprintf(full_name, sizeof(full_name), "%s.tree", name);
+  bench_report(full_name, "levels", DEEP_BENCH_LEVELS, samples);
+
+  Program program = {0};
+  ExprWalk walk = {0};
+  if (!compile(&program, &walk, expr))
+    die("Failed to compile the nested expression");
+  bench_vm(&program, expected, runs, &samples);
+  snprintf(full_name, sizeof(full_name), "%s.vm", name);
+  bench_report(full_name, "levels", DEEP_BENCH_LEVELS, samples);
+
+  JitCode jit;
+  if (jit_compile(&jit, &program)) {
+    bench_jit(&jit, program.max_stack, expected, runs, &samples);
+    snprintf(full_name, sizeof(full_name), "%s.jit", name);
+    bench_report(full_name, "levels", DEEP_BENCH_LEVELS, samples);
+    jit_free(&jit);
+  }
+
+  free_program(&program);
+  free_expr_walk(&walk);
+  arena_free(&arena);
+  arraylist_free(diagnostics);
+  arraylist_free(samples);
+}
+
+// Nesting this deep overflows the C stack of a recursive parser. Shapes leaving
+// a deep tree of integers are also evaluated on their own, which excludes
+// parentheses, parsed to a single node, and vectors, which are not compiled.
+static void bench_deep(size_t runs) {
+  static const struct {
+    const char *name, *prefix, *suffix;
+    bool evaluated;
+  } shapes[] = {
+      {"deep.parentheses", "(", ")", false},
+      {"deep.signs", "- ", "", true},
+      {"deep.right_chain", "1-(", ")", true},
+      {"deep.vectors", "[", "]", false},
+  };
+  if (runs > DEEP_BENCH_RUNS)
+    runs = DEEP_BENCH_RUNS;
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+    char *line = generate_nested(shapes[i].prefix, shapes[i].suffix,
+                                 DEEP_BENCH_LEVELS);
+    bench_line(shapes[i].name, line, "levels", DEEP_BENCH_LEVELS, runs);
+    if (shapes[i].evaluated)
+      bench_deep_eval(shapes[i].name, line, runs);
+    arraylist_free(line);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Main
+//===----------------------------------------------------------------------===//
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --seed N       seed of the expression generator (default %d)\n"
+          "  --size N       operands in the expression (default %d)\n"
+          "  --depth N      nesting of parentheses (default %d)\n"
+          "  --mix A,S,M,D,N\n"
+          "                 weights of +, -, *, / and negation "
+          "(default 4,2,2,1,1)\n"
+          "  --runs N       runs of each benchmark (default %d)\n"
+          "  --threads N    most threads of the parallel evaluator (default: "
+          "all cores)\n"
+          "  --pipeline     only benchmark the expression pipeline\n"
+          "  --print        print the expression and exit\n",
+          program, DEFAULT_SEED, DEFAULT_SIZE, DEFAULT_DEPTH, DEFAULT_RUNS);
+  exit(1);
+}
+
+static size_t parse_count(const char *program, const char *arg) {
+  char *end;
+  if (!arg || !isdigit((unsigned char)*arg))
+    usage(program);
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (*end != '\0')
+    usage(program);
+  return value;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = DEFAULT_SEED;
+  size_t size = DEFAULT_SIZE, depth = DEFAULT_DEPTH, runs = DEFAULT_RUNS;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = cores > 0 ? cores : 1;
+  unsigned mix[MIX_COUNT] = {4, 2, 2, 1, 1};
+  bool pipeline_only = false, print_only = false;
+#ifdef ALLOC_STATS
+  alloc_stats_print_at_exit();
+#endif
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : 0;
+    if (strcmp(arg, "--seed") == 0) {
+      seed = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--size") == 0) {
+      size = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--depth") == 0) {
+      depth = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--threads") == 0) {
+      max_threads = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--runs") == 0) {
+      runs = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--mix") == 0) {
+      if (!value || !parse_mix(value, mix))
+        usage(argv[0]);
+      ++i;
+    } else if (strcmp(arg, "--pipeline") == 0) {
+      pipeline_only = true;
+    } else if (strcmp(arg, "--print") == 0) {
+      print_only = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (size == 0 || runs == 0 || max_threads == 0)
+    usage(argv[0]);
+
+  int64_t expected;
+  char *line = generate_expression(seed, size, depth, mix, &expected);
+  if (print_only) {
+    printf("%s\n", line);
+    arraylist_free(line);
+    return 0;
+  }
+
+  printf("# seed=%llu size=%zu depth=%zu mix=%u,%u,%u,%u,%u runs=%zu "
+         "threads=%zu bytes=%zu\n",
+         (unsigned long long)seed, size, depth, mix[MIX_ADD], mix[MIX_SUB],
+         mix[MIX_MUL], mix[MIX_DIV], mix[MIX_NEG], runs, max_threads,
+         strlen(line));
+  bench_report_header();
+  bench_pipeline(line, expected, max_threads, runs);
+  if (!pipeline_only) {
+    bench_balanced(max_threads, runs);
+    bench_vectors(runs);
+    bench_bignums(runs);
+    bench_lexers(line, runs);
+    bench_deep(runs);
+  }
+
+  arraylist_free(line);
+  return 0;
+}
@@ -1,11 +1,65 @@
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
 
+#if !defined(CALC_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) &&    \
+    defined(__SSE2__)
+#define CALC_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define CALC_AVX2 1
+#define AVX2 __attribute__((__target__("avx2")))
+#else
+#define CALC_AVX2 0
+#endif
+#else
+#define CALC_SSE2 0
+#define CALC_AVX2 0
+#endif
+
+#if defined(__linux__) && !defined(CALC_NO_SERVER)
+#define CALC_SERVER 1
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#else
+#define CALC_SERVER 0
+#endif
+
+#if defined(__linux__) && !defined(CALC_NO_PERF)
+#define CALC_PERF 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#else
+#define CALC_PERF 0
+#endif
+
+#include "alloc-stats.h"
 #include "arraylist.h"
 
+// calc-bench and libcalc include this file with CALC_NO_MAIN defined, leaving
+// out the command-line program. libcalc also defines CALC_LIBRARY, leaving out
+// what only the program and the benchmarks use, while what only the program and
+// the library use is left out of the benchmarks.
+
 //===----------------------------------------------------------------------===//
 // Common
 //===----------------------------------------------------------------------===//
@@ -20,6 +74,20 @@
 #define NO_RETURN
 #endif
 
+static uint64_t hash_bytes(const char *data, size_t size) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  uint64_t word = 0;
+  memcpy(&word, data, size);
+  h = (h ^ word) * 0x94d049bb133111ebull;
+  return h ^ (h >> 29);
+}
+
 //===----------------------------------------------------------------------===//
 // Error handling
 //===----------------------------------------------------------------------===//
@@ -51,6 +119,490 @@ NO_RETURN static void die(const char *msg) {
   exit(1);
 }
 
+//===----------------------------------------------------------------------===//
+// Memory
+//===----------------------------------------------------------------------===//
+
+#ifndef ARENA_BLOCK_SIZE
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+ALLOC_CATEGORY(arena_allocs, "arena");
+
+// Blocks are kept around when the arena is reset so that, once warmed up, an
+// arena serves every subsequent line without touching the system allocator.
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t capacity;
+  size_t used;
+  max_align_t data[];
+} ArenaBlock;
+
+typedef struct Arena {
+  ArenaBlock *first;
+  ArenaBlock *curr;
+  size_t block_count; // Number of blocks obtained from the system allocator
+} Arena;
+
+static void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+  // Blocks after the current one are left over from before the last reset and
+  // are recycled in order
+  ArenaBlock *prev = 0;
+  ArenaBlock *block = arena->curr;
+  while (block && block->capacity - block->used < size) {
+    prev = block;
+    block = block->next;
+    if (block)
+      block->used = 0;
+  }
+
+  if (!block) {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = ALLOC_MALLOC(arena_allocs, sizeof(ArenaBlock) + capacity);
+    if (!block)
+      die("Failed to allocate memory");
+    block->next = 0;
+    block->capacity = capacity;
+    block->used = 0;
+    if (prev)
+      prev->next = block;
+    else
+      arena->first = block;
+    ++arena->block_count;
+  }
+
+  arena->curr = block;
+  void *result = (char *)block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+#ifndef CALC_LIBRARY
+// Release every allocation at once, keeping the blocks for reuse
+static void arena_reset(Arena *arena) {
+  if (arena->first)
+    arena->first->used = 0;
+  arena->curr = arena->first;
+}
+#endif // CALC_LIBRARY
+
+static void arena_free(Arena *arena) {
+  ArenaBlock *block = arena->first;
+  while (block) {
+    ArenaBlock *next = block->next;
+    ALLOC_FREE(block);
+    block = next;
+  }
+  *arena = (Arena){0};
+}
+
+// Lists allocated from an arena are released with it. A list growing at the
+// end of the current block is extended in place.
+static void *arena_list_resize(void *context, void *ptr, size_t old_size,
+                               size_t size) {
+  // Allocations are rounded up to the alignment
+  size_t align = alignof(max_align_t);
+  size_t used = (old_size + align - 1) & ~(align - 1);
+  if (ptr && size <= used)
+    return ptr;
+  Arena *arena = context;
+  ArenaBlock *block = arena->curr;
+  size_t extra = (size - used + align - 1) & ~(align - 1);
+  if (ptr && (char *)ptr + used == (char *)block->data + block->used &&
+      extra <= block->capacity - block->used) {
+    block->used += extra;
+    return ptr;
+  }
+  void *result = arena_alloc(arena, size);
+  if (ptr)
+    memcpy(result, ptr, old_size);
+  return result;
+}
+
+static ArrayListAllocator arena_list_allocator(Arena *arena) {
+  return (ArrayListAllocator){.resize = arena_list_resize, .context = arena};
+}
+
+//===----------------------------------------------------------------------===//
+// Big integers
+//===----------------------------------------------------------------------===//
+
+// Integers that do not fit in an int are stored as a sign and a magnitude made
+// of 32-bit limbs, least significant first. The mag_* functions work on raw
+// magnitudes while the bigint_* ones allocate their result, which never has
+// leading zero limbs.
+
+#ifndef KARATSUBA_THRESHOLD
+#define KARATSUBA_THRESHOLD 32 // Limbs below which schoolbook is faster
+#endif
+
+ALLOC_CATEGORY(bigint_allocs, "bigint");
+ALLOC_CATEGORY(limb_allocs, "bigint.scratch"); // Magnitudes used internally
+
+typedef struct BigInt {
+  size_t size; // Number of limbs, zero for the value zero
+  bool negative;
+  uint32_t limbs[];
+} BigInt;
+
+static uint32_t *mag_alloc(size_t size) {
+  uint32_t *result =
+      ALLOC_MALLOC(limb_allocs, (size ? size : 1) * sizeof(uint32_t));
+  if (!result)
+    die("Failed to allocate memory");
+  return result;
+}
+
+static size_t mag_trim(const uint32_t *a, size_t n) {
+  while (n > 0 && a[n - 1] == 0)
+    --n;
+  return n;
+}
+
+static int mag_cmp(const uint32_t *a, size_t an, const uint32_t *b,
+                   size_t bn) {
+  if (an != bn)
+    return an < bn ? -1 : 1;
+  for (size_t i = an; i-- > 0;) {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+// r[0..rn) += a[0..an), where an <= rn. Return the carry out of r.
+static uint32_t mag_add_into(uint32_t *r, size_t rn, const uint32_t *a,
+                             size_t an) {
+  uint64_t carry = 0;
+  size_t i = 0;
+  for (; i < an; ++i) {
+    carry += (uint64_t)r[i] + a[i];
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  for (; carry && i < rn; ++i) {
+    carry += r[i];
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  return (uint32_t)carry;
+}
+
+// r[0..rn) -= a[0..an), where a <= r
+static void mag_sub_into(uint32_t *r, size_t rn, const uint32_t *a,
+                         size_t an) {
+  int64_t borrow = 0;
+  size_t i = 0;
+  for (; i < an; ++i) {
+    int64_t d = (int64_t)r[i] - a[i] - borrow;
+    r[i] = (uint32_t)d;
+    borrow = d < 0;
+  }
+  for (; borrow && i < rn; ++i) {
+    int64_t d = (int64_t)r[i] - borrow;
+    r[i] = (uint32_t)d;
+    borrow = d < 0;
+  }
+}
+
+// a[0..n) = a * m + add. Return the carry out of a.
+static uint32_t mag_mul_small(uint32_t *a, size_t n, uint32_t m,
+                              uint32_t add) {
+  uint64_t carry = add;
+  for (size_t i = 0; i < n; ++i) {
+    carry += (uint64_t)a[i] * m;
+    a[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  return (uint32_t)carry;
+}
+
+// q[0..an) = a / d. Return a % d. q may be a itself.
+static uint32_t mag_div_small(uint32_t *q, const uint32_t *a, size_t an,
+                              uint32_t d) {
+  uint64_t rem = 0;
+  for (size_t i = an; i-- > 0;) {
+    uint64_t curr = (rem << 32) | a[i];
+    q[i] = (uint32_t)(curr / d);
+    rem = curr % d;
+  }
+  return (uint32_t)rem;
+}
+
+static void mag_mul_schoolbook(uint32_t *r, const uint32_t *a, size_t an,
+                               const uint32_t *b, size_t bn) {
+  memset(r, 0, (an + bn) * sizeof(uint32_t));
+  for (size_t i = 0; i < an; ++i) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < bn; ++j) {
+      carry += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r[i + bn] = (uint32_t)carry;
+  }
+}
+
+// r[0..an+bn) = a * b. Above KARATSUBA_THRESHOLD limbs, both operands are split
+// in halves a1:a0 and b1:b0, and the middle part of the product is computed as
+// (a0 + a1)(b0 + b1) - a0 b0 - a1 b1, which takes three half-size products
+// instead of four.
+static void mag_mul(uint32_t *r, const uint32_t *a, size_t an,
+                    const uint32_t *b, size_t bn) {
+  if (an < bn) {
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    size_t tn = an;
+    an = bn;
+    bn = tn;
+  }
+  if (bn < KARATSUBA_THRESHOLD) {
+    mag_mul_schoolbook(r, a, an, b, bn);
+    return;
+  }
+
+  size_t m = (an + 1) / 2;
+  if (bn <= m) {
+    // b is too short to be split, multiply it by each half of a instead
+    mag_mul(r, a, m, b, bn);
+    memset(r + m + bn, 0, (an - m) * sizeof(uint32_t));
+    uint32_t *high = mag_alloc(an - m + bn);
+    mag_mul(high, a + m, an - m, b, bn);
+    mag_add_into(r + m, an + bn - m, high, an - m + bn);
+    ALLOC_FREE(high);
+    return;
+  }
+
+  size_t a1n = an - m, b1n = bn - m;
+  uint32_t *scratch = mag_alloc(4 * m + 4);
+  uint32_t *sa = scratch, *sb = sa + m + 1, *mid = sb + m + 1;
+  memcpy(sa, a, m * sizeof(uint32_t));
+  sa[m] = mag_add_into(sa, m, a + m, a1n);
+  memcpy(sb, b, m * sizeof(uint32_t));
+  sb[m] = mag_add_into(sb, m, b + m, b1n);
+  mag_mul(mid, sa, m + 1, sb, m + 1);
+
+  // The low and high products go directly to their place in the result
+  mag_mul(r, a, m, b, m);
+  mag_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+  mag_sub_into(mid, 2 * m + 2, r, 2 * m);
+  mag_sub_into(mid, 2 * m + 2, r + 2 * m, a1n + b1n);
+  mag_add_into(r + m, an + bn - m, mid, mag_trim(mid, 2 * m + 2));
+  ALLOC_FREE(scratch);
+}
+
+// q[0..an-bn+1) = a / b and r[0..bn) = a % b, where an >= bn >= 2 and the top
+// limb of b is not zero. This is Knuth's algorithm D.
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, size_t an,
+                       const uint32_t *b, size_t bn) {
+  // Shift both operands so that the top bit of the divisor is set, which keeps
+  // the estimated quotient digits off by at most two
+  int shift = __builtin_clz(b[bn - 1]);
+  uint32_t *u = mag_alloc(an + 1 + bn);
+  uint32_t *v = u + an + 1;
+  for (size_t i = bn; i-- > 0;)
+    v[i] = (b[i] << shift) |
+           (shift && i > 0 ? b[i - 1] >> (32 - shift) : 0);
+  u[an] = shift ? a[an - 1] >> (32 - shift) : 0;
+  for (size_t i = an; i-- > 0;)
+    u[i] = (a[i] << shift) |
+           (shift && i > 0 ? a[i - 1] >> (32 - shift) : 0);
+
+  for (size_t j = an - bn + 1; j-- > 0;) {
+    uint64_t top = ((uint64_t)u[j + bn] << 32) | u[j + bn - 1];
+    uint64_t qhat = top / v[bn - 1];
+    uint64_t rhat = top % v[bn - 1];
+    while (qhat > UINT32_MAX ||
+           qhat * v[bn - 2] > ((rhat << 32) | u[j + bn - 2])) {
+      --qhat;
+      rhat += v[bn - 1];
+      if (rhat > UINT32_MAX)
+        break;
+    }
+
+    int64_t borrow = 0;
+    uint64_t carry = 0;
+    for (size_t i = 0; i < bn; ++i) {
+      uint64_t p = qhat * v[i] + carry;
+      carry = p >> 32;
+      int64_t t = (int64_t)u[i + j] - borrow - (uint32_t)p;
+      u[i + j] = (uint32_t)t;
+      borrow = t < 0;
+    }
+    int64_t t = (int64_t)u[j + bn] - borrow - (int64_t)carry;
+    u[j + bn] = (uint32_t)t;
+
+    // The estimate was one too large, add the divisor back
+    if (t < 0) {
+      --qhat;
+      uint64_t c = 0;
+      for (size_t i = 0; i < bn; ++i) {
+        c += (uint64_t)u[i + j] + v[i];
+        u[i + j] = (uint32_t)c;
+        c >>= 32;
+      }
+      u[j + bn] += (uint32_t)c;
+    }
+    q[j] = (uint32_t)qhat;
+  }
+
+  for (size_t i = 0; i < bn; ++i)
+    r[i] = (u[i] >> shift) |
+           (shift ? (uint32_t)((uint64_t)u[i + 1] << (32 - shift)) : 0);
+  ALLOC_FREE(u);
+}
+
+static BigInt *bigint_alloc(size_t size) {
+  BigInt *result =
+      ALLOC_MALLOC(bigint_allocs, sizeof(BigInt) + size * sizeof(uint32_t));
+  if (!result)
+    die("Failed to allocate memory");
+  result->size = size;
+  result->negative = false;
+  return result;
+}
+
+static BigInt *bigint_trim(BigInt *a) {
+  a->size = mag_trim(a->limbs, a->size);
+  if (a->size == 0)
+    a->negative = false;
+  return a;
+}
+
+static BigInt *bigint_from_int64(int64_t value) {
+  uint64_t mag = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  BigInt *result = bigint_alloc(2);
+  result->limbs[0] = (uint32_t)mag;
+  result->limbs[1] = (uint32_t)(mag >> 32);
+  result->negative = value < 0;
+  return bigint_trim(result);
+}
+
+static BigInt *bigint_copy(const BigInt *a) {
+  BigInt *result = bigint_alloc(a->size);
+  memcpy(result->limbs, a->limbs, a->size * sizeof(uint32_t));
+  result->negative = a->negative;
+  return result;
+}
+
+// Return whether a fits in an int and store its value
+static bool bigint_to_int(const BigInt *a, int *value) {
+  if (a->size > 1)
+    return false;
+  uint64_t mag = a->size ? a->limbs[0] : 0;
+  if (mag > (a->negative ? (uint64_t)INT_MAX + 1 : (uint64_t)INT_MAX))
+    return false;
+  *value = (int)(a->negative ? -(int64_t)mag : (int64_t)mag);
+  return true;
+}
+
+static bool bigint_is_one(const BigInt *a) {
+  return a->size == 1 && a->limbs[0] == 1 && !a->negative;
+}
+
+// Return a + b, or a - b if subtract is set
+static BigInt *bigint_add(const BigInt *a, const BigInt *b, bool subtract) {
+  bool b_negative = b->negative != subtract;
+  if (a->negative == b_negative) {
+    const BigInt *big = a->size >= b->size ? a : b;
+    const BigInt *small = big == a ? b : a;
+    BigInt *result = bigint_alloc(big->size + 1);
+    memcpy(result->limbs, big->limbs, big->size * sizeof(uint32_t));
+    result->limbs[big->size] =
+        mag_add_into(result->limbs, big->size, small->limbs, small->size);
+    result->negative = a->negative;
+    return bigint_trim(result);
+  }
+
+  // Signs differ, subtract the smaller magnitude from the larger one
+  bool a_larger = mag_cmp(a->limbs, a->size, b->limbs, b->size) >= 0;
+  const BigInt *big = a_larger ? a : b;
+  const BigInt *small = a_larger ? b : a;
+  BigInt *result = bigint_copy(big);
+  mag_sub_into(result->limbs, result->size, small->limbs, small->size);
+  result->negative = a_larger ? a->negative : b_negative;
+  return bigint_trim(result);
+}
+
+static BigInt *bigint_mul(const BigInt *a, const BigInt *b) {
+  if (a->size == 0 || b->size == 0)
+    return bigint_alloc(0);
+  BigInt *result = bigint_alloc(a->size + b->size);
+  mag_mul(result->limbs, a->limbs, a->size, b->limbs, b->size);
+  result->negative = a->negative != b->negative;
+  return bigint_trim(result);
+}
+
+// Return a / b rounded toward zero, storing the remainder in *rem if not null.
+// b must not be zero.
+static BigInt *bigint_divmod(const BigInt *a, const BigInt *b, BigInt **rem) {
+  BigInt *q, *r;
+  if (mag_cmp(a->limbs, a->size, b->limbs, b->size) < 0) {
+    q = bigint_alloc(0);
+    r = bigint_copy(a);
+  } else if (b->size == 1) {
+    q = bigint_alloc(a->size);
+    r = bigint_alloc(1);
+    r->limbs[0] = mag_div_small(q->limbs, a->limbs, a->size, b->limbs[0]);
+  } else {
+    q = bigint_alloc(a->size - b->size + 1);
+    r = bigint_alloc(b->size);
+    mag_divmod(q->limbs, r->limbs, a->limbs, a->size, b->limbs, b->size);
+  }
+  q->negative = a->negative != b->negative;
+  r->negative = a->negative;
+  bigint_trim(q);
+  bigint_trim(r);
+  if (rem)
+    *rem = r;
+  else
+    ALLOC_FREE(r);
+  return q;
+}
+
+// Return the greatest common divisor of a and b, which is never negative
+static BigInt *bigint_gcd(const BigInt *a, const BigInt *b) {
+  BigInt *x = bigint_copy(a), *y = bigint_copy(b);
+  x->negative = y->negative = false;
+  while (y->size > 0) {
+    BigInt *r;
+    ALLOC_FREE(bigint_divmod(x, y, &r));
+    ALLOC_FREE(x);
+    x = y;
+    y = r;
+  }
+  ALLOC_FREE(y);
+  return x;
+}
+
+#if !defined(CALC_NO_MAIN) || defined(CALC_LIBRARY)
+static void bigint_print(FILE *out, const BigInt *a) {
+  if (a->size == 0) {
+    putc('0', out);
+    return;
+  }
+
+  // Peel off groups of nine decimal digits, least significant first
+  uint32_t *t = mag_alloc(a->size);
+  memcpy(t, a->limbs, a->size * sizeof(uint32_t));
+  uint32_t *groups = mag_alloc(a->size * 32 / 29 + 2);
+  size_t group_count = 0;
+  for (size_t n = a->size; n > 0; n = mag_trim(t, n))
+    groups[group_count++] = mag_div_small(t, t, n, 1000000000);
+
+  if (a->negative)
+    putc('-', out);
+  fprintf(out, "%u", (unsigned)groups[group_count - 1]);
+  for (size_t i = group_count - 1; i-- > 0;)
+    fprintf(out, "%09u", (unsigned)groups[i]);
+  ALLOC_FREE(groups);
+  ALLOC_FREE(t);
+}
+#endif
+
 //===----------------------------------------------------------------------===//
 // Expressions
 //===----------------------------------------------------------------------===//
@@ -58,7 +610,9 @@ NO_RETURN static void die(const char *msg) {
 typedef enum ExpressionType {
   EXPR_NUMBER,
   EXPR_BINARY_OP,
-  EXPR_UNARY_OP
+  EXPR_UNARY_OP,
+  EXPR_VARIABLE,
+  EXPR_VECTOR
 } ExpressionType;
 
 typedef enum BinaryOperator {
@@ -70,27 +624,50 @@ typedef enum BinaryOperator {
 
 typedef enum UnaryOperator { UNARY_OP_PLUS, UNARY_OP_NEG } UnaryOperator;
 
-typedef enum NumberType { NUMBER_INTEGER } NumberType;
+typedef enum NumberType {
+  NUMBER_INTEGER,
+  NUMBER_BIGINT,
+  NUMBER_FRACTION,
+  NUMBER_VECTOR
+} NumberType;
 
+// Scalars are kept in the smallest representation that holds them exactly:
+// integers that fit in an int are stored inline, and heap storage is only used
+// for larger integers and for fractions.
 typedef struct Number {
   NumberType type;
   union {
-    // TODO: Add fractions
     int integer;
+    BigInt *bigint; // Does not fit in an int
+    struct {
+      BigInt *num;
+      BigInt *den; // Greater than one, coprime with num
+    } fraction;
+    int *vector; // Arraylist owned by the number
   };
 } Number;
 
+// Operators record the number of nodes of their subtree, which fits in what
+// would otherwise be padding
 typedef struct BinaryOp {
   struct Expression *lhs;
   struct Expression *rhs;
   BinaryOperator op;
+  uint32_t size;
 } BinaryOp;
 
 typedef struct UnaryOp {
   struct Expression *expr;
   UnaryOperator op;
+  uint32_t size;
 } UnaryOp;
 
+typedef struct Vector {
+  struct Expression **elements; // Null when all elements are constants
+  int *values;                  // Constant elements
+  size_t size;
+} Vector;
+
 typedef struct Expression {
   ExpressionType type;
   bool valid;
@@ -98,82 +675,397 @@ typedef struct Expression {
     BinaryOp binary_op;
     UnaryOp unary_op;
     Number number;
+    size_t variable; // Index of the variable in its sheet
+    Vector vector;
   };
 } Expression;
 
+// The invalid expression is shared by every thread and must stay read-only
 static Expression *expr_invalid(void) {
   static Expression invalid = (Expression){.valid = false};
   return &invalid;
 }
 
-static void free_expr(Expression *expr) {
-  if (!expr || expr == expr_invalid())
-    return;
+static Expression *expr_integer(Arena *arena, int value) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
+  result->type = EXPR_NUMBER;
+  result->number.type = NUMBER_INTEGER;
+  result->number.integer = value;
+  result->valid = true;
+  return result;
+}
+
+// Integer literals too large for an int. The value is owned by the arena.
+static Expression *expr_bigint(Arena *arena, BigInt *value) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
+  result->type = EXPR_NUMBER;
+  result->number.type = NUMBER_BIGINT;
+  result->number.bigint = value;
+  result->valid = true;
+  return result;
+}
+
+static Expression *expr_variable(Arena *arena, size_t index) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
+  result->type = EXPR_VARIABLE;
+  result->variable = index;
+  result->valid = true;
+  return result;
+}
+
+// Return whether expr is an integer literal, possibly preceded by a sign, and
+// store its value
+static bool expr_is_constant(const Expression *expr, int *value) {
+  int sign = 1;
+  while (expr->type == EXPR_UNARY_OP) {
+    if (expr->unary_op.op == UNARY_OP_NEG)
+      sign = -sign;
+    expr = expr->unary_op.expr;
+  }
+  if (expr->type != EXPR_NUMBER || expr->number.type != NUMBER_INTEGER ||
+      (sign < 0 && expr->number.integer == INT_MIN))
+    return false;
+  *value = sign * expr->number.integer;
+  return true;
+}
+
+static uint32_t saturate_size(uint64_t size) {
+  return size < UINT32_MAX ? size : UINT32_MAX;
+}
+
+// Return the number of nodes of the tree, saturating at UINT32_MAX
+static uint32_t expr_size(const Expression *expr) {
+  if (!expr)
+    return 0;
   switch (expr->type) {
   case EXPR_BINARY_OP:
-    free_expr(expr->binary_op.lhs);
-    free_expr(expr->binary_op.rhs);
-    break;
+    return expr->binary_op.size;
   case EXPR_UNARY_OP:
-    free_expr(expr->unary_op.expr);
-    break;
+    return expr->unary_op.size;
+  case EXPR_VECTOR: {
+    uint64_t size = 1;
+    for (size_t i = 0; expr->vector.elements && i < expr->vector.size; ++i)
+      size += expr_size(expr->vector.elements[i]);
+    return saturate_size(size);
+  }
   default:
-    break;
+    return 1;
   }
-  free(expr);
 }
 
-static Expression *expr_integer(int value) {
-  Expression *result = calloc(1, sizeof(Expression));
-  result->type = EXPR_NUMBER;
-  result->number.type = NUMBER_INTEGER;
-  result->number.integer = value;
+// Vectors of constants, such as columns of data, are stored as a contiguous
+// array of values instead of one node per element
+static Expression *expr_vector(Arena *arena, Expression **elements,
+                               size_t size) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
+  result->type = EXPR_VECTOR;
+  result->vector = (Vector){.size = size};
   result->valid = true;
+
+  int *values = arena_alloc(arena, size * sizeof(int));
+  size_t i = 0;
+  while (i < size && expr_is_constant(elements[i], &values[i]))
+    ++i;
+  if (i == size) {
+    result->vector.values = values;
+    return result;
+  }
+
+  result->vector.elements = arena_alloc(arena, size * sizeof(Expression *));
+  for (i = 0; i < size; ++i) {
+    result->vector.elements[i] = elements[i];
+    result->valid = result->valid && elements[i]->valid;
+  }
   return result;
 }
 
-static Expression *expr_unary_op(UnaryOperator op, Expression *expr) {
-  Expression *result = calloc(1, sizeof(Expression));
+static Expression *expr_unary_op(Arena *arena, UnaryOperator op,
+                                 Expression *expr) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
   result->type = EXPR_UNARY_OP;
   result->unary_op.op = op;
   result->unary_op.expr = expr;
+  result->unary_op.size = saturate_size(1 + (uint64_t)expr_size(expr));
   result->valid = (expr != 0) && expr->valid;
   return result;
 }
 
-static Expression *expr_unary_plus(Expression *expr) {
-  return expr_unary_op(UNARY_OP_PLUS, expr);
-}
-
-static Expression *expr_unary_minus(Expression *expr) {
-  return expr_unary_op(UNARY_OP_NEG, expr);
-}
-
-static Expression *expr_binary_op(BinaryOperator op, Expression *lhs,
-                                  Expression *rhs) {
-  Expression *result = calloc(1, sizeof(Expression));
+static Expression *expr_binary_op(Arena *arena, BinaryOperator op,
+                                  Expression *lhs, Expression *rhs) {
+  Expression *result = arena_alloc(arena, sizeof(Expression));
   result->type = EXPR_BINARY_OP;
   result->binary_op.op = op;
   result->binary_op.lhs = lhs;
   result->binary_op.rhs = rhs;
+  result->binary_op.size =
+      saturate_size(1 + (uint64_t)expr_size(lhs) + expr_size(rhs));
   result->valid = (lhs != 0 && lhs->valid) && (rhs != 0 && rhs->valid);
   return result;
 }
 
-static Expression *expr_add(Expression *lhs, Expression *rhs) {
-  return expr_binary_op(BINARY_OP_ADD, lhs, rhs);
+static size_t expr_operand_count(const Expression *expr) {
+  switch (expr->type) {
+  case EXPR_BINARY_OP:
+    return 2;
+  case EXPR_UNARY_OP:
+    return 1;
+  case EXPR_VECTOR:
+    return expr->vector.elements ? expr->vector.size : 0;
+  default:
+    return 0;
+  }
+}
+
+static const Expression *expr_operand(const Expression *expr, size_t i) {
+  switch (expr->type) {
+  case EXPR_BINARY_OP:
+    return i == 0 ? expr->binary_op.lhs : expr->binary_op.rhs;
+  case EXPR_UNARY_OP:
+    return expr->unary_op.expr;
+  case EXPR_VECTOR:
+    return expr->vector.elements[i];
+  default:
+    UNREACHABLE("Expression has no operand");
+  }
+}
+
+// Hash the contents of a node, operands being identified by their address
+static uint64_t expr_hash(const Expression *expr) {
+  uint64_t key[3] = {expr->type};
+  const char *data = 0;
+  size_t size = 0;
+  switch (expr->type) {
+  case EXPR_NUMBER:
+    if (expr->number.type == NUMBER_BIGINT) {
+      key[1] = expr->number.bigint->negative;
+      data = (const char *)expr->number.bigint->limbs;
+      size = expr->number.bigint->size * sizeof(uint32_t);
+    } else {
+      key[1] = (uint32_t)expr->number.integer;
+    }
+    break;
+  case EXPR_VARIABLE:
+    key[1] = expr->variable;
+    break;
+  case EXPR_BINARY_OP:
+    key[0] |= (uint64_t)expr->binary_op.op << 8;
+    key[1] = (uintptr_t)expr->binary_op.lhs;
+    key[2] = (uintptr_t)expr->binary_op.rhs;
+    break;
+  case EXPR_UNARY_OP:
+    key[0] |= (uint64_t)expr->unary_op.op << 8;
+    key[1] = (uintptr_t)expr->unary_op.expr;
+    break;
+  case EXPR_VECTOR:
+    key[1] = expr->vector.size;
+    if (expr->vector.elements) {
+      data = (const char *)expr->vector.elements;
+      size = expr->vector.size * sizeof(Expression *);
+    } else {
+      data = (const char *)expr->vector.values;
+      size = expr->vector.size * sizeof(int);
+    }
+    break;
+  default:
+    UNREACHABLE("Unexpected expression type");
+  }
+  uint64_t h = hash_bytes((const char *)key, sizeof(key));
+  return size ? h ^ hash_bytes(data, size) : h;
+}
+
+// Return whether two nodes have the same contents and the same operands
+static bool expr_equal(const Expression *a, const Expression *b) {
+  if (a->type != b->type)
+    return false;
+  switch (a->type) {
+  case EXPR_NUMBER:
+    if (a->number.type != b->number.type)
+      return false;
+    if (a->number.type == NUMBER_BIGINT) {
+      const BigInt *x = a->number.bigint, *y = b->number.bigint;
+      return x->negative == y->negative && x->size == y->size &&
+             memcmp(x->limbs, y->limbs, x->size * sizeof(uint32_t)) == 0;
+    }
+    return a->number.integer == b->number.integer;
+  case EXPR_VARIABLE:
+    return a->variable == b->variable;
+  case EXPR_BINARY_OP:
+    return a->binary_op.op == b->binary_op.op &&
+           a->binary_op.lhs == b->binary_op.lhs &&
+           a->binary_op.rhs == b->binary_op.rhs;
+  case EXPR_UNARY_OP:
+    return a->unary_op.op == b->unary_op.op &&
+           a->unary_op.expr == b->unary_op.expr;
+  case EXPR_VECTOR:
+    if (a->vector.size != b->vector.size ||
+        !a->vector.elements != !b->vector.elements)
+      return false;
+    if (a->vector.elements)
+      return memcmp(a->vector.elements, b->vector.elements,
+                    a->vector.size * sizeof(Expression *)) == 0;
+    return memcmp(a->vector.values, b->vector.values,
+                  a->vector.size * sizeof(int)) == 0;
+  default:
+    UNREACHABLE("Unexpected expression type");
+  }
+}
+
+// Distinct nodes numbered in insertion order. Nodes are told apart by
+// expr_equal, so two nodes with the same contents and operands share an index.
+typedef struct ExprTable {
+  const Expression **nodes;
+  uint32_t *slots; // Open addressing table of indices in nodes
+} ExprTable;
+
+#define EXPR_TABLE_EMPTY_SLOT UINT32_MAX
+#define EXPR_TABLE_MIN_SLOTS 16
+
+// Forget every node, shrinking the slots if the last use needed far fewer
+static void expr_table_reset(ExprTable *t) {
+  size_t slot_count = arraylist_size(t->slots);
+  size_t needed = 4 * arraylist_size(t->nodes);
+  arraylist_clear(t->nodes);
+  if (slot_count > EXPR_TABLE_MIN_SLOTS && slot_count > 4 * needed) {
+    while (slot_count > EXPR_TABLE_MIN_SLOTS && slot_count / 2 >= needed)
+      slot_count /= 2;
+    arraylist_free(t->slots);
+  }
+  if (!t->slots) {
+    if (slot_count == 0)
+      slot_count = EXPR_TABLE_MIN_SLOTS;
+    arraylist_grow(t->slots, slot_count);
+    arraylist_ptr(t->slots)->size = arraylist_capacity(t->slots);
+  }
+  memset(t->slots, 0xff, arraylist_size(t->slots) * sizeof(uint32_t));
+}
+
+// Return the index of a node equal to expr, or EXPR_TABLE_EMPTY_SLOT
+static uint32_t expr_table_find(const ExprTable *t, const Expression *expr) {
+  size_t mask = arraylist_size(t->slots) - 1;
+  for (size_t i = expr_hash(expr) & mask;; i = (i + 1) & mask) {
+    uint32_t index = t->slots[i];
+    if (index == EXPR_TABLE_EMPTY_SLOT || expr_equal(t->nodes[index], expr))
+      return index;
+  }
+}
+
+static void expr_table_insert_slot(ExprTable *t, uint32_t index) {
+  size_t mask = arraylist_size(t->slots) - 1;
+  size_t i = expr_hash(t->nodes[index]) & mask;
+  while (t->slots[i] != EXPR_TABLE_EMPTY_SLOT)
+    i = (i + 1) & mask;
+  t->slots[i] = index;
+}
+
+// Add a node which is not in the table yet and return its index
+static uint32_t expr_table_add(ExprTable *t, const Expression *expr) {
+  uint32_t index = arraylist_size(t->nodes);
+  arraylist_push(t->nodes, expr);
+  size_t slot_count = arraylist_size(t->slots);
+  if (2 * arraylist_size(t->nodes) > slot_count) {
+    slot_count *= 2;
+    arraylist_grow(t->slots, slot_count - arraylist_capacity(t->slots));
+    arraylist_ptr(t->slots)->size = slot_count;
+    memset(t->slots, 0xff, slot_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < arraylist_size(t->nodes); ++i)
+      expr_table_insert_slot(t, i);
+  } else {
+    expr_table_insert_slot(t, index);
+  }
+  return index;
+}
+
+static void free_expr_table(ExprTable *t) {
+  arraylist_free(t->nodes);
+  arraylist_free(t->slots);
+}
+
+// Trees are traversed with an explicit stack rather than by recursion so that
+// their depth is only limited by memory. Nodes come out in post-order, every
+// operator after its operands, left to right.
+//
+// Optimized expressions may share nodes, turning them into DAGs. These can be
+// walked as the trees they stand for, or with a table of the nodes visited in
+// which case a node seen before comes out again without its operands, flagged
+// as repeated, and walk->index tells the order in which it first came out.
+typedef struct WalkFrame {
+  const Expression *expr;
+  size_t next_operand;
+} WalkFrame;
+
+typedef struct ExprWalk {
+  WalkFrame *frames;      // Operators whose operands are being visited
+  const Expression *root; // Not visited yet, null once started
+  ExprTable *visited;     // Nodes visited so far when walking a DAG
+  uint32_t index;         // Index of the last node in visited
+  bool repeated;          // Whether the last node was visited before
+} ExprWalk;
+
+// Start a traversal, reusing the storage of a previous one
+static void expr_walk_start(ExprWalk *walk, const Expression *root) {
+  arraylist_clear(walk->frames);
+  walk->root = root;
+  walk->visited = 0;
+}
+
+#ifndef CALC_LIBRARY
+// Start a traversal visiting every distinct node once
+static void expr_walk_start_dag(ExprWalk *walk, const Expression *root,
+                                ExprTable *visited) {
+  expr_walk_start(walk, root);
+  expr_table_reset(visited);
+  walk->visited = visited;
+}
+#endif // CALC_LIBRARY
+
+static bool expr_walk_seen(const ExprWalk *walk, const Expression *expr) {
+  return walk->visited &&
+         expr_table_find(walk->visited, expr) != EXPR_TABLE_EMPTY_SLOT;
+}
+
+// Push the leftmost path from expr down to a leaf, or to a node visited
+// before, and return that node
+static const Expression *expr_walk_descend(ExprWalk *walk,
+                                           const Expression *expr) {
+  while (expr_operand_count(expr) > 0 && !expr_walk_seen(walk, expr)) {
+    WalkFrame frame = {.expr = expr, .next_operand = 1};
+    arraylist_push(walk->frames, frame);
+    expr = expr_operand(expr, 0);
+  }
+  return expr;
 }
 
-static Expression *expr_sub(Expression *lhs, Expression *rhs) {
-  return expr_binary_op(BINARY_OP_SUB, lhs, rhs);
+static const Expression *expr_walk_visit(ExprWalk *walk,
+                                         const Expression *expr) {
+  if (walk->visited) {
+    walk->index = expr_table_find(walk->visited, expr);
+    walk->repeated = walk->index != EXPR_TABLE_EMPTY_SLOT;
+    if (!walk->repeated)
+      walk->index = expr_table_add(walk->visited, expr);
+  }
+  return expr;
 }
 
-static Expression *expr_mul(Expression *lhs, Expression *rhs) {
-  return expr_binary_op(BINARY_OP_MUL, lhs, rhs);
+// Return the next node, or null once the whole tree has been visited
+static const Expression *expr_walk_next(ExprWalk *walk) {
+  if (walk->root) {
+    const Expression *root = walk->root;
+    walk->root = 0;
+    return expr_walk_visit(walk, expr_walk_descend(walk, root));
+  }
+  if (arraylist_size(walk->frames) == 0)
+    return 0;
+  WalkFrame *top = &walk->frames[arraylist_size(walk->frames) - 1];
+  if (top->next_operand < expr_operand_count(top->expr)) {
+    const Expression *operand = expr_operand(top->expr, top->next_operand++);
+    return expr_walk_visit(walk, expr_walk_descend(walk, operand));
+  }
+  return expr_walk_visit(walk, arraylist_pop(walk->frames).expr);
 }
 
-static Expression *expr_div(Expression *lhs, Expression *rhs) {
-  return expr_binary_op(BINARY_OP_DIV, lhs, rhs);
+static void free_expr_walk(ExprWalk *walk) {
+  arraylist_free(walk->frames);
+  walk->root = 0;
 }
 
 //===----------------------------------------------------------------------===//
@@ -189,16 +1081,18 @@ typedef enum TokenType {
   TOKEN_RPAREN,
   TOKEN_LSQUARE,
   TOKEN_RSQUARE,
+  TOKEN_COMMA,
+  TOKEN_ASSIGN,
   TOKEN_INTEGER,
   TOKEN_IDENTIFIER,
   TOKEN_EOF,
   TOKEN_CHARACTER
 } TokenType;
 
+// Locations are byte offsets from the start of the input
 typedef struct Location {
-  const char *line;
-  const char *start;
-  const char *end;
+  size_t start;
+  size_t end;
 } Location;
 
 typedef struct Token {
@@ -207,249 +1101,4198 @@ typedef struct Token {
   union {
     struct {
       int value;
+      BigInt *big; // Copied to the lexer's arena when value would overflow
     } integer;
+    struct {
+      const char *name; // Copied to the lexer's arena
+      size_t size;
+    } identifier;
   };
 } Token;
 
-static Token *tokenize(const char *input) {
-  Token *result = 0;
+// Input is pulled from a source handing out successive chunks. A chunk must
+// stay valid until the next one is requested. Return false at the end of input.
+typedef struct InputSource {
+  bool (*next_chunk)(void *context, const char **data, size_t *size);
+  void *context;
+} InputSource;
 
-  const char *curr = input;
-  size_t size = strlen(input);
-  while (curr != input + size) {
-    Token t =
-        (Token){.loc.line = input, .loc.start = curr, .loc.end = curr + 1};
+// Input already in memory is handed out as a single chunk
+typedef struct MemoryInput {
+  const char *data;
+  size_t size;
+} MemoryInput;
 
-    switch (*curr) {
-    case '+': {
-      t.type = TOKEN_PLUS;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case '-': {
-      t.type = TOKEN_MINUS;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case '*': {
-      t.type = TOKEN_TIMES;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case '/': {
-      t.type = TOKEN_DIVIDE;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case '(': {
-      t.type = TOKEN_LPAREN;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case ')': {
-      t.type = TOKEN_RPAREN;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case '[': {
-      t.type = TOKEN_LSQUARE;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    case ']': {
-      t.type = TOKEN_RSQUARE;
-      arraylist_push(result, t);
-      curr += 1;
-    } break;
-    default:
-      if (isdigit(*curr)) {
-        int value = 0;
-        t.type = TOKEN_INTEGER;
-        do {
-          value = value * 10 + (*curr - '0');
-          curr += 1;
-        } while (curr < input + size && isdigit(*curr));
-        t.integer.value = value;
-        t.loc.end = curr;
-        arraylist_push(result, t);
-      } else if (isalpha(*curr) || *curr == '_') {
-        t.type = TOKEN_IDENTIFIER;
-        do {
-          curr += 1;
-        } while (curr < input + size && (isalnum(*curr) || *curr == '_'));
-        t.loc.end = curr;
-        arraylist_push(result, t);
+static bool memory_next_chunk(void *context, const char **data, size_t *size) {
+  MemoryInput *input = context;
+  if (input->size == 0)
+    return false;
+  *data = input->data;
+  *size = input->size;
+  input->size = 0;
+  return true;
+}
+
+static InputSource memory_source(MemoryInput *input) {
+  return (InputSource){.next_chunk = memory_next_chunk, .context = input};
+}
+
+// Characters are classified through a table rather than the <ctype.h>
+// functions, which also gives the meaning of the C locale to the input.
+// Classes are combined in bitmasks, so that a run of characters is found by
+// testing any of the classes it may contain.
+enum {
+  CHAR_SPACE = 1,
+  CHAR_DIGIT = 2,
+  CHAR_IDENT = 4,  // Part of an identifier: letters, digits and '_'
+  CHAR_LETTER = 8, // Start of an identifier: letters and '_'
+};
+
+static const unsigned char char_classes[256] = {
+    [' '] = CHAR_SPACE,
+    ['\t'... '\r'] = CHAR_SPACE,
+    ['0'... '9'] = CHAR_DIGIT | CHAR_IDENT,
+    ['a'... 'z'] = CHAR_IDENT | CHAR_LETTER,
+    ['A'... 'Z'] = CHAR_IDENT | CHAR_LETTER,
+    ['_'] = CHAR_IDENT | CHAR_LETTER,
+};
+
+static bool char_is(int c, unsigned classes) {
+  return c != EOF && (char_classes[(unsigned char)c] & classes);
+}
+
+// Long lines are classified a block at a time. Bit i of each mask is set when
+// the character at offset i of the block belongs to the class.
+#define LEXER_BLOCK_SIZE 64
+
+typedef struct CharMasks {
+  uint64_t space;
+  uint64_t digit;
+  uint64_t ident;
+} CharMasks;
+
+typedef struct Classifier {
+  const char *name;
+  void (*classify)(const char *block, CharMasks *masks);
+} Classifier;
+
+static void scalar_classify(const char *block, CharMasks *masks) {
+  *masks = (CharMasks){0};
+  for (size_t i = 0; i < LEXER_BLOCK_SIZE; ++i) {
+    unsigned classes = char_classes[(unsigned char)block[i]];
+    masks->space |= (uint64_t)((classes & CHAR_SPACE) != 0) << i;
+    masks->digit |= (uint64_t)((classes & CHAR_DIGIT) != 0) << i;
+    masks->ident |= (uint64_t)((classes & CHAR_IDENT) != 0) << i;
+  }
+}
+
+static const Classifier scalar_classifier = {.name = "scalar",
+                                             .classify = scalar_classify};
+
+// Define a classifier processing width bytes at a time. Ranges of characters
+// are tested with a single unsigned comparison, x - lo <= hi - lo, done as
+// min(x - lo, hi - lo) == x - lo since there is no unsigned byte comparison.
+#define DEFINE_CLASSIFIER(prefix, attr, type, width, load, set1, sub, bit_or,  \
+                          min_u8, cmpeq, movemask)                             \
+  attr static type prefix##_in_range(type x, char lo, char hi) {               \
+    type offset = sub(x, set1(lo));                                            \
+    return cmpeq(min_u8(offset, set1((char)(hi - lo))), offset);               \
+  }                                                                            \
+  attr static void prefix##_classify(const char *block, CharMasks *masks) {    \
+    *masks = (CharMasks){0};                                                   \
+    for (size_t i = 0; i < LEXER_BLOCK_SIZE; i += (width)) {                   \
+      type x = load((const type *)(block + i));                                \
+      type space =                                                             \
+          bit_or(cmpeq(x, set1(' ')), prefix##_in_range(x, '\t', '\r'));       \
+      type digit = prefix##_in_range(x, '0', '9');                             \
+      type letter = prefix##_in_range(bit_or(x, set1(0x20)), 'a', 'z');        \
+      type ident = bit_or(bit_or(digit, letter), cmpeq(x, set1('_')));         \
+      masks->space |= (uint64_t)(uint32_t)movemask(space) << i;                \
+      masks->digit |= (uint64_t)(uint32_t)movemask(digit) << i;                \
+      masks->ident |= (uint64_t)(uint32_t)movemask(ident) << i;                \
+    }                                                                          \
+  }                                                                            \
+  static const Classifier prefix##_classifier = {                              \
+      .name = #prefix, .classify = prefix##_classify};
+
+#if CALC_SSE2
+DEFINE_CLASSIFIER(sse2, , __m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+                  _mm_sub_epi8, _mm_or_si128, _mm_min_epu8, _mm_cmpeq_epi8,
+                  _mm_movemask_epi8)
+
+#if CALC_AVX2
+DEFINE_CLASSIFIER(avx2, AVX2, __m256i, 32, _mm256_loadu_si256,
+                  _mm256_set1_epi8, _mm256_sub_epi8, _mm256_or_si256,
+                  _mm256_min_epu8, _mm256_cmpeq_epi8, _mm256_movemask_epi8)
+#endif
+#endif // CALC_SSE2
+
+static const Classifier *selected_classifier = &scalar_classifier;
+static once_flag classifier_once = ONCE_FLAG_INIT;
+
+static void select_classifier(void) {
+#if CALC_SSE2
+  selected_classifier = &sse2_classifier;
+#if CALC_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    selected_classifier = &avx2_classifier;
+#endif
+#endif
+}
+
+static const Classifier *char_classifier(void) {
+  call_once(&classifier_once, select_classifier);
+  return selected_classifier;
+}
+
+// Integer literals of up to this many digits are converted at once
+#define FAST_DIGIT_COUNT 16
+
+// Return the value of the given 1 to FAST_DIGIT_COUNT digits. Bytes before
+// them may be read as long as they are not before start.
+static uint64_t digits_value(const char *digits, size_t n, const char *start) {
+#if CALC_SSE2
+  // The 16 bytes ending with the last digit are loaded, and those preceding
+  // the first digit are cleared, so that each lane has a fixed weight
+  static const char lane_masks[32] = {
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+  char buffer[16];
+  const char *last = digits + n;
+  if (last - start < 16) {
+    memset(buffer, '0', sizeof(buffer));
+    memcpy(buffer + sizeof(buffer) - n, digits, n);
+    last = buffer + sizeof(buffer);
+  }
+  __m128i x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(last - 16)),
+                           _mm_set1_epi8('0'));
+  x = _mm_and_si128(x, _mm_loadu_si128((const __m128i *)(lane_masks + n)));
+
+  // Adjacent lanes are combined into values of 2, 4, then 8 digits
+  __m128i zero = _mm_setzero_si128();
+  __m128i tens = _mm_setr_epi16(10, 1, 10, 1, 10, 1, 10, 1);
+  __m128i pairs =
+      _mm_packs_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(x, zero), tens),
+                      _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), tens));
+  __m128i quads = _mm_madd_epi16(
+      pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+  __m128i octs = _mm_madd_epi16(
+      _mm_packs_epi32(quads, quads),
+      _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+  uint32_t high = (uint32_t)_mm_cvtsi128_si32(octs);
+  uint32_t low = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(octs, 4));
+  return high * UINT64_C(100000000) + low;
+#else
+  (void)start;
+  uint64_t value = 0;
+  for (size_t i = 0; i < n; ++i)
+    value = value * 10 + (uint64_t)(digits[i] - '0');
+  return value;
+#endif
+}
+
+// Tokens are produced on demand, the parser seeing one token of lookahead, so
+// that no more than a chunk of the input is held at any time
+typedef struct Lexer {
+  InputSource source;
+  const char *chunk;
+  const char *curr;
+  const char *end;
+  size_t chunk_offset; // Offset of the current chunk in the input
+  bool at_end;
+  Arena *arena;
+  char *scratch;   // Start of an identifier spanning several chunks
+  uint32_t *limbs; // Value of an integer literal too large for an int
+  Token token;     // Next token to be consumed
+  const Classifier *classifier;
+  const char *block; // Block of the current chunk described by masks, if any
+  CharMasks masks;
+} Lexer;
+
+// Make sure that the current character is available. Return false at the end
+// of input.
+static bool lexer_fill(Lexer *lx) {
+  while (lx->curr == lx->end) {
+    if (lx->at_end)
+      return false;
+    lx->chunk_offset += lx->end - lx->chunk;
+    lx->chunk = lx->end;
+    const char *data;
+    size_t size;
+    if (!lx->source.next_chunk(lx->source.context, &data, &size)) {
+      lx->at_end = true;
+      return false;
+    }
+    lx->chunk = lx->curr = data;
+    lx->end = data + size;
+    lx->block = 0;
+  }
+  return true;
+}
+
+static int lexer_peek_char(Lexer *lx) {
+  return lexer_fill(lx) ? (unsigned char)*lx->curr : EOF;
+}
+
+static size_t lexer_offset(const Lexer *lx) {
+  return lx->chunk_offset + (size_t)(lx->curr - lx->chunk);
+}
+
+// Return the end of the run of characters having any of the given classes
+// that starts at p, stopping at the end of the chunk. Runs are found in the
+// masks of whole blocks, the last bytes of the chunk being tested one by one.
+static const char *lexer_span(Lexer *lx, const char *p, unsigned classes) {
+  while (lx->end - p >= LEXER_BLOCK_SIZE) {
+    if (!lx->block || p < lx->block || p - lx->block >= LEXER_BLOCK_SIZE) {
+      lx->block = p;
+      lx->classifier->classify(p, &lx->masks);
+    }
+    uint64_t run = (classes & CHAR_SPACE ? lx->masks.space : 0) |
+                   (classes & CHAR_DIGIT ? lx->masks.digit : 0) |
+                   (classes & CHAR_IDENT ? lx->masks.ident : 0);
+    size_t offset = (size_t)(p - lx->block);
+    uint64_t stop = ~(run >> offset) & (UINT64_MAX >> offset);
+    if (stop)
+      return p + __builtin_ctzll(stop);
+    p = lx->block + LEXER_BLOCK_SIZE;
+  }
+  while (p != lx->end && char_is((unsigned char)*p, classes))
+    p += 1;
+  return p;
+}
+
+static void lexer_integer(Lexer *lx, Token *t) {
+  t->type = TOKEN_INTEGER;
+
+  // Literals that fit in an int and do not reach the end of the chunk are
+  // converted at once
+  const char *end = lexer_span(lx, lx->curr, CHAR_DIGIT);
+  size_t n = (size_t)(end - lx->curr);
+  if (end != lx->end && n <= FAST_DIGIT_COUNT) {
+    uint64_t value = digits_value(lx->curr, n, lx->chunk);
+    if (value <= INT_MAX) {
+      t->integer.value = (int)value;
+      lx->curr = end;
+      return;
+    }
+  }
+
+  int value = 0;
+  bool overflow = false;
+  for (int c = lexer_peek_char(lx); char_is(c, CHAR_DIGIT);
+       c = lexer_peek_char(lx)) {
+    lx->curr += 1;
+    int digit = c - '0', next;
+    if (!overflow && !__builtin_mul_overflow(value, 10, &next) &&
+        !__builtin_add_overflow(next, digit, &next)) {
+      value = next;
+      continue;
+    }
+    if (!overflow) {
+      // Carry on in limbs from the value read so far
+      overflow = true;
+      arraylist_clear(lx->limbs);
+      arraylist_push(lx->limbs, (uint32_t)value);
+    }
+    uint32_t carry =
+        mag_mul_small(lx->limbs, arraylist_size(lx->limbs), 10, digit);
+    if (carry)
+      arraylist_push(lx->limbs, carry);
+  }
+
+  t->integer.value = value;
+  if (overflow) {
+    size_t size = arraylist_size(lx->limbs);
+    BigInt *big =
+        arena_alloc(lx->arena, sizeof(BigInt) + size * sizeof(uint32_t));
+    big->size = size;
+    big->negative = false;
+    memcpy(big->limbs, lx->limbs, size * sizeof(uint32_t));
+    t->integer.big = big;
+  }
+}
+
+static void lexer_identifier(Lexer *lx, Token *t) {
+  // Identifiers are usually contained in a chunk and copied directly from it.
+  // Pieces that end at a chunk boundary are saved until the rest is read.
+  const char *start = lx->curr;
+  for (;;) {
+    lx->curr = lexer_span(lx, lx->curr, CHAR_IDENT);
+    if (lx->curr != lx->end)
+      break;
+    arraylist_push_n(lx->scratch, start, lx->curr - start);
+    bool more = lexer_fill(lx);
+    start = lx->curr;
+    if (!more)
+      break;
+  }
+
+  size_t saved = arraylist_size(lx->scratch);
+  size_t size = saved + (size_t)(lx->curr - start);
+  char *name = arena_alloc(lx->arena, size);
+  if (saved > 0)
+    memcpy(name, lx->scratch, saved);
+  memcpy(name + saved, start, size - saved);
+  arraylist_clear(lx->scratch);
+
+  t->type = TOKEN_IDENTIFIER;
+  t->identifier.name = name;
+  t->identifier.size = size;
+}
+
+static TokenType punctuation_type(int c) {
+  switch (c) {
+  case '+':
+    return TOKEN_PLUS;
+  case '-':
+    return TOKEN_MINUS;
+  case '*':
+    return TOKEN_TIMES;
+  case '/':
+    return TOKEN_DIVIDE;
+  case '(':
+    return TOKEN_LPAREN;
+  case ')':
+    return TOKEN_RPAREN;
+  case '[':
+    return TOKEN_LSQUARE;
+  case ']':
+    return TOKEN_RSQUARE;
+  case ',':
+    return TOKEN_COMMA;
+  case '=':
+    return TOKEN_ASSIGN;
+  default:
+    // Unknown character
+    return TOKEN_CHARACTER;
+  }
+}
+
+// Read the next token into lx->token. The end of input is reported by an
+// endless sequence of TOKEN_EOF.
+static void lexer_next(Lexer *lx) {
+  // Tokens are rarely separated by more than a space, which is skipped before
+  // looking for longer runs
+  while (lexer_fill(lx) && char_is((unsigned char)*lx->curr, CHAR_SPACE)) {
+    lx->curr = lexer_span(lx, lx->curr + 1, CHAR_SPACE);
+    if (lx->curr != lx->end)
+      break;
+  }
+
+  int c = lexer_peek_char(lx);
+  Token t = {.loc.start = lexer_offset(lx)};
+  if (c == EOF) {
+    t.type = TOKEN_EOF;
+  } else if (char_is(c, CHAR_DIGIT)) {
+    lexer_integer(lx, &t);
+  } else if (char_is(c, CHAR_LETTER)) {
+    lexer_identifier(lx, &t);
+  } else {
+    t.type = punctuation_type(c);
+    lx->curr += 1;
+  }
+  t.loc.end = lexer_offset(lx);
+  lx->token = t;
+}
+
+// Start reading from the given source. Identifier names are allocated in the
+// given arena.
+static void lexer_init(Lexer *lx, InputSource source, Arena *arena) {
+  *lx = (Lexer){
+      .source = source, .arena = arena, .classifier = char_classifier()};
+  lexer_next(lx);
+}
+
+static void free_lexer(Lexer *lx) {
+  arraylist_free(lx->scratch);
+  arraylist_free(lx->limbs);
+  *lx = (Lexer){0};
+}
+
+//===----------------------------------------------------------------------===//
+// Parsing
+//===----------------------------------------------------------------------===//
+
+// Diagnostic locations are byte offsets from the start of the line
+typedef struct Diagnostic {
+  const char *message;
+  size_t start;
+  size_t end;
+} Diagnostic;
+
+typedef struct Sheet Sheet;
+
+#define NO_VARIABLE SIZE_MAX
+
+static size_t sheet_find(const Sheet *sheet, const char *name, size_t size);
+static size_t sheet_intern(Sheet *sheet, const char *name, size_t size);
+static bool sheet_has_value(const Sheet *sheet, size_t index);
+
+typedef enum PendingKind {
+  PENDING_BINARY,
+  PENDING_UNARY,
+  PENDING_PAREN,
+  PENDING_VECTOR
+} PendingKind;
+
+// A construct waiting for its last operand to be parsed
+typedef struct Pending {
+  struct Pending *prev;
+  PendingKind kind;
+  int min_prec; // Precedence at which parsing resumes once it is complete
+  union {
+    BinaryOperator binary;
+    UnaryOperator unary;
+  } op;
+  Expression *lhs;       // Left operand of a binary operator
+  Expression **elements; // Elements of a vector parsed so far
+  bool valid;
+} Pending;
+
+typedef struct Parser {
+  Lexer *lexer;
+  Arena *arena;
+  Diagnostic **diagnostics;
+  Sheet *sheet;       // Null when variables are not available
+  bool in_definition; // Definitions may refer to variables without a value
+  Pending *pending;   // Innermost construct being parsed
+  Pending *unused;    // Completed entries, kept for reuse
+  // Allocator of the lists of elements of vectors, taking from the arena
+  ArrayListAllocator list_allocator;
+} Parser;
+
+static void parser_error(Parser *p, const char *msg, const Token *token) {
+  Diagnostic d = {
+      .message = msg, .start = token->loc.start, .end = token->loc.end};
+  arraylist_push(*p->diagnostics, d);
+}
+
+static const Token *parser_peek(const Parser *p) { return &p->lexer->token; }
+
+static void parser_advance(Parser *p) { lexer_next(p->lexer); }
+
+static Pending *parser_push(Parser *p, PendingKind kind, int min_prec) {
+  Pending *pending = p->unused;
+  if (pending)
+    p->unused = pending->prev;
+  else
+    pending = arena_alloc(p->arena, sizeof(Pending));
+  *pending = (Pending){
+      .prev = p->pending, .kind = kind, .min_prec = min_prec, .valid = true};
+  p->pending = pending;
+  return pending;
+}
+
+static void parser_pop(Parser *p) {
+  Pending *pending = p->pending;
+  p->pending = pending->prev;
+  pending->prev = p->unused;
+  p->unused = pending;
+}
+
+static Expression *parse_variable(Parser *const p, const Token *token) {
+  const char *name = token->identifier.name;
+  size_t size = token->identifier.size;
+  if (!p->sheet) {
+    parser_error(p, "Variables are not available in this mode", token);
+    return expr_invalid();
+  }
+  if (p->in_definition)
+    return expr_variable(p->arena, sheet_intern(p->sheet, name, size));
+
+  size_t index = sheet_find(p->sheet, name, size);
+  if (index == NO_VARIABLE || !sheet_has_value(p->sheet, index)) {
+    parser_error(p, "Variable has no value", token);
+    return expr_invalid();
+  }
+  return expr_variable(p->arena, index);
+}
+
+// Sums bind less tightly than products. A sign applies to the whole product
+// that follows it, so '-2*3' is '-(2*3)'.
+#define PREC_SUM 1
+#define PREC_PRODUCT 2
+
+// Return the precedence of a binary operator, or 0 if the token is not one
+static int binary_precedence(TokenType type, BinaryOperator *op) {
+  switch (type) {
+  case TOKEN_PLUS:
+    *op = BINARY_OP_ADD;
+    return PREC_SUM;
+  case TOKEN_MINUS:
+    *op = BINARY_OP_SUB;
+    return PREC_SUM;
+  case TOKEN_TIMES:
+    *op = BINARY_OP_MUL;
+    return PREC_PRODUCT;
+  case TOKEN_DIVIDE:
+    *op = BINARY_OP_DIV;
+    return PREC_PRODUCT;
+  default:
+    return 0;
+  }
+}
+
+// Parse the start of an operand. Return it if it is a leaf. Otherwise, open a
+// construct waiting for the rest, set the precedence at which its operand is
+// parsed and return null.
+static Expression *parse_prefix(Parser *const p, int *min_prec) {
+  Token curr = *parser_peek(p);
+  parser_advance(p);
+  switch (curr.type) {
+  case TOKEN_INTEGER:
+    if (curr.integer.big)
+      return expr_bigint(p->arena, curr.integer.big);
+    return expr_integer(p->arena, curr.integer.value);
+  case TOKEN_PLUS:
+  case TOKEN_MINUS:
+    parser_push(p, PENDING_UNARY, *min_prec)->op.unary =
+        curr.type == TOKEN_PLUS ? UNARY_OP_PLUS : UNARY_OP_NEG;
+    *min_prec = PREC_PRODUCT;
+    return 0;
+  case TOKEN_LPAREN:
+    parser_push(p, PENDING_PAREN, *min_prec);
+    *min_prec = PREC_SUM;
+    return 0;
+  case TOKEN_IDENTIFIER:
+    return parse_variable(p, &curr);
+  case TOKEN_LSQUARE:
+    if (parser_peek(p)->type == TOKEN_RSQUARE) {
+      parser_advance(p);
+      return expr_vector(p->arena, 0, 0);
+    }
+    // The elements are copied to the vector once complete, so their list
+    // stays in the arena like the rest of the line
+    arraylist_init_with(parser_push(p, PENDING_VECTOR, *min_prec)->elements,
+                        ARRAYLIST_INIT_CAPACITY, &p->list_allocator);
+    *min_prec = PREC_SUM;
+    return 0;
+  default:
+    parser_error(p, "Unexpected token", &curr);
+    return expr_invalid();
+  }
+}
+
+// Hand a complete operand to the innermost pending construct. Return the
+// resulting expression, or null if the construct needs another operand.
+static Expression *parse_complete(Parser *const p, Expression *expr,
+                                  int *min_prec) {
+  Pending *top = p->pending;
+  switch (top->kind) {
+  case PENDING_BINARY:
+    expr = expr_binary_op(p->arena, top->op.binary, top->lhs, expr);
+    break;
+  case PENDING_UNARY:
+    expr = expr_unary_op(p->arena, top->op.unary, expr);
+    break;
+  case PENDING_PAREN:
+    if (parser_peek(p)->type != TOKEN_RPAREN) {
+      parser_error(p, "Expected closing ')' at end of expression",
+                   parser_peek(p));
+      if (expr->valid)
+        expr->valid = false;
+    } else {
+      parser_advance(p);
+    }
+    break;
+  case PENDING_VECTOR:
+    top->valid = top->valid && expr->valid;
+    arraylist_push(top->elements, expr);
+    switch (parser_peek(p)->type) {
+    case TOKEN_COMMA:
+      parser_advance(p);
+      *min_prec = PREC_SUM;
+      return 0;
+    case TOKEN_RSQUARE:
+      parser_advance(p);
+      break;
+    default:
+      parser_error(p, "Expected ',' or ']' in vector", parser_peek(p));
+      top->valid = false;
+      break;
+    }
+    expr = expr_vector(p->arena, top->elements, arraylist_size(top->elements));
+    arraylist_free(top->elements);
+    expr->valid = expr->valid && top->valid;
+    break;
+  default:
+    UNREACHABLE("Unexpected pending construct");
+  }
+  *min_prec = top->min_prec;
+  parser_pop(p);
+  return expr;
+}
+
+// Parse an expression with an operator-precedence parser. Constructs waiting
+// for an operand are kept on an explicit stack instead of the C stack, so that
+// nesting is only limited by memory. If factor is not null, it was already
+// parsed as the first factor of the expression.
+static Expression *parse_expression(Parser *const p, Expression *factor) {
+  Pending *outer = p->pending;
+  int min_prec = PREC_SUM;
+  Expression *expr = factor;
+  for (;;) {
+    while (!expr)
+      expr = parse_prefix(p, &min_prec);
+
+    BinaryOperator op = BINARY_OP_ADD;
+    int prec = binary_precedence(parser_peek(p)->type, &op);
+    if (prec >= min_prec) {
+      // Operators are left-associative, the right operand only takes in
+      // operators binding more tightly
+      parser_advance(p);
+      Pending *pending = parser_push(p, PENDING_BINARY, min_prec);
+      pending->op.binary = op;
+      pending->lhs = expr;
+      min_prec = prec + 1;
+      expr = 0;
+      continue;
+    }
+
+    if (p->pending == outer)
+      return expr;
+    expr = parse_complete(p, expr, &min_prec);
+  }
+}
+
+// Parse an expression whose first factor, if not null, was already parsed
+static Expression *parse_until_eof(Parser *const p, Expression *factor) {
+  Expression *expr = parse_expression(p, factor);
+  if (parser_peek(p)->type != TOKEN_EOF) {
+    parser_error(p, "Unexpected input after expression", parser_peek(p));
+    if (expr->valid)
+      expr->valid = false;
+  }
+  return expr;
+}
+
+typedef struct Statement {
+  Expression *expr;
+  size_t target;       // Variable being assigned, or NO_VARIABLE
+  Location target_loc; // Location of the assigned variable's name
+  size_t definition;   // Offset of the expression assigned to it
+} Statement;
+
+#ifndef CALC_LIBRARY
+// Parse either a plain expression or an assignment of the form 'name = expr'.
+// Variables are resolved in the given sheet, assigned ones being created if
+// needed. All nodes are allocated in the given arena and are released together
+// by resetting it. Diagnostics are appended to the given list.
+static Statement parse_statement(Lexer *lexer, Arena *arena, Sheet *sheet,
+                                 Diagnostic **diagnostics) {
+  Parser p = {.lexer = lexer,
+              .arena = arena,
+              .diagnostics = diagnostics,
+              .sheet = sheet,
+              .list_allocator = arena_list_allocator(arena)};
+  if (parser_peek(&p)->type != TOKEN_IDENTIFIER)
+    return (Statement){.expr = parse_until_eof(&p, 0), .target = NO_VARIABLE};
+
+  // A leading name is either assigned or the first factor of an expression
+  Token name = *parser_peek(&p);
+  parser_advance(&p);
+  if (parser_peek(&p)->type != TOKEN_ASSIGN) {
+    Expression *factor = parse_variable(&p, &name);
+    return (Statement){.expr = parse_until_eof(&p, factor),
+                       .target = NO_VARIABLE};
+  }
+
+  Statement result = {.target = NO_VARIABLE, .target_loc = name.loc};
+  if (!sheet) {
+    parser_error(&p, "Variables are not available in this mode", &name);
+    result.expr = expr_invalid();
+    return result;
+  }
+
+  parser_advance(&p);
+  p.in_definition = true;
+  result.definition = parser_peek(&p)->loc.start;
+  result.expr = parse_until_eof(&p, 0);
+  if (result.expr->valid)
+    result.target =
+        sheet_intern(sheet, name.identifier.name, name.identifier.size);
+  return result;
+}
+#endif // CALC_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Vector kernels
+//===----------------------------------------------------------------------===//
+
+// Element-wise operations over int buffers. Lanes wrap around on overflow, so
+// the scalar versions compute in unsigned arithmetic to match the SIMD ones.
+// The best implementation supported by the CPU is selected on first use.
+
+typedef void (*VectorKernel)(int *dst, const int *a, const int *b, size_t n);
+typedef void (*BroadcastKernel)(int *dst, const int *a, int b, size_t n);
+
+typedef struct VectorKernels {
+  const char *name;
+  // Indexed by binary operator, division is handled separately
+  VectorKernel vector[3];   // dst = a op b
+  BroadcastKernel left[3];  // dst = a op scalar
+  BroadcastKernel right[3]; // dst = scalar op a
+} VectorKernels;
+
+#define SCALAR_ADD(a, b) ((int)((unsigned)(a) + (unsigned)(b)))
+#define SCALAR_SUB(a, b) ((int)((unsigned)(a) - (unsigned)(b)))
+#define SCALAR_MUL(a, b) ((int)((unsigned)(a) * (unsigned)(b)))
+
+// Define the kernels of one operation. The SIMD part processes width lanes at
+// a time and the remaining elements go through the scalar operation.
+#define DEFINE_VECTOR_KERNELS(name, attr, type, width, load, store, set1, op,  \
+                              scalar_op)                                       \
+  attr static void name##_vector(int *dst, const int *a, const int *b,         \
+                                 size_t n) {                                   \
+    size_t i = 0;                                                              \
+    for (; i + (width) <= n; i += (width))                                     \
+      store((type *)(dst + i),                                                 \
+            op(load((const type *)(a + i)), load((const type *)(b + i))));     \
+    for (; i < n; ++i)                                                         \
+      dst[i] = scalar_op(a[i], b[i]);                                          \
+  }                                                                            \
+  attr static void name##_left(int *dst, const int *a, int b, size_t n) {      \
+    size_t i = 0;                                                              \
+    type vb = set1(b);                                                         \
+    for (; i + (width) <= n; i += (width))                                     \
+      store((type *)(dst + i), op(load((const type *)(a + i)), vb));           \
+    for (; i < n; ++i)                                                         \
+      dst[i] = scalar_op(a[i], b);                                             \
+  }                                                                            \
+  attr static void name##_right(int *dst, const int *a, int b, size_t n) {     \
+    size_t i = 0;                                                              \
+    type vb = set1(b);                                                         \
+    for (; i + (width) <= n; i += (width))                                     \
+      store((type *)(dst + i), op(vb, load((const type *)(a + i))));           \
+    for (; i < n; ++i)                                                         \
+      dst[i] = scalar_op(b, a[i]);                                             \
+  }
+
+#define IDENTITY(x) (x)
+#define LOAD_SCALAR(p) (*(p))
+#define STORE_SCALAR(p, x) (*(p) = (x))
+
+DEFINE_VECTOR_KERNELS(scalar_add, , int, 1, LOAD_SCALAR, STORE_SCALAR,
+                      IDENTITY, SCALAR_ADD, SCALAR_ADD)
+DEFINE_VECTOR_KERNELS(scalar_sub, , int, 1, LOAD_SCALAR, STORE_SCALAR,
+                      IDENTITY, SCALAR_SUB, SCALAR_SUB)
+DEFINE_VECTOR_KERNELS(scalar_mul, , int, 1, LOAD_SCALAR, STORE_SCALAR,
+                      IDENTITY, SCALAR_MUL, SCALAR_MUL)
+
+static const VectorKernels scalar_kernels = {
+    .name = "scalar",
+    .vector = {scalar_add_vector, scalar_sub_vector, scalar_mul_vector},
+    .left = {scalar_add_left, scalar_sub_left, scalar_mul_left},
+    .right = {scalar_add_right, scalar_sub_right, scalar_mul_right},
+};
+
+#if CALC_SSE2
+// SSE2 has no 32-bit multiplication keeping the low half of the products, so
+// even and odd lanes are multiplied separately and shuffled back together
+static __m128i mullo_epi32_sse2(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+DEFINE_VECTOR_KERNELS(sse2_add, , __m128i, 4, _mm_loadu_si128,
+                      _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32,
+                      SCALAR_ADD)
+DEFINE_VECTOR_KERNELS(sse2_sub, , __m128i, 4, _mm_loadu_si128,
+                      _mm_storeu_si128, _mm_set1_epi32, _mm_sub_epi32,
+                      SCALAR_SUB)
+DEFINE_VECTOR_KERNELS(sse2_mul, , __m128i, 4, _mm_loadu_si128,
+                      _mm_storeu_si128, _mm_set1_epi32, mullo_epi32_sse2,
+                      SCALAR_MUL)
+
+static const VectorKernels sse2_kernels = {
+    .name = "sse2",
+    .vector = {sse2_add_vector, sse2_sub_vector, sse2_mul_vector},
+    .left = {sse2_add_left, sse2_sub_left, sse2_mul_left},
+    .right = {sse2_add_right, sse2_sub_right, sse2_mul_right},
+};
+
+#if CALC_AVX2
+DEFINE_VECTOR_KERNELS(avx2_add, AVX2, __m256i, 8, _mm256_loadu_si256,
+                      _mm256_storeu_si256, _mm256_set1_epi32, _mm256_add_epi32,
+                      SCALAR_ADD)
+DEFINE_VECTOR_KERNELS(avx2_sub, AVX2, __m256i, 8, _mm256_loadu_si256,
+                      _mm256_storeu_si256, _mm256_set1_epi32, _mm256_sub_epi32,
+                      SCALAR_SUB)
+DEFINE_VECTOR_KERNELS(avx2_mul, AVX2, __m256i, 8, _mm256_loadu_si256,
+                      _mm256_storeu_si256, _mm256_set1_epi32,
+                      _mm256_mullo_epi32, SCALAR_MUL)
+
+static const VectorKernels avx2_kernels = {
+    .name = "avx2",
+    .vector = {avx2_add_vector, avx2_sub_vector, avx2_mul_vector},
+    .left = {avx2_add_left, avx2_sub_left, avx2_mul_left},
+    .right = {avx2_add_right, avx2_sub_right, avx2_mul_right},
+};
+#endif
+#endif // CALC_SSE2
+
+static const VectorKernels *selected_kernels = &scalar_kernels;
+static once_flag kernels_once = ONCE_FLAG_INIT;
+
+static void select_vector_kernels(void) {
+#if CALC_SSE2
+  selected_kernels = &sse2_kernels;
+#if CALC_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    selected_kernels = &avx2_kernels;
+#endif
+#endif
+}
+
+static const VectorKernels *vector_kernels(void) {
+  call_once(&kernels_once, select_vector_kernels);
+  return selected_kernels;
+}
+
+// Like the other lane operations, INT_MIN / -1 wraps around instead of
+// trapping
+static int lane_div(int a, int b) {
+  return b == -1 ? (int)(0u - (unsigned)a) : a / b;
+}
+
+// There is no SIMD integer division, so it is always done one element at a
+// time. Return false on division by zero.
+static bool vector_div(int *dst, const int *a, const int *b, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (b[i] == 0)
+      return false;
+    dst[i] = lane_div(a[i], b[i]);
+  }
+  return true;
+}
+
+static bool vector_div_left(int *dst, const int *a, int b, size_t n) {
+  if (b == 0)
+    return false;
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = lane_div(a[i], b);
+  return true;
+}
+
+static bool vector_div_right(int *dst, const int *a, int b, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (a[i] == 0)
+      return false;
+    dst[i] = lane_div(b, a[i]);
+  }
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Evaluation
+//===----------------------------------------------------------------------===//
+
+typedef struct Evaluator {
+  const int *env;    // Values of the variables
+  const char *error; // First error encountered, if any
+  ExprWalk walk;     // Traversal state, reused across evaluations
+  Number *values;    // Values of the operands not consumed yet
+} Evaluator;
+
+static Number number_integer(int value) {
+  return (Number){.type = NUMBER_INTEGER, .integer = value};
+}
+
+// Take ownership of value, demoting it to an int if it fits
+static Number number_bigint(BigInt *value) {
+  int small;
+  if (bigint_to_int(value, &small)) {
+    ALLOC_FREE(value);
+    return number_integer(small);
+  }
+  return (Number){.type = NUMBER_BIGINT, .bigint = value};
+}
+
+// Take ownership of num and den, which must not be zero, and reduce num / den
+// to lowest terms
+static Number number_fraction(BigInt *num, BigInt *den) {
+  if (den->negative) {
+    den->negative = false;
+    num->negative = num->size > 0 && !num->negative;
+  }
+  BigInt *gcd = bigint_gcd(num, den);
+  if (!bigint_is_one(gcd)) {
+    BigInt *reduced_num = bigint_divmod(num, gcd, 0);
+    BigInt *reduced_den = bigint_divmod(den, gcd, 0);
+    ALLOC_FREE(num);
+    ALLOC_FREE(den);
+    num = reduced_num;
+    den = reduced_den;
+  }
+  ALLOC_FREE(gcd);
+  if (bigint_is_one(den)) {
+    ALLOC_FREE(den);
+    return number_bigint(num);
+  }
+  return (Number){.type = NUMBER_FRACTION, .fraction = {num, den}};
+}
+
+static void free_number(Number *n) {
+  switch (n->type) {
+  case NUMBER_BIGINT:
+    ALLOC_FREE(n->bigint);
+    break;
+  case NUMBER_FRACTION:
+    ALLOC_FREE(n->fraction.num);
+    ALLOC_FREE(n->fraction.den);
+    break;
+  case NUMBER_VECTOR:
+    arraylist_free(n->vector);
+    break;
+  default:
+    break;
+  }
+  *n = number_integer(0);
+}
+
+#ifndef CALC_LIBRARY
+static Number copy_number(Number n) {
+  if (n.type == NUMBER_BIGINT) {
+    n.bigint = bigint_copy(n.bigint);
+  } else if (n.type == NUMBER_FRACTION) {
+    n.fraction.num = bigint_copy(n.fraction.num);
+    n.fraction.den = bigint_copy(n.fraction.den);
+  } else if (n.type == NUMBER_VECTOR) {
+    int *vector = 0;
+    arraylist_extend(vector, n.vector);
+    n.vector = vector;
+  }
+  return n;
+}
+#endif // CALC_LIBRARY
+
+#if !defined(CALC_NO_MAIN) || defined(CALC_LIBRARY)
+static void print_number(FILE *out, Number n) {
+  switch (n.type) {
+  case NUMBER_INTEGER:
+    fprintf(out, "%d\n", n.integer);
+    break;
+  case NUMBER_BIGINT:
+    bigint_print(out, n.bigint);
+    putc('\n', out);
+    break;
+  case NUMBER_FRACTION:
+    bigint_print(out, n.fraction.num);
+    putc('/', out);
+    bigint_print(out, n.fraction.den);
+    putc('\n', out);
+    break;
+  case NUMBER_VECTOR:
+    putc('[', out);
+    for (size_t i = 0; i < arraylist_size(n.vector); ++i)
+      fprintf(out, i > 0 ? ", %d" : "%d", n.vector[i]);
+    fputs("]\n", out);
+    break;
+  default:
+    UNREACHABLE("Unexpected number type");
+  }
+}
+#endif
+
+static void eval_error(Evaluator *ev, const char *msg) {
+  if (!ev->error)
+    ev->error = msg;
+}
+
+static Number eval_number(Number n) {
+  switch (n.type) {
+  case NUMBER_INTEGER:
+    return n;
+  case NUMBER_BIGINT:
+    return (Number){.type = NUMBER_BIGINT, .bigint = bigint_copy(n.bigint)};
+  default:
+    UNREACHABLE("Unexpected number type");
+  }
+}
+
+// Evaluate an element-wise operation where at least one of the operands is a
+// vector. The storage of a vector operand is reused for the result.
+static Number eval_vector_binop(Evaluator *ev, BinaryOperator op, Number lhs,
+                                Number rhs) {
+  const VectorKernels *kernels = vector_kernels();
+  bool ok = true;
+
+  if ((lhs.type != NUMBER_VECTOR && lhs.type != NUMBER_INTEGER) ||
+      (rhs.type != NUMBER_VECTOR && rhs.type != NUMBER_INTEGER)) {
+    eval_error(ev, "Vector elements must be machine integers");
+    free_number(&lhs);
+    free_number(&rhs);
+    return number_integer(0);
+  }
+
+  if (lhs.type == NUMBER_VECTOR && rhs.type == NUMBER_VECTOR) {
+    size_t n = arraylist_size(lhs.vector);
+    if (n != arraylist_size(rhs.vector)) {
+      eval_error(ev, "Vector sizes do not match");
+    } else if (op == BINARY_OP_DIV) {
+      ok = vector_div(lhs.vector, lhs.vector, rhs.vector, n);
+    } else {
+      kernels->vector[op](lhs.vector, lhs.vector, rhs.vector, n);
+    }
+    free_number(&rhs);
+    if (!ok)
+      eval_error(ev, "Division by zero");
+    return lhs;
+  }
+
+  if (lhs.type == NUMBER_VECTOR) {
+    size_t n = arraylist_size(lhs.vector);
+    if (op == BINARY_OP_DIV)
+      ok = vector_div_left(lhs.vector, lhs.vector, rhs.integer, n);
+    else
+      kernels->left[op](lhs.vector, lhs.vector, rhs.integer, n);
+    if (!ok)
+      eval_error(ev, "Division by zero");
+    return lhs;
+  }
+
+  size_t n = arraylist_size(rhs.vector);
+  if (op == BINARY_OP_DIV)
+    ok = vector_div_right(rhs.vector, rhs.vector, lhs.integer, n);
+  else
+    kernels->right[op](rhs.vector, rhs.vector, lhs.integer, n);
+  if (!ok)
+    eval_error(ev, "Division by zero");
+  return rhs;
+}
+
+// Return a new big integer holding an integer scalar
+static BigInt *number_to_bigint(Number n) {
+  return n.type == NUMBER_INTEGER ? bigint_from_int64(n.integer)
+                                  : bigint_copy(n.bigint);
+}
+
+// Store a scalar as a numerator and a denominator, both newly allocated
+static void number_to_ratio(Number n, BigInt **num, BigInt **den) {
+  if (n.type == NUMBER_FRACTION) {
+    *num = bigint_copy(n.fraction.num);
+    *den = bigint_copy(n.fraction.den);
+  } else {
+    *num = number_to_bigint(n);
+    *den = bigint_from_int64(1);
+  }
+}
+
+static Number eval_ratio_binop(Evaluator *ev, BinaryOperator op, Number lhs,
+                               Number rhs) {
+  BigInt *a, *b, *c, *d; // lhs = a / b and rhs = c / d
+  number_to_ratio(lhs, &a, &b);
+  number_to_ratio(rhs, &c, &d);
+  BigInt *num = 0, *den = 0;
+  switch (op) {
+  case BINARY_OP_ADD:
+  case BINARY_OP_SUB: {
+    BigInt *ad = bigint_mul(a, d), *cb = bigint_mul(c, b);
+    num = bigint_add(ad, cb, op == BINARY_OP_SUB);
+    den = bigint_mul(b, d);
+    ALLOC_FREE(ad);
+    ALLOC_FREE(cb);
+  } break;
+  case BINARY_OP_MUL:
+    num = bigint_mul(a, c);
+    den = bigint_mul(b, d);
+    break;
+  case BINARY_OP_DIV:
+    if (c->size == 0) {
+      eval_error(ev, "Division by zero");
+      break;
+    }
+    num = bigint_mul(a, d);
+    den = bigint_mul(b, c);
+    break;
+  default:
+    UNREACHABLE("Unexpected binary operator");
+  }
+  ALLOC_FREE(a);
+  ALLOC_FREE(b);
+  ALLOC_FREE(c);
+  ALLOC_FREE(d);
+  return num ? number_fraction(num, den) : number_integer(0);
+}
+
+// Compute an operation on ints. Return false if the result is not an int.
+static bool eval_int_binop(BinaryOperator op, int a, int b, int *result) {
+  switch (op) {
+  case BINARY_OP_ADD:
+    return !__builtin_add_overflow(a, b, result);
+  case BINARY_OP_SUB:
+    return !__builtin_sub_overflow(a, b, result);
+  case BINARY_OP_MUL:
+    return !__builtin_mul_overflow(a, b, result);
+  case BINARY_OP_DIV:
+    if (b == 0 || b == -1 || a % b != 0)
+      return false;
+    *result = a / b;
+    return true;
+  default:
+    UNREACHABLE("Unexpected binary operator");
+  }
+}
+
+// Scalar arithmetic is exact. Operations on ints stay on a fast path unless
+// they overflow, and division only produces a fraction when it is inexact.
+static Number eval_scalar_binop(Evaluator *ev, BinaryOperator op, Number lhs,
+                                Number rhs) {
+  if (lhs.type == NUMBER_INTEGER && rhs.type == NUMBER_INTEGER) {
+    int a = lhs.integer, b = rhs.integer, r;
+    if (eval_int_binop(op, a, b, &r))
+      return number_integer(r);
+    switch (op) {
+    case BINARY_OP_ADD:
+      return number_bigint(bigint_from_int64((int64_t)a + b));
+    case BINARY_OP_SUB:
+      return number_bigint(bigint_from_int64((int64_t)a - b));
+    case BINARY_OP_MUL:
+      return number_bigint(bigint_from_int64((int64_t)a * b));
+    case BINARY_OP_DIV:
+      if (b == 0) {
+        eval_error(ev, "Division by zero");
+        return number_integer(0);
+      }
+      return number_fraction(bigint_from_int64(a), bigint_from_int64(b));
+    default:
+      UNREACHABLE("Unexpected binary operator");
+    }
+  }
+
+  Number result;
+  if (lhs.type != NUMBER_FRACTION && rhs.type != NUMBER_FRACTION &&
+      op != BINARY_OP_DIV) {
+    BigInt *a = number_to_bigint(lhs), *b = number_to_bigint(rhs);
+    result = number_bigint(op == BINARY_OP_MUL
+                               ? bigint_mul(a, b)
+                               : bigint_add(a, b, op == BINARY_OP_SUB));
+    ALLOC_FREE(a);
+    ALLOC_FREE(b);
+  } else {
+    result = eval_ratio_binop(ev, op, lhs, rhs);
+  }
+  free_number(&lhs);
+  free_number(&rhs);
+  return result;
+}
+
+static Number eval_binop(Evaluator *ev, BinaryOperator op, Number lhs,
+                         Number rhs) {
+  if (lhs.type == NUMBER_VECTOR || rhs.type == NUMBER_VECTOR)
+    return eval_vector_binop(ev, op, lhs, rhs);
+  return eval_scalar_binop(ev, op, lhs, rhs);
+}
+
+static Number eval_unop(UnaryOperator op, Number n) {
+  switch (op) {
+  case UNARY_OP_PLUS:
+    return n;
+  case UNARY_OP_NEG:
+    switch (n.type) {
+    case NUMBER_INTEGER:
+      if (n.integer == INT_MIN)
+        return number_bigint(bigint_from_int64(-(int64_t)INT_MIN));
+      return number_integer(-n.integer);
+    case NUMBER_BIGINT:
+      n.bigint->negative = !n.bigint->negative;
+      return number_bigint(n.bigint);
+    case NUMBER_FRACTION:
+      n.fraction.num->negative = !n.fraction.num->negative;
+      return n;
+    case NUMBER_VECTOR:
+      vector_kernels()->right[BINARY_OP_SUB](n.vector, n.vector, 0,
+                                             arraylist_size(n.vector));
+      return n;
+    default:
+      UNREACHABLE("Unexpected number type");
+    }
+  default:
+    UNREACHABLE("Unexpected unary operator");
+  }
+}
+
+// Build a vector, taking ownership of the values of its elements unless they
+// are all constants
+static Number eval_vector(Evaluator *ev, const Vector *v, Number *elements) {
+  int *result = 0;
+  if (v->size == 0)
+    return (Number){.type = NUMBER_VECTOR, .vector = 0};
+
+  arraylist_grow(result, v->size);
+  arraylist_ptr(result)->size = v->size;
+  if (!v->elements) {
+    memcpy(result, v->values, v->size * sizeof(int));
+    return (Number){.type = NUMBER_VECTOR, .vector = result};
+  }
+
+  for (size_t i = 0; i < v->size; ++i) {
+    Number element = elements[i];
+    if (element.type != NUMBER_INTEGER) {
+      eval_error(ev, element.type == NUMBER_VECTOR
+                         ? "Vectors cannot be nested"
+                         : "Vector elements must be machine integers");
+      free_number(&element);
+    }
+    result[i] = element.integer;
+  }
+  return (Number){.type = NUMBER_VECTOR, .vector = result};
+}
+
+// Apply an operator to the values of its operands, taking ownership of them
+static Number eval_operator(Evaluator *ev, const Expression *expr,
+                            Number *operands) {
+  switch (expr->type) {
+  case EXPR_BINARY_OP:
+    return eval_binop(ev, expr->binary_op.op, operands[0], operands[1]);
+  case EXPR_UNARY_OP:
+    return eval_unop(expr->unary_op.op, operands[0]);
+  case EXPR_VECTOR:
+    return eval_vector(ev, &expr->vector, operands);
+  default:
+    UNREACHABLE("Expression is not an operator");
+  }
+}
+
+// Forget the values on top of the stack, once they were consumed
+static void eval_drop(Evaluator *ev, size_t count) {
+  if (count > 0)
+    arraylist_ptr(ev->values)->size -= count;
+}
+
+// Evaluate an expression, reading variables from ev->env. The caller owns the
+// result. On error, ev->error is set and the result is meaningless. Nodes are
+// visited in post-order, each operator taking the values of its operands from
+// the top of ev->values.
+static Number eval(Evaluator *ev, const Expression *expr) {
+  expr_walk_start(&ev->walk, expr);
+  while ((expr = expr_walk_next(&ev->walk))) {
+    Number result;
+    size_t top = arraylist_size(ev->values);
+    switch (expr->type) {
+    case EXPR_NUMBER:
+      result = eval_number(expr->number);
+      break;
+    case EXPR_VARIABLE:
+      result = number_integer(ev->env[expr->variable]);
+      break;
+    case EXPR_BINARY_OP: {
+      // Results that stay ints replace the left operand in place
+      Number *lhs = &ev->values[top - 2], *rhs = &ev->values[top - 1];
+      int value;
+      if (lhs->type == NUMBER_INTEGER && rhs->type == NUMBER_INTEGER &&
+          eval_int_binop(expr->binary_op.op, lhs->integer, rhs->integer,
+                         &value)) {
+        lhs->integer = value;
+        eval_drop(ev, 1);
+        continue;
+      }
+    }
+      // Fall through
+    default: {
+      size_t count = expr_operand_count(expr);
+      result = eval_operator(ev, expr, count ? ev->values + top - count : 0);
+      eval_drop(ev, count);
+    } break;
+    }
+    arraylist_push(ev->values, result);
+  }
+  return arraylist_pop(ev->values);
+}
+
+static void free_evaluator(Evaluator *ev) {
+  free_expr_walk(&ev->walk);
+  arraylist_free(ev->values);
+}
+
+//===----------------------------------------------------------------------===//
+// Optimization
+//===----------------------------------------------------------------------===//
+
+// With --optimize, parsed trees are rewritten before being evaluated. Operators
+// on int literals are folded when the result is an int, identities such as x*1,
+// x+0, --x and +x are simplified, and nodes with the same contents are shared
+// so that the tree becomes a DAG. Folding only happens when eval_int_binop
+// succeeds, leaving overflows, fractions and errors to evaluation, so results
+// and diagnostics are unchanged. Only the flat evaluator takes advantage of
+// sharing, the others visit a shared node once for each of its parents.
+
+typedef struct Optimizer {
+  ExprWalk walk;
+  const Expression **results; // Rewritten operands of the current operator
+  Expression **elements;      // Rewritten elements of a vector
+  ExprTable nodes;            // Distinct nodes of the rewritten tree
+} Optimizer;
+
+static bool opt_integer(const Expression *expr, int *value) {
+  if (expr->type != EXPR_NUMBER || expr->number.type != NUMBER_INTEGER)
+    return false;
+  *value = expr->number.integer;
+  return true;
+}
+
+// Return the node equal to key if there is one, or else add key, copying it to
+// the arena unless it is the original node
+static const Expression *opt_intern(Optimizer *opt, Arena *arena,
+                                    const Expression *original,
+                                    const Expression *key) {
+  uint32_t index = expr_table_find(&opt->nodes, key);
+  if (index != EXPR_TABLE_EMPTY_SLOT)
+    return opt->nodes.nodes[index];
+  if (key != original) {
+    Expression *copy = arena_alloc(arena, sizeof(Expression));
+    *copy = *key;
+    key = copy;
+  }
+  expr_table_add(&opt->nodes, key);
+  return key;
+}
+
+// Leaves are only added to the table once they are known to be the operand of
+// a node that is kept, since most literals get folded into their parent
+static const Expression *opt_leaf(Optimizer *opt, Arena *arena,
+                                  const Expression *expr) {
+  if (expr->type != EXPR_NUMBER && expr->type != EXPR_VARIABLE)
+    return expr;
+  return opt_intern(opt, arena, expr, expr);
+}
+
+static const Expression *opt_binary_op(Optimizer *opt, Arena *arena,
+                                       const Expression *expr,
+                                       const Expression *lhs,
+                                       const Expression *rhs) {
+  BinaryOperator op = expr->binary_op.op;
+  int a, b, value;
+  bool lhs_int = opt_integer(lhs, &a), rhs_int = opt_integer(rhs, &b);
+  if (lhs_int && rhs_int && eval_int_binop(op, a, b, &value))
+    return expr_integer(arena, value);
+  if (rhs_int && (op == BINARY_OP_ADD || op == BINARY_OP_SUB) && b == 0)
+    return lhs;
+  if (rhs_int && (op == BINARY_OP_MUL || op == BINARY_OP_DIV) && b == 1)
+    return lhs;
+  if (lhs_int && ((op == BINARY_OP_ADD && a == 0) ||
+                  (op == BINARY_OP_MUL && a == 1)))
+    return rhs;
+
+  lhs = opt_leaf(opt, arena, lhs);
+  rhs = opt_leaf(opt, arena, rhs);
+  if (lhs == expr->binary_op.lhs && rhs == expr->binary_op.rhs)
+    return opt_intern(opt, arena, expr, expr);
+  Expression key = *expr;
+  key.binary_op.lhs = (Expression *)lhs;
+  key.binary_op.rhs = (Expression *)rhs;
+  key.binary_op.size =
+      saturate_size(1 + (uint64_t)expr_size(lhs) + expr_size(rhs));
+  return opt_intern(opt, arena, expr, &key);
+}
+
+static const Expression *opt_unary_op(Optimizer *opt, Arena *arena,
+                                      const Expression *expr,
+                                      const Expression *operand) {
+  if (expr->unary_op.op == UNARY_OP_PLUS)
+    return operand;
+  int value;
+  if (opt_integer(operand, &value) && value != INT_MIN)
+    return expr_integer(arena, -value);
+  if (operand->type == EXPR_UNARY_OP && operand->unary_op.op == UNARY_OP_NEG)
+    return operand->unary_op.expr;
+
+  operand = opt_leaf(opt, arena, operand);
+  if (operand == expr->unary_op.expr)
+    return opt_intern(opt, arena, expr, expr);
+  Expression key = *expr;
+  key.unary_op.expr = (Expression *)operand;
+  key.unary_op.size = saturate_size(1 + (uint64_t)expr_size(operand));
+  return opt_intern(opt, arena, expr, &key);
+}
+
+// Vectors whose elements all become constants are stored as values
+static const Expression *opt_vector(Optimizer *opt, Arena *arena,
+                                    const Expression *expr,
+                                    const Expression **elements) {
+  size_t size = expr_operand_count(expr);
+  bool changed = false;
+  arraylist_clear(opt->elements);
+  for (size_t i = 0; i < size; ++i) {
+    const Expression *element = opt_leaf(opt, arena, elements[i]);
+    changed = changed || element != expr->vector.elements[i];
+    arraylist_push(opt->elements, (Expression *)element);
+  }
+  if (!changed)
+    return opt_intern(opt, arena, expr, expr);
+  Expression *vector = expr_vector(arena, opt->elements, size);
+  return opt_intern(opt, arena, vector, vector);
+}
+
+// Rewrite a valid tree into an equivalent DAG allocated in the given arena
+static Expression *optimize(Optimizer *opt, Arena *arena,
+                            const Expression *expr) {
+  expr_table_reset(&opt->nodes);
+  arraylist_clear(opt->results);
+  expr_walk_start(&opt->walk, expr);
+  while ((expr = expr_walk_next(&opt->walk))) {
+    const Expression *result;
+    size_t top = arraylist_size(opt->results);
+    switch (expr->type) {
+    case EXPR_NUMBER:
+    case EXPR_VARIABLE:
+      result = expr;
+      break;
+    case EXPR_BINARY_OP:
+      result = opt_binary_op(opt, arena, expr, opt->results[top - 2],
+                             opt->results[top - 1]);
+      break;
+    case EXPR_UNARY_OP:
+      result = opt_unary_op(opt, arena, expr, opt->results[top - 1]);
+      break;
+    case EXPR_VECTOR:
+      result = opt_vector(opt, arena, expr,
+                          opt->results + top - expr_operand_count(expr));
+      break;
+    default:
+      UNREACHABLE("Unexpected expression type");
+    }
+    size_t count = expr_operand_count(expr);
+    if (count > 0)
+      arraylist_ptr(opt->results)->size -= count;
+    arraylist_push(opt->results, result);
+  }
+  return (Expression *)arraylist_pop(opt->results);
+}
+
+#ifndef CALC_LIBRARY
+// Return the number of distinct nodes of a DAG
+static size_t opt_count_nodes(Optimizer *opt, const Expression *expr) {
+  expr_walk_start_dag(&opt->walk, expr, &opt->nodes);
+  while (expr_walk_next(&opt->walk))
+    ;
+  return arraylist_size(opt->nodes.nodes);
+}
+#endif // CALC_LIBRARY
+
+static void free_optimizer(Optimizer *opt) {
+  free_expr_walk(&opt->walk);
+  arraylist_free(opt->results);
+  arraylist_free(opt->elements);
+  free_expr_table(&opt->nodes);
+}
+
+//===----------------------------------------------------------------------===//
+// Flat trees
+//===----------------------------------------------------------------------===//
+
+#ifndef CALC_LIBRARY
+// A tree can be flattened into arrays holding one entry per node in
+// post-order, operands referring to earlier nodes by 32-bit index. A node
+// takes 13 bytes instead of sizeof(Expression) and evaluation is a single pass
+// over the arrays, the value of each node being stored at its own index.
+// Big literals and vectors keep referring to the nodes they were flattened
+// from, so a flat tree is only valid as long as the original one. Flattening
+// an optimized DAG keeps one entry per distinct node, the operators sharing it
+// all referring to that entry, which is then evaluated only once.
+
+typedef enum FlatOp {
+  FLAT_INTEGER,
+  FLAT_BIGINT,
+  FLAT_VARIABLE,
+  FLAT_VECTOR,
+  FLAT_PLUS,
+  FLAT_NEG,
+  FLAT_ADD, // Binary operators follow in the order of BinaryOperator
+  FLAT_SUB,
+  FLAT_MUL,
+  FLAT_DIV
+} FlatOp;
+
+// Set on the ops of entries that are the operand of several others
+#define FLAT_SHARED 0x80
+
+#ifndef FLAT_VECTOR_STORAGE
+#define FLAT_VECTOR_STORAGE 16 // Elements gathered without heap allocation
+#endif
+
+typedef struct FlatTree {
+  uint8_t *ops;              // FlatOp of each node
+  uint32_t *lhs;             // Left or only operand, or offset in elements
+  uint32_t *rhs;             // Right operand, or operand count of a vector
+  int32_t *values;           // Integer literal, variable, or index in extras
+  uint32_t *elements;        // Operands of vectors, in order
+  const Expression **extras; // Nodes of big literals and vectors
+  uint32_t *roots;           // Subtrees not consumed yet while flattening
+  size_t shared_count;       // Number of entries flagged FLAT_SHARED
+} FlatTree;
+
+static uint32_t flat_pop(FlatTree *t) { return arraylist_pop(t->roots); }
+
+// Flatten a valid tree, reusing the storage already held by t. If visited is
+// not null, expr is flattened as a DAG with the help of that table. Return
+// false if it has too many nodes to be indexed on 32 bits.
+static bool flat_build(FlatTree *t, ExprWalk *walk, const Expression *expr,
+                       ExprTable *visited) {
+  arraylist_clear(t->ops);
+  arraylist_clear(t->lhs);
+  arraylist_clear(t->rhs);
+  arraylist_clear(t->values);
+  arraylist_clear(t->elements);
+  arraylist_clear(t->extras);
+  arraylist_clear(t->roots);
+  t->shared_count = 0;
+
+  // Reserve space for every node up front, sizes being known from parsing.
+  // Those of DAGs count shared nodes as many times as they are referred to.
+  size_t size = expr_size(expr);
+  if (visited) {
+    size = 0;
+    expr_walk_start_dag(walk, expr, visited);
+  } else if (size >= UINT32_MAX) {
+    return false;
+  } else {
+    expr_walk_start(walk, expr);
+  }
+  if (arraylist_capacity(t->ops) < size) {
+    size_t n = size - arraylist_capacity(t->ops);
+    arraylist_grow(t->ops, n);
+    arraylist_grow(t->lhs, n);
+    arraylist_grow(t->rhs, n);
+    arraylist_grow(t->values, n);
+  }
+
+  while ((expr = expr_walk_next(walk))) {
+    if (visited && walk->repeated) {
+      if (!(t->ops[walk->index] & FLAT_SHARED)) {
+        t->ops[walk->index] |= FLAT_SHARED;
+        ++t->shared_count;
+      }
+      arraylist_push(t->roots, walk->index);
+      continue;
+    }
+    size_t index = arraylist_size(t->ops);
+    if (index >= UINT32_MAX || arraylist_size(t->extras) >= INT32_MAX)
+      return false;
+    FlatOp op;
+    uint32_t lhs = 0, rhs = 0;
+    int32_t value = 0;
+    switch (expr->type) {
+    case EXPR_NUMBER:
+      if (expr->number.type == NUMBER_INTEGER) {
+        op = FLAT_INTEGER;
+        value = expr->number.integer;
       } else {
-        // Unknown character
-        t.type = TOKEN_CHARACTER;
-        arraylist_push(result, t);
-        curr += 1;
+        op = FLAT_BIGINT;
+        value = arraylist_size(t->extras);
+        arraylist_push(t->extras, expr);
+      }
+      break;
+    case EXPR_VARIABLE:
+      op = FLAT_VARIABLE;
+      value = expr->variable;
+      break;
+    case EXPR_BINARY_OP:
+      op = FLAT_ADD + expr->binary_op.op;
+      rhs = flat_pop(t);
+      lhs = flat_pop(t);
+      break;
+    case EXPR_UNARY_OP:
+      op = expr->unary_op.op == UNARY_OP_NEG ? FLAT_NEG : FLAT_PLUS;
+      lhs = flat_pop(t);
+      break;
+    case EXPR_VECTOR: {
+      op = FLAT_VECTOR;
+      value = arraylist_size(t->extras);
+      arraylist_push(t->extras, expr);
+      size_t count = expr_operand_count(expr);
+      size_t first = arraylist_size(t->roots) - count;
+      lhs = arraylist_size(t->elements);
+      rhs = count;
+      for (size_t i = 0; i < count; ++i)
+        arraylist_push(t->elements, t->roots[first + i]);
+      if (count > 0)
+        arraylist_ptr(t->roots)->size = first;
+    } break;
+    default:
+      UNREACHABLE("Unexpected expression type");
+    }
+    arraylist_push(t->ops, op);
+    arraylist_push(t->lhs, lhs);
+    arraylist_push(t->rhs, rhs);
+    arraylist_push(t->values, value);
+    arraylist_push(t->roots, index);
+  }
+  return true;
+}
+
+// Take the value of an operand, copying it if other entries still need it
+static Number flat_operand(const FlatTree *t, Number *values, uint32_t index) {
+  return t->ops[index] & FLAT_SHARED ? copy_number(values[index])
+                                     : values[index];
+}
+
+// Evaluate a flat tree like eval, reading variables from ev->env. The value
+// of every node is stored in ev->values at its index until it is consumed.
+static Number flat_eval(Evaluator *ev, const FlatTree *t) {
+  size_t count = arraylist_size(t->ops);
+  arraylist_clear(ev->values);
+  if (arraylist_capacity(ev->values) < count)
+    arraylist_grow(ev->values, count - arraylist_capacity(ev->values));
+  Number *values = ev->values, *elements = 0;
+  arraylist_storage(Number, FLAT_VECTOR_STORAGE) element_storage;
+  arraylist_init_storage(elements, element_storage);
+
+  for (size_t i = 0; i < count; ++i) {
+    Number *lhs = &values[t->lhs[i]], *rhs = &values[t->rhs[i]];
+    switch (t->ops[i] & ~FLAT_SHARED) {
+    case FLAT_INTEGER:
+      values[i] = number_integer(t->values[i]);
+      break;
+    case FLAT_BIGINT:
+      values[i] = eval_number(t->extras[t->values[i]]->number);
+      break;
+    case FLAT_VARIABLE:
+      values[i] = number_integer(ev->env[t->values[i]]);
+      break;
+    case FLAT_VECTOR:
+      arraylist_clear(elements);
+      for (uint32_t j = 0; j < t->rhs[i]; ++j)
+        arraylist_push(elements,
+                       flat_operand(t, values, t->elements[t->lhs[i] + j]));
+      values[i] = eval_vector(ev, &t->extras[t->values[i]]->vector, elements);
+      break;
+    case FLAT_PLUS:
+      values[i] = flat_operand(t, values, t->lhs[i]);
+      break;
+    case FLAT_NEG:
+      values[i] = eval_unop(UNARY_OP_NEG, flat_operand(t, values, t->lhs[i]));
+      break;
+    default: {
+      BinaryOperator op = (t->ops[i] & ~FLAT_SHARED) - FLAT_ADD;
+      int value;
+      if (lhs->type == NUMBER_INTEGER && rhs->type == NUMBER_INTEGER &&
+          eval_int_binop(op, lhs->integer, rhs->integer, &value))
+        values[i] = number_integer(value);
+      else
+        values[i] = eval_binop(ev, op, flat_operand(t, values, t->lhs[i]),
+                               flat_operand(t, values, t->rhs[i]));
+    } break;
+    }
+  }
+  arraylist_free(elements);
+  for (size_t i = 0; t->shared_count > 0 && i < count; ++i) {
+    if (t->ops[i] & FLAT_SHARED)
+      free_number(&values[i]);
+  }
+  return values[count - 1];
+}
+
+static void free_flat_tree(FlatTree *t) {
+  arraylist_free(t->ops);
+  arraylist_free(t->lhs);
+  arraylist_free(t->rhs);
+  arraylist_free(t->values);
+  arraylist_free(t->elements);
+  arraylist_free(t->extras);
+  arraylist_free(t->roots);
+}
+#endif // CALC_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Parallel evaluation
+//===----------------------------------------------------------------------===//
+
+#ifndef CALC_LIBRARY
+// Operands of an operator are independent, so large trees can be evaluated by
+// several threads, using the subtree sizes recorded by the parser. Starting
+// from a large node, the path following the largest operand down to a subtree
+// smaller than PARALLEL_GRAIN is its spine. The operands hanging off the spine
+// are evaluated as tasks of a fork-join pool, small ones in batches of about
+// PARALLEL_GRAIN nodes and large ones split the same way in turn, while the
+// spine is combined bottom-up once they are done. Every operator is applied to
+// the same operands as in eval and the first error in post-order is kept, so
+// results and errors are the same as there.
+
+#define PARALLEL_GRAIN 4096
+
+// Lines shorter than this cannot hold enough nodes to be split
+#define PARALLEL_MIN_LINE_SIZE (4 * PARALLEL_GRAIN)
+
+typedef struct ForkWorker ForkWorker;
+
+typedef struct ForkTask {
+  void (*run)(struct ForkTask *task, ForkWorker *worker);
+  atomic_bool done;
+} ForkTask;
+
+// Every worker owns a deque of tasks. The owner pushes and pops tasks at the
+// back while idle workers steal from the front, the oldest tasks usually being
+// the largest ones.
+struct ForkWorker {
+  struct ForkPool *pool;
+  mtx_t lock;
+  ForkTask **tasks; // Tasks from index head on are waiting
+  size_t head;
+  uint64_t victim; // State of the generator picking workers to steal from
+  Evaluator evaluator;
+  thrd_t thread;
+};
+
+// Worker 0 is the thread calling parallel_eval, the others belong to the pool
+typedef struct ForkPool {
+  ForkWorker *workers;
+  size_t worker_count;
+  mtx_t lock;
+  cnd_t wake;
+  atomic_size_t spawned; // Tasks spawned so far, to tell when to stop waiting
+  atomic_size_t sleeping;
+  atomic_bool stopping;
+  const int *env; // Variables of the expression being evaluated
+} ForkPool;
+
+static void fork_spawn(ForkWorker *w, ForkTask *task) {
+  atomic_store(&task->done, false);
+  mtx_lock(&w->lock);
+  arraylist_push(w->tasks, task);
+  mtx_unlock(&w->lock);
+  ForkPool *pool = w->pool;
+  atomic_fetch_add(&pool->spawned, 1);
+  if (atomic_load(&pool->sleeping) > 0) {
+    mtx_lock(&pool->lock);
+    cnd_signal(&pool->wake);
+    mtx_unlock(&pool->lock);
+  }
+}
+
+// Sleep until a task is spawned after seen was read from pool->spawned, until
+// task is done if not null, or until the pool stops. Waiters count themselves
+// as sleeping before checking, so whoever publishes a change after the check
+// sees them and signals.
+static void fork_wait(ForkPool *pool, size_t seen, ForkTask *task) {
+  mtx_lock(&pool->lock);
+  atomic_fetch_add(&pool->sleeping, 1);
+  while (atomic_load(&pool->spawned) == seen &&
+         !atomic_load(&pool->stopping) && !(task && atomic_load(&task->done)))
+    cnd_wait(&pool->wake, &pool->lock);
+  atomic_fetch_sub(&pool->sleeping, 1);
+  mtx_unlock(&pool->lock);
+}
+
+// Take the newest task of the worker's own deque, or else steal the oldest one
+// of another worker
+static ForkTask *fork_find(ForkWorker *w) {
+  ForkTask *task = 0;
+  mtx_lock(&w->lock);
+  if (arraylist_size(w->tasks) > w->head) {
+    task = arraylist_pop(w->tasks);
+    if (arraylist_size(w->tasks) == w->head) {
+      arraylist_clear(w->tasks);
+      w->head = 0;
+    }
+  }
+  mtx_unlock(&w->lock);
+
+  ForkPool *pool = w->pool;
+  size_t start = (w->victim = w->victim * 6364136223846793005u + 1) >> 33;
+  for (size_t i = 0; !task && i < pool->worker_count; ++i) {
+    ForkWorker *victim = &pool->workers[(start + i) % pool->worker_count];
+    if (victim == w)
+      continue;
+    mtx_lock(&victim->lock);
+    if (arraylist_size(victim->tasks) > victim->head) {
+      task = victim->tasks[victim->head++];
+      if (victim->head == arraylist_size(victim->tasks)) {
+        arraylist_clear(victim->tasks);
+        victim->head = 0;
+      }
+    }
+    mtx_unlock(&victim->lock);
+  }
+  return task;
+}
+
+// Run a task then wake the workers waiting for it, any of them may be joining
+static void fork_run(ForkWorker *w, ForkTask *task) {
+  task->run(task, w);
+  atomic_store(&task->done, true);
+  ForkPool *pool = w->pool;
+  if (atomic_load(&pool->sleeping) > 0) {
+    mtx_lock(&pool->lock);
+    cnd_broadcast(&pool->wake);
+    mtx_unlock(&pool->lock);
+  }
+}
+
+// Wait for a task spawned by this worker, running other tasks meanwhile
+static void fork_join(ForkWorker *w, ForkTask *task) {
+  while (!atomic_load(&task->done)) {
+    size_t seen = atomic_load(&w->pool->spawned);
+    ForkTask *other = fork_find(w);
+    if (other)
+      fork_run(w, other);
+    else
+      fork_wait(w->pool, seen, task);
+  }
+}
+
+static int fork_worker_main(void *data) {
+  ForkWorker *w = data;
+  ForkPool *pool = w->pool;
+  while (!atomic_load(&pool->stopping)) {
+    // Reading the counter first makes a task spawned during the search wake us
+    size_t seen = atomic_load(&pool->spawned);
+    ForkTask *task = fork_find(w);
+    if (task)
+      fork_run(w, task);
+    else
+      fork_wait(pool, seen, 0);
+  }
+  return thrd_success;
+}
+
+// Start a pool of thread_count workers, including the calling thread
+static ForkPool *fork_pool_create(size_t thread_count) {
+  ForkPool *pool = calloc(1, sizeof(ForkPool));
+  if (!pool)
+    die("Failed to allocate memory");
+  pool->worker_count = thread_count > 0 ? thread_count : 1;
+  pool->workers = calloc(pool->worker_count, sizeof(ForkWorker));
+  if (!pool->workers)
+    die("Failed to allocate memory");
+  if (mtx_init(&pool->lock, mtx_plain) != thrd_success ||
+      cnd_init(&pool->wake) != thrd_success)
+    die("Failed to create synchronization primitives");
+  for (size_t i = 0; i < pool->worker_count; ++i) {
+    ForkWorker *w = &pool->workers[i];
+    *w = (ForkWorker){.pool = pool, .victim = i};
+    if (mtx_init(&w->lock, mtx_plain) != thrd_success)
+      die("Failed to create synchronization primitives");
+  }
+  for (size_t i = 1; i < pool->worker_count; ++i) {
+    ForkWorker *w = &pool->workers[i];
+    if (thrd_create(&w->thread, fork_worker_main, w) != thrd_success)
+      die("Failed to create thread");
+  }
+  return pool;
+}
+
+static void fork_pool_free(ForkPool *pool) {
+  if (!pool)
+    return;
+  mtx_lock(&pool->lock);
+  atomic_store(&pool->stopping, true);
+  cnd_broadcast(&pool->wake);
+  mtx_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->worker_count; ++i) {
+    ForkWorker *w = &pool->workers[i];
+    if (i > 0)
+      thrd_join(w->thread, 0);
+    mtx_destroy(&w->lock);
+    arraylist_free(w->tasks);
+    free_evaluator(&w->evaluator);
+  }
+  cnd_destroy(&pool->wake);
+  mtx_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+// The value of a subtree along with the first error met while computing it
+typedef struct ParallelValue {
+  Number number;
+  const char *error;
+} ParallelValue;
+
+static void parallel_eval_node(ForkWorker *w, const Expression *expr,
+                               ParallelValue *result);
+
+// Evaluate the listed subtrees, storing their values in order
+typedef struct ParallelTask {
+  ForkTask task;
+  const Expression **exprs;
+  size_t count;
+  ParallelValue *values;
+} ParallelTask;
+
+static void parallel_run(ForkTask *task, ForkWorker *w) {
+  ParallelTask *t = (ParallelTask *)task;
+  for (size_t i = 0; i < t->count; ++i)
+    parallel_eval_node(w, t->exprs[i], &t->values[i]);
+}
+
+static void parallel_eval_node(ForkWorker *w, const Expression *expr,
+                               ParallelValue *result) {
+  ForkPool *pool = w->pool;
+  Evaluator *ev = &w->evaluator;
+  if (expr->type == EXPR_NUMBER) {
+    *result = (ParallelValue){.number = eval_number(expr->number)};
+    return;
+  }
+  if (expr_size(expr) < PARALLEL_GRAIN) {
+    ev->env = pool->env;
+    ev->error = 0;
+    result->number = eval(ev, expr);
+    result->error = ev->error;
+    return;
+  }
+
+  // Walk down the spine, listing the other operands of its nodes in post-order
+  // and the position of the spine among the operands of each node
+  const Expression **spine = 0, **others = 0;
+  size_t *spine_operand = 0;
+  for (;;) {
+    arraylist_push(spine, expr);
+    size_t count = expr_operand_count(expr);
+    if (count == 0 || expr_size(expr) < PARALLEL_GRAIN)
+      break;
+    size_t largest = 0;
+    for (size_t i = 1; i < count; ++i) {
+      if (expr_size(expr_operand(expr, i)) >
+          expr_size(expr_operand(expr, largest)))
+        largest = i;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (i != largest)
+        arraylist_push(others, expr_operand(expr, i));
+    }
+    arraylist_push(spine_operand, largest);
+    expr = expr_operand(expr, largest);
+  }
+
+  // The bottom of the spine is evaluated by this worker, the other operands
+  // being split in tasks of about PARALLEL_GRAIN nodes
+  size_t other_count = arraylist_size(others);
+  ParallelValue *values = calloc(other_count + 1, sizeof(ParallelValue));
+  ParallelTask *tasks = 0;
+  if (!values)
+    die("Failed to allocate memory");
+  for (size_t begin = 0, end; begin < other_count; begin = end) {
+    size_t nodes = 0;
+    for (end = begin; end < other_count && nodes < PARALLEL_GRAIN; ++end)
+      nodes += expr_size(others[end]);
+    ParallelTask t = {.task.run = parallel_run,
+                      .exprs = others + begin,
+                      .count = end - begin,
+                      .values = values + begin};
+    arraylist_push(tasks, t);
+  }
+  for (size_t i = 0; i < arraylist_size(tasks); ++i)
+    fork_spawn(w, &tasks[i].task);
+  ParallelValue *bottom = &values[other_count];
+  parallel_eval_node(w, spine[arraylist_size(spine) - 1], bottom);
+  for (size_t i = arraylist_size(tasks); i > 0; --i)
+    fork_join(w, &tasks[i - 1].task);
+
+  // Combine the spine bottom-up. The other operands of each node are taken
+  // from the end of their list.
+  ParallelValue value = *bottom;
+  Number *args = 0;
+  size_t next_other = other_count;
+  for (size_t i = arraylist_size(spine) - 1; i > 0; --i) {
+    expr = spine[i - 1];
+    size_t count = expr_operand_count(expr), position = spine_operand[i - 1];
+    next_other -= count - 1;
+    arraylist_clear(args);
+    const char *error = 0;
+    for (size_t j = 0, k = next_other; j < count; ++j) {
+      ParallelValue arg = j == position ? value : values[k++];
+      arraylist_push(args, arg.number);
+      if (!error)
+        error = arg.error;
+    }
+
+    int sum;
+    if (expr->type == EXPR_BINARY_OP && args[0].type == NUMBER_INTEGER &&
+        args[1].type == NUMBER_INTEGER &&
+        eval_int_binop(expr->binary_op.op, args[0].integer, args[1].integer,
+                       &sum)) {
+      value = (ParallelValue){.number = number_integer(sum), .error = error};
+      continue;
+    }
+    ev->env = pool->env;
+    ev->error = error;
+    value.number = eval_operator(ev, expr, args);
+    value.error = ev->error;
+  }
+  *result = value;
+
+  arraylist_free(args);
+  arraylist_free(tasks);
+  free(values);
+  arraylist_free(others);
+  arraylist_free(spine_operand);
+  arraylist_free(spine);
+}
+
+// Evaluate an expression like eval, spreading the work over the workers of the
+// pool once it is large enough. The caller owns the result. On error, *error
+// is set and the result is meaningless.
+static Number parallel_eval(ForkPool *pool, const Expression *expr,
+                            const int *env, const char **error) {
+  pool->env = env;
+  ParallelValue result;
+  parallel_eval_node(&pool->workers[0], expr, &result);
+  *error = result.error;
+  return result.number;
+}
+
+#endif // CALC_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Bytecode
+//===----------------------------------------------------------------------===//
+
+// Expressions can be compiled to a linear program for a stack machine. Operands
+// are pushed in post-order so that every operator finds its arguments on top of
+// the stack. The machine only handles ints, expressions involving vectors or
+// big literals are left to the tree walker above, which is also kept as a
+// reference implementation. Programs stop when a result would not be an int,
+// leaving the tree walker to compute it exactly.
+
+typedef enum OpCode {
+  OP_PUSH,
+  OP_LOAD,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NEG,
+  OP_RET
+} OpCode;
+
+typedef struct Instruction {
+  OpCode op;
+  int operand;
+} Instruction;
+
+typedef struct Program {
+  Instruction *code;
+  size_t max_stack; // Number of stack slots needed to run the program
+} Program;
+
+typedef struct Compiler {
+  Program *program;
+  size_t depth;
+} Compiler;
+
+static void emit(Compiler *c, OpCode op, int operand, int stack_effect) {
+  Instruction instruction = {.op = op, .operand = operand};
+  arraylist_push(c->program->code, instruction);
+  c->depth += stack_effect;
+  if (c->depth > c->program->max_stack)
+    c->program->max_stack = c->depth;
+}
+
+// Emit the instruction for a node whose operands were already compiled
+static bool compile_node(Compiler *c, const Expression *expr) {
+  static const OpCode opcodes[] = {
+      [BINARY_OP_ADD] = OP_ADD,
+      [BINARY_OP_SUB] = OP_SUB,
+      [BINARY_OP_MUL] = OP_MUL,
+      [BINARY_OP_DIV] = OP_DIV,
+  };
+  switch (expr->type) {
+  case EXPR_NUMBER:
+    if (expr->number.type != NUMBER_INTEGER)
+      return false;
+    emit(c, OP_PUSH, expr->number.integer, 1);
+    return true;
+  case EXPR_BINARY_OP:
+    emit(c, opcodes[expr->binary_op.op], 0, -1);
+    return true;
+  case EXPR_UNARY_OP:
+    if (expr->unary_op.op == UNARY_OP_NEG)
+      emit(c, OP_NEG, 0, 0);
+    return true;
+  case EXPR_VARIABLE:
+    emit(c, OP_LOAD, (int)expr->variable, 1);
+    return true;
+  case EXPR_VECTOR:
+    return false;
+  default:
+    UNREACHABLE("Unexpected expression type");
+  }
+}
+
+// Compile a valid expression, reusing the storage already held by the program
+// and the walk. Return false if the expression cannot be handled by the
+// virtual machine.
+static bool compile(Program *program, ExprWalk *walk, const Expression *expr) {
+  arraylist_clear(program->code);
+  program->max_stack = 0;
+  Compiler c = {.program = program};
+  expr_walk_start(walk, expr);
+  bool ok = true;
+  while (ok && (expr = expr_walk_next(walk)))
+    ok = compile_node(&c, expr);
+  if (ok)
+    emit(&c, OP_RET, 0, 0);
+  return ok;
+}
+
+static void free_program(Program *program) {
+  arraylist_free(program->code);
+  program->max_stack = 0;
+}
+
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+// Run a program using the given stack, which must have room for at least
+// program->max_stack values. Variables are read from env. Return false on
+// overflow, inexact division or division by zero.
+static bool run(const Program *program, int *stack, const int *env,
+                int *result) {
+  const Instruction *ip = program->code;
+  int *sp = stack;
+
+#if VM_COMPUTED_GOTO
+  static void *const dispatch[] = {
+      [OP_PUSH] = &&label_OP_PUSH, [OP_LOAD] = &&label_OP_LOAD,
+      [OP_ADD] = &&label_OP_ADD,   [OP_SUB] = &&label_OP_SUB,
+      [OP_MUL] = &&label_OP_MUL,   [OP_DIV] = &&label_OP_DIV,
+      [OP_NEG] = &&label_OP_NEG,   [OP_RET] = &&label_OP_RET,
+  };
+#define VM_CASE(op) label_##op:
+#define VM_NEXT() goto *dispatch[(++ip)->op]
+  goto *dispatch[ip->op];
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT()                                                              \
+  ++ip;                                                                        \
+  continue
+  for (;;) {
+    switch (ip->op) {
+#endif
+
+  VM_CASE(OP_PUSH) {
+    *sp++ = ip->operand;
+    VM_NEXT();
+  }
+  VM_CASE(OP_LOAD) {
+    *sp++ = env[ip->operand];
+    VM_NEXT();
+  }
+  VM_CASE(OP_ADD) {
+    --sp;
+    if (__builtin_add_overflow(sp[-1], sp[0], &sp[-1]))
+      return false;
+    VM_NEXT();
+  }
+  VM_CASE(OP_SUB) {
+    --sp;
+    if (__builtin_sub_overflow(sp[-1], sp[0], &sp[-1]))
+      return false;
+    VM_NEXT();
+  }
+  VM_CASE(OP_MUL) {
+    --sp;
+    if (__builtin_mul_overflow(sp[-1], sp[0], &sp[-1]))
+      return false;
+    VM_NEXT();
+  }
+  VM_CASE(OP_DIV) {
+    --sp;
+    if (sp[0] == 0 || (sp[0] == -1 && sp[-1] == INT_MIN) ||
+        sp[-1] % sp[0] != 0)
+      return false;
+    sp[-1] /= sp[0];
+    VM_NEXT();
+  }
+  VM_CASE(OP_NEG) {
+    if (sp[-1] == INT_MIN)
+      return false;
+    sp[-1] = -sp[-1];
+    VM_NEXT();
+  }
+  VM_CASE(OP_RET) {
+    *result = sp[-1];
+    return true;
+  }
+
+#if !VM_COMPUTED_GOTO
+    default:
+      UNREACHABLE("Unexpected opcode");
+    }
+  }
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+//===----------------------------------------------------------------------===//
+// JIT compilation
+//===----------------------------------------------------------------------===//
+
+// Programs evaluated many times can be translated to native code. The top of
+// the stack lives in eax, the rest of it in memory pointed to by rsi, and
+// variables are read from the array pointed to by rdi. Like the interpreter,
+// the code bails out when a result would not be an int. Code is written to an
+// anonymous mapping which is then made executable. When that is not possible,
+// or on other architectures, callers keep using the interpreter.
+
+#if defined(__x86_64__) && defined(__unix__) && defined(MAP_ANONYMOUS) &&      \
+    !defined(CALC_NO_JIT)
+#define CALC_JIT 1
+#else
+#define CALC_JIT 0
+#endif
+
+// Compiled code is called with the same arguments as run and a stack of at
+// least program->max_stack values
+typedef bool (*JitFunction)(const int *env, int *stack, int *result);
+
+typedef struct JitCode {
+  JitFunction function; // Null if the program could not be compiled
+  void *memory;
+  size_t size;
+} JitCode;
+
+#if CALC_JIT
+#ifndef CALC_LIBRARY
+static void jit_emit(uint8_t **code, const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; ++i)
+    arraylist_push(*code, bytes[i]);
+}
+
+#define JIT_EMIT(code, ...)                                                    \
+  jit_emit(code, (const uint8_t[]){__VA_ARGS__},                               \
+           sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void jit_emit_u32(uint8_t **code, uint32_t value) {
+  JIT_EMIT(code, value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff,
+           value >> 24);
+}
+
+// Move the value held in eax to the memory stack
+static void jit_emit_spill(uint8_t **code) {
+  JIT_EMIT(code, 0x89, 0x06);             // mov [rsi], eax
+  JIT_EMIT(code, 0x48, 0x83, 0xc6, 0x04); // add rsi, 4
+}
+
+// Pop the left operand of a binary operator, leaving rsi pointing to it
+static void jit_emit_pop(uint8_t **code) {
+  JIT_EMIT(code, 0x48, 0x83, 0xee, 0x04); // sub rsi, 4
+}
+
+// Emit a conditional jump to the failure exit, whose offset is filled in once
+// the whole program is translated
+static void jit_emit_bail(uint8_t **code, size_t **fixups, uint8_t condition) {
+  JIT_EMIT(code, 0x0f, condition);
+  arraylist_push(*fixups, arraylist_size(*code));
+  jit_emit_u32(code, 0);
+}
+
+#define JIT_JO 0x80
+#define JIT_JE 0x84
+#define JIT_JNE 0x85
+
+static bool jit_translate_ops(uint8_t **code, size_t **fixups,
+                              const Program *program) {
+  // The stack depth at each instruction is known statically, which tells
+  // whether eax holds a value that must be saved before a push
+  size_t depth = 0;
+  for (const Instruction *ip = program->code;; ++ip) {
+    switch (ip->op) {
+    case OP_PUSH:
+      if (depth++ > 0)
+        jit_emit_spill(code);
+      JIT_EMIT(code, 0xb8); // mov eax, imm32
+      jit_emit_u32(code, (uint32_t)ip->operand);
+      break;
+    case OP_LOAD:
+      if ((size_t)ip->operand > INT32_MAX / sizeof(int))
+        return false;
+      if (depth++ > 0)
+        jit_emit_spill(code);
+      JIT_EMIT(code, 0x8b, 0x87); // mov eax, [rdi + disp32]
+      jit_emit_u32(code, (uint32_t)(ip->operand * sizeof(int)));
+      break;
+    case OP_ADD:
+      jit_emit_pop(code);
+      JIT_EMIT(code, 0x03, 0x06); // add eax, [rsi]
+      jit_emit_bail(code, fixups, JIT_JO);
+      --depth;
+      break;
+    case OP_SUB:
+      jit_emit_pop(code);
+      JIT_EMIT(code, 0x89, 0xc1); // mov ecx, eax
+      JIT_EMIT(code, 0x8b, 0x06); // mov eax, [rsi]
+      JIT_EMIT(code, 0x29, 0xc8); // sub eax, ecx
+      jit_emit_bail(code, fixups, JIT_JO);
+      --depth;
+      break;
+    case OP_MUL:
+      jit_emit_pop(code);
+      JIT_EMIT(code, 0x0f, 0xaf, 0x06); // imul eax, [rsi]
+      jit_emit_bail(code, fixups, JIT_JO);
+      --depth;
+      break;
+    case OP_DIV:
+      jit_emit_pop(code);
+      JIT_EMIT(code, 0x89, 0xc1); // mov ecx, eax
+      JIT_EMIT(code, 0x85, 0xc9); // test ecx, ecx
+      jit_emit_bail(code, fixups, JIT_JE);
+      JIT_EMIT(code, 0x8b, 0x06); // mov eax, [rsi]
+      // INT_MIN / -1 overflows and would trap
+      JIT_EMIT(code, 0x83, 0xf9, 0xff);             // cmp ecx, -1
+      JIT_EMIT(code, 0x75, 0x0b);                   // jne over the next two
+      JIT_EMIT(code, 0x3d, 0x00, 0x00, 0x00, 0x80); // cmp eax, INT_MIN
+      jit_emit_bail(code, fixups, JIT_JE);
+      JIT_EMIT(code, 0x99);       // cdq
+      JIT_EMIT(code, 0xf7, 0xf9); // idiv ecx
+      JIT_EMIT(code, 0x85, 0xd2); // test edx, edx
+      jit_emit_bail(code, fixups, JIT_JNE);
+      --depth;
+      break;
+    case OP_NEG:
+      JIT_EMIT(code, 0xf7, 0xd8); // neg eax
+      jit_emit_bail(code, fixups, JIT_JO);
+      break;
+    case OP_RET:
+      JIT_EMIT(code, 0x41, 0x89, 0x00);             // mov [r8], eax
+      JIT_EMIT(code, 0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+      JIT_EMIT(code, 0xc3);                         // ret
+      return true;
+    default:
+      UNREACHABLE("Unexpected opcode");
+    }
+  }
+}
+
+static bool jit_translate(uint8_t **code, const Program *program) {
+  JIT_EMIT(code, 0x49, 0x89, 0xd0); // mov r8, rdx, which idiv clobbers
+  size_t *fixups = 0;
+  bool ok = jit_translate_ops(code, &fixups, program);
+
+  // Failure exit
+  size_t fail = arraylist_size(*code);
+  JIT_EMIT(code, 0x31, 0xc0); // xor eax, eax
+  JIT_EMIT(code, 0xc3);       // ret
+  for (size_t i = 0; i < arraylist_size(fixups); ++i) {
+    uint32_t offset = (uint32_t)(fail - (fixups[i] + 4));
+    for (int j = 0; j < 4; ++j)
+      (*code)[fixups[i] + j] = (uint8_t)(offset >> (8 * j));
+  }
+  arraylist_free(fixups);
+  return ok;
+}
+
+// Translate a program to native code. Return false, leaving the caller to
+// interpret the program, if the code cannot be generated or made executable.
+static bool jit_compile(JitCode *jit, const Program *program) {
+  *jit = (JitCode){0};
+  uint8_t *code = 0;
+  if (!jit_translate(&code, program)) {
+    arraylist_free(code);
+    return false;
+  }
+
+  size_t size = arraylist_size(code);
+  void *memory = mmap(0, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    arraylist_free(code);
+    return false;
+  }
+  memcpy(memory, code, size);
+  arraylist_free(code);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  *jit = (JitCode){.function = (JitFunction)(uintptr_t)memory,
+                    .memory = memory,
+                    .size = size};
+  return true;
+}
+#endif // CALC_LIBRARY
+
+static void jit_free(JitCode *jit) {
+  if (jit->memory)
+    munmap(jit->memory, jit->size);
+  *jit = (JitCode){0};
+}
+#else
+#ifndef CALC_LIBRARY
+static bool jit_compile(JitCode *jit, const Program *program) {
+  (void)program;
+  *jit = (JitCode){0};
+  return false;
+}
+#endif // CALC_LIBRARY
+
+static void jit_free(JitCode *jit) { *jit = (JitCode){0}; }
+#endif // CALC_JIT
+
+//===----------------------------------------------------------------------===//
+// Result cache
+//===----------------------------------------------------------------------===//
+
+#ifndef CALC_NO_MAIN
+// Results are cached by normalized input so that repeated lines skip lexing,
+// parsing and evaluation altogether. Normalization drops whitespace, except for
+// a single space between two word characters where it separates tokens.
+
+#define DEFAULT_CACHE_CAPACITY 4096
+#define CACHE_NIL UINT32_MAX
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' ||
+         c == '\f';
+}
+
+static bool is_word(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+typedef struct Normalizer {
+  const char *line;
+  size_t size;
+  size_t pos;
+  char prev; // Last byte produced
+} Normalizer;
+
+// Produce the next byte of the normalized line along with the offset of the
+// byte it comes from. Return false at the end of the line.
+static bool normalizer_next(Normalizer *n, char *c, size_t *origin) {
+  while (n->pos < n->size && is_space(n->line[n->pos])) {
+    size_t start = n->pos;
+    while (n->pos < n->size && is_space(n->line[n->pos]))
+      ++n->pos;
+    if (n->pos < n->size && is_word(n->prev) && is_word(n->line[n->pos])) {
+      *c = n->prev = ' ';
+      *origin = start;
+      return true;
+    }
+  }
+  if (n->pos == n->size)
+    return false;
+  *origin = n->pos;
+  *c = n->prev = n->line[n->pos++];
+  return true;
+}
+
+static void normalize(const char *line, size_t size, char **key) {
+  Normalizer n = {.line = line, .size = size};
+  char c;
+  size_t origin;
+  arraylist_clear(*key);
+  while (normalizer_next(&n, &c, &origin))
+    arraylist_push(*key, c);
+}
+
+// Map an offset in the line to the corresponding offset in its normalized form
+static size_t normalized_offset(const char *line, size_t size, size_t offset) {
+  Normalizer n = {.line = line, .size = size};
+  char c;
+  size_t origin;
+  size_t result = 0;
+  while (normalizer_next(&n, &c, &origin) && origin < offset)
+    ++result;
+  return result;
+}
+
+// Map an offset in the normalized form of a line back to the line itself
+static size_t original_offset(const char *line, size_t size, size_t offset) {
+  Normalizer n = {.line = line, .size = size};
+  char c;
+  size_t origin;
+  for (size_t i = 0; normalizer_next(&n, &c, &origin); ++i) {
+    if (i == offset)
+      return origin;
+  }
+  return size;
+}
+
+typedef struct CacheEntry {
+  char *key;
+  uint64_t hash;
+  bool valid;
+  Number value;            // Owned by the entry
+  Diagnostic *diagnostics; // Offsets are relative to the normalized line
+  uint32_t prev;           // Towards the most recently used entry
+  uint32_t next;           // Towards the least recently used entry
+  uint32_t chain;          // Next entry in the same bucket
+} CacheEntry;
+
+// Bounded hash table whose entries are also linked in least recently used
+// order. Once full, the least recently used entry is recycled for new keys.
+typedef struct ResultCache {
+  CacheEntry *entries;
+  uint32_t *buckets;
+  size_t capacity;
+  uint32_t head;
+  uint32_t tail;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} ResultCache;
+
+static void cache_init(ResultCache *cache, size_t capacity) {
+  *cache = (ResultCache){.head = CACHE_NIL, .tail = CACHE_NIL};
+  if (capacity >= CACHE_NIL)
+    capacity = CACHE_NIL - 1;
+  if (capacity == 0)
+    return;
+
+  size_t bucket_count = 1;
+  while (bucket_count < capacity)
+    bucket_count *= 2;
+  arraylist_grow(cache->entries, capacity);
+  arraylist_grow(cache->buckets, bucket_count);
+  for (size_t i = 0; i < bucket_count; ++i)
+    arraylist_push(cache->buckets, CACHE_NIL);
+  cache->capacity = capacity;
+}
+
+static void cache_unlink(ResultCache *cache, uint32_t index) {
+  CacheEntry *entry = &cache->entries[index];
+  if (entry->prev != CACHE_NIL)
+    cache->entries[entry->prev].next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next != CACHE_NIL)
+    cache->entries[entry->next].prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+}
+
+static void cache_push_front(ResultCache *cache, uint32_t index) {
+  CacheEntry *entry = &cache->entries[index];
+  entry->prev = CACHE_NIL;
+  entry->next = cache->head;
+  if (cache->head != CACHE_NIL)
+    cache->entries[cache->head].prev = index;
+  else
+    cache->tail = index;
+  cache->head = index;
+}
+
+static uint32_t *cache_bucket(ResultCache *cache, uint64_t hash) {
+  return &cache->buckets[hash & (arraylist_size(cache->buckets) - 1)];
+}
+
+// Return the entry for the given key, marking it as the most recently used
+static const CacheEntry *cache_lookup(ResultCache *cache, const char *key,
+                                      size_t size, uint64_t hash) {
+  for (uint32_t i = *cache_bucket(cache, hash); i != CACHE_NIL;
+       i = cache->entries[i].chain) {
+    CacheEntry *entry = &cache->entries[i];
+    if (entry->hash == hash && arraylist_size(entry->key) == size &&
+        memcmp(entry->key, key, size) == 0) {
+      if (cache->head != i) {
+        cache_unlink(cache, i);
+        cache_push_front(cache, i);
+      }
+      ++cache->hits;
+      return entry;
+    }
+  }
+  ++cache->misses;
+  return 0;
+}
+
+// Return a fresh entry for a key that is not in the cache yet, evicting the
+// least recently used entry if needed. Its result is left for the caller to
+// fill.
+static CacheEntry *cache_insert(ResultCache *cache, const char *key,
+                                size_t size, uint64_t hash) {
+  uint32_t index;
+  if (arraylist_size(cache->entries) < cache->capacity) {
+    index = arraylist_size(cache->entries);
+    arraylist_push(cache->entries, (CacheEntry){0});
+  } else {
+    index = cache->tail;
+    cache_unlink(cache, index);
+    uint32_t *link = cache_bucket(cache, cache->entries[index].hash);
+    while (*link != index)
+      link = &cache->entries[*link].chain;
+    *link = cache->entries[index].chain;
+    ++cache->evictions;
+  }
+
+  // Storage of recycled entries is reused for the new key
+  CacheEntry *entry = &cache->entries[index];
+  arraylist_clear(entry->key);
+  for (size_t i = 0; i < size; ++i)
+    arraylist_push(entry->key, key[i]);
+  arraylist_clear(entry->diagnostics);
+  free_number(&entry->value);
+  entry->hash = hash;
+  uint32_t *bucket = cache_bucket(cache, hash);
+  entry->chain = *bucket;
+  *bucket = index;
+  cache_push_front(cache, index);
+  return entry;
+}
+
+static void cache_print_stats(const ResultCache *cache, FILE *out) {
+  fprintf(out,
+          "cache: %zu/%zu entries, %zu hits, %zu misses, %zu evictions\n",
+          arraylist_size(cache->entries), cache->capacity, cache->hits,
+          cache->misses, cache->evictions);
+}
+
+static void free_cache(ResultCache *cache) {
+  for (size_t i = 0; i < arraylist_size(cache->entries); ++i) {
+    arraylist_free(cache->entries[i].key);
+    arraylist_free(cache->entries[i].diagnostics);
+    free_number(&cache->entries[i].value);
+  }
+  arraylist_free(cache->entries);
+  arraylist_free(cache->buckets);
+  cache->capacity = 0;
+}
+
+#endif // CALC_NO_MAIN
+
+//===----------------------------------------------------------------------===//
+// Variables
+//===----------------------------------------------------------------------===//
+
+// A sheet holds variables along with the dependency graph between their
+// definitions. Every definition is compiled once and records the variables it
+// reads, which in turn know which definitions read them. Assigning a variable
+// then only re-evaluates the definitions downstream of it, in topological
+// order, instead of the whole sheet.
+
+#define SHEET_EMPTY_SLOT UINT32_MAX
+#define SHEET_INIT_SLOT_COUNT 16
+
+// Number of evaluations after which a definition is compiled to native code,
+// when the JIT is enabled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 16
+#endif
+
+typedef struct Variable {
+  char *name; // Null-terminated
+  size_t name_size;
+  Program program;      // Compiled definition
+  JitCode jit;          // Native version of the program, once it is hot
+  size_t eval_count;    // Evaluations of the current definition
+  size_t *dependencies; // Variables read by the definition
+  size_t *dependents;   // Variables whose definition reads this one
+  bool defined;
+  bool has_value;
+  size_t mark;    // Last traversal that visited the variable
+  size_t pending; // Dependencies left to update during a recomputation
+} Variable;
+
+struct Sheet {
+  Variable *variables;
+  int *values;     // Current values, indexed like variables
+  uint32_t *slots; // Open addressing table of variable indices
+  size_t *worklist;
+  size_t *ready;
+  int *stack;
+  ExprWalk walk;     // Traversal state, reused across assignments
+  size_t epoch;      // Incremented by every traversal of the graph
+  size_t recomputed; // Number of definitions evaluated so far
+  bool use_jit;
+};
+
+static size_t sheet_find(const Sheet *sheet, const char *name, size_t size) {
+  if (arraylist_size(sheet->slots) == 0)
+    return NO_VARIABLE;
+  size_t mask = arraylist_size(sheet->slots) - 1;
+  for (size_t i = hash_bytes(name, size) & mask;; i = (i + 1) & mask) {
+    uint32_t index = sheet->slots[i];
+    if (index == SHEET_EMPTY_SLOT)
+      return NO_VARIABLE;
+    const Variable *v = &sheet->variables[index];
+    if (v->name_size == size && memcmp(v->name, name, size) == 0)
+      return index;
+  }
+}
+
+static void sheet_insert_slot(Sheet *sheet, uint32_t index) {
+  const Variable *v = &sheet->variables[index];
+  size_t mask = arraylist_size(sheet->slots) - 1;
+  size_t i = hash_bytes(v->name, v->name_size) & mask;
+  while (sheet->slots[i] != SHEET_EMPTY_SLOT)
+    i = (i + 1) & mask;
+  sheet->slots[i] = index;
+}
+
+// Return the index of the variable with the given name, creating it without a
+// definition if needed
+static size_t sheet_intern(Sheet *sheet, const char *name, size_t size) {
+  size_t index = sheet_find(sheet, name, size);
+  if (index != NO_VARIABLE)
+    return index;
+
+  index = arraylist_size(sheet->variables);
+  if (index >= SHEET_EMPTY_SLOT)
+    die("Too many variables");
+  Variable v = {.name = malloc(size + 1), .name_size = size};
+  if (!v.name)
+    die("Failed to allocate memory");
+  memcpy(v.name, name, size);
+  v.name[size] = 0;
+  arraylist_push(sheet->variables, v);
+  arraylist_push(sheet->values, 0);
+
+  // Keep the table at most half full
+  size_t slot_count = arraylist_size(sheet->slots);
+  if (2 * (index + 1) > slot_count) {
+    slot_count = slot_count ? 2 * slot_count : SHEET_INIT_SLOT_COUNT;
+    arraylist_clear(sheet->slots);
+    arraylist_grow(sheet->slots, slot_count - arraylist_capacity(sheet->slots));
+    for (size_t i = 0; i < slot_count; ++i)
+      arraylist_push(sheet->slots, SHEET_EMPTY_SLOT);
+    for (size_t i = 0; i < index; ++i)
+      sheet_insert_slot(sheet, i);
+  }
+  sheet_insert_slot(sheet, index);
+  return index;
+}
+
+static bool sheet_has_value(const Sheet *sheet, size_t index) {
+  return sheet->variables[index].has_value;
+}
+
+#ifndef CALC_NO_MAIN
+// Append the variables read by expr which have not been marked yet
+static void sheet_collect_dependencies(Sheet *sheet, const Expression *expr,
+                                       size_t **dependencies) {
+  expr_walk_start(&sheet->walk, expr);
+  while ((expr = expr_walk_next(&sheet->walk))) {
+    if (expr->type != EXPR_VARIABLE)
+      continue;
+    Variable *v = &sheet->variables[expr->variable];
+    if (v->mark != sheet->epoch) {
+      v->mark = sheet->epoch;
+      arraylist_push(*dependencies, expr->variable);
+    }
+  }
+}
+
+// Return whether any of the given variables is target itself or depends on it.
+// The search goes downstream from target, which costs no more than the
+// recomputation that follows an assignment.
+static bool sheet_depends_on(Sheet *sheet, const size_t *variables,
+                             size_t target) {
+  ++sheet->epoch;
+  arraylist_clear(sheet->worklist);
+  sheet->variables[target].mark = sheet->epoch;
+  arraylist_push(sheet->worklist, target);
+  for (size_t i = 0; i < arraylist_size(sheet->worklist); ++i) {
+    const Variable *v = &sheet->variables[sheet->worklist[i]];
+    for (size_t j = 0; j < arraylist_size(v->dependents); ++j) {
+      Variable *dependent = &sheet->variables[v->dependents[j]];
+      if (dependent->mark != sheet->epoch) {
+        dependent->mark = sheet->epoch;
+        arraylist_push(sheet->worklist, v->dependents[j]);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < arraylist_size(variables); ++i) {
+    if (sheet->variables[variables[i]].mark == sheet->epoch)
+      return true;
+  }
+  return false;
+}
+
+static void sheet_evaluate(Sheet *sheet, size_t index) {
+  Variable *v = &sheet->variables[index];
+  v->has_value = v->defined;
+  for (size_t i = 0; i < arraylist_size(v->dependencies); ++i) {
+    if (!sheet->variables[v->dependencies[i]].has_value)
+      v->has_value = false;
+  }
+  if (v->has_value) {
+    if (arraylist_capacity(sheet->stack) < v->program.max_stack)
+      arraylist_grow(sheet->stack, v->program.max_stack -
+                                       arraylist_capacity(sheet->stack));
+    if (sheet->use_jit && v->eval_count++ == JIT_THRESHOLD)
+      jit_compile(&v->jit, &v->program);
+    // Definitions whose value is not an int are left without a value
+    int *value = &sheet->values[index];
+    if (v->jit.function)
+      v->has_value = v->jit.function(sheet->values, sheet->stack, value);
+    else
+      v->has_value = run(&v->program, sheet->stack, sheet->values, value);
+  }
+  ++sheet->recomputed;
+}
+
+// Re-evaluate the definition of root and every definition downstream of it,
+// each one after all of its own dependencies are up to date
+static void sheet_recompute(Sheet *sheet, size_t root) {
+  // Gather the affected variables, counting for each of them how many of its
+  // dependencies are affected as well
+  ++sheet->epoch;
+  arraylist_clear(sheet->worklist);
+  sheet->variables[root].mark = sheet->epoch;
+  sheet->variables[root].pending = 0;
+  arraylist_push(sheet->worklist, root);
+  for (size_t i = 0; i < arraylist_size(sheet->worklist); ++i) {
+    const Variable *v = &sheet->variables[sheet->worklist[i]];
+    for (size_t j = 0; j < arraylist_size(v->dependents); ++j) {
+      Variable *dependent = &sheet->variables[v->dependents[j]];
+      if (dependent->mark != sheet->epoch) {
+        dependent->mark = sheet->epoch;
+        dependent->pending = 0;
+        arraylist_push(sheet->worklist, v->dependents[j]);
+      }
+      ++dependent->pending;
+    }
+  }
+
+  arraylist_clear(sheet->ready);
+  arraylist_push(sheet->ready, root);
+  while (arraylist_size(sheet->ready) > 0) {
+    size_t index = arraylist_pop(sheet->ready);
+    sheet_evaluate(sheet, index);
+    const Variable *v = &sheet->variables[index];
+    for (size_t i = 0; i < arraylist_size(v->dependents); ++i) {
+      if (--sheet->variables[v->dependents[i]].pending == 0)
+        arraylist_push(sheet->ready, v->dependents[i]);
+    }
+  }
+}
+
+typedef enum AssignResult {
+  ASSIGN_OK,
+  ASSIGN_CIRCULAR,  // The definition depends on the variable itself
+  ASSIGN_NOT_SCALAR // Only int definitions can be compiled
+} AssignResult;
+
+// Replace the definition of the target variable and update everything that
+// depends on it. On failure, the sheet is left untouched.
+static AssignResult sheet_assign(Sheet *sheet, size_t target,
+                                 const Expression *expr) {
+  Program program = {0};
+  if (!compile(&program, &sheet->walk, expr)) {
+    free_program(&program);
+    return ASSIGN_NOT_SCALAR;
+  }
+
+  size_t *dependencies = 0;
+  ++sheet->epoch;
+  sheet_collect_dependencies(sheet, expr, &dependencies);
+  if (sheet_depends_on(sheet, dependencies, target)) {
+    arraylist_free(dependencies);
+    free_program(&program);
+    return ASSIGN_CIRCULAR;
+  }
+
+  Variable *v = &sheet->variables[target];
+  for (size_t i = 0; i < arraylist_size(v->dependencies); ++i) {
+    Variable *dependency = &sheet->variables[v->dependencies[i]];
+    for (size_t j = 0; j < arraylist_size(dependency->dependents); ++j) {
+      if (dependency->dependents[j] == target) {
+        dependency->dependents[j] = arraylist_pop(dependency->dependents);
+        break;
+      }
+    }
+  }
+  arraylist_free(v->dependencies);
+  v->dependencies = dependencies;
+  for (size_t i = 0; i < arraylist_size(dependencies); ++i)
+    arraylist_push(sheet->variables[dependencies[i]].dependents, target);
+
+  free_program(&v->program);
+  jit_free(&v->jit);
+  v->program = program;
+  v->eval_count = 0;
+  v->defined = true;
+  sheet_recompute(sheet, target);
+  return ASSIGN_OK;
+}
+#endif // CALC_NO_MAIN
+
+#if !defined(CALC_NO_MAIN) || defined(CALC_LIBRARY)
+static void free_sheet(Sheet *sheet) {
+  for (size_t i = 0; i < arraylist_size(sheet->variables); ++i) {
+    Variable *v = &sheet->variables[i];
+    free(v->name);
+    free_program(&v->program);
+    jit_free(&v->jit);
+    arraylist_free(v->dependencies);
+    arraylist_free(v->dependents);
+  }
+  arraylist_free(sheet->variables);
+  arraylist_free(sheet->values);
+  arraylist_free(sheet->slots);
+  arraylist_free(sheet->worklist);
+  arraylist_free(sheet->ready);
+  arraylist_free(sheet->stack);
+  free_expr_walk(&sheet->walk);
+  *sheet = (Sheet){0};
+}
+#endif
+
+//===----------------------------------------------------------------------===//
+// Statistics
+//===----------------------------------------------------------------------===//
+
+#ifndef CALC_NO_MAIN
+// With --stats, the time spent in each phase of handling a line is added up,
+// along with hardware counters of the measuring thread where the kernel lets
+// us open them. The parser pulls tokens from the lexer as it goes, so lexing
+// and parsing are measured together as a single phase. Work done by other
+// threads, such as those of the fork pool, only shows in times.
+
+typedef enum Phase {
+  PHASE_READ,
+  PHASE_PARSE, // Includes lexing
+  PHASE_OPTIMIZE,
+  PHASE_EVAL,
+  PHASE_FREE,
+  PHASE_COUNT
+} Phase;
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "read", "lex+parse", "optimize", "eval", "free"};
+
+typedef enum Counter {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_COUNT
+} Counter;
+
+static const char *const counter_names[COUNTER_COUNT] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"};
+
+typedef enum StatsFormat { STATS_NONE, STATS_TABLE, STATS_JSON } StatsFormat;
+
+typedef struct PhaseStats {
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t counters[COUNTER_COUNT];
+} PhaseStats;
+
+typedef struct Stats {
+  PhaseStats phases[PHASE_COUNT];
+  unsigned counters; // Bit set of the counters measured
+  uint64_t nodes_parsed;    // Nodes of the trees given to the optimizer
+  uint64_t nodes_optimized; // Distinct nodes of the DAGs it produced
+} Stats;
+
+// Measures the phases run by one thread
+typedef struct StatsRecorder {
+  Stats totals;
+  int fds[COUNTER_COUNT]; // -1 for counters that could not be opened
+  int group;              // First counter opened, read for all of them
+  bool counting;          // Whether start holds the counters of the phase
+  uint64_t start_ns;
+  uint64_t start[COUNTER_COUNT];
+} StatsRecorder;
+
+static uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Create a recorder for the calling thread. Counters the kernel refuses to
+// open, for lack of support or of permission, are left out.
+static StatsRecorder *stats_recorder_create(void) {
+  StatsRecorder *r = malloc(sizeof(StatsRecorder));
+  if (!r)
+    die("Failed to allocate memory");
+  *r = (StatsRecorder){.group = -1};
+  for (size_t i = 0; i < COUNTER_COUNT; ++i)
+    r->fds[i] = -1;
+#if CALC_PERF
+  static const uint64_t configs[COUNTER_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = PERF_TYPE_HARDWARE,
+        .config = configs[i],
+        .disabled = r->group < 0,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_GROUP,
+    };
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, r->group, 0);
+    if (fd < 0)
+      continue;
+    if (r->group < 0)
+      r->group = fd;
+    r->fds[i] = fd;
+    r->totals.counters |= 1u << i;
+  }
+  if (r->group >= 0 &&
+      ioctl(r->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+      if (r->fds[i] >= 0)
+        close(r->fds[i]);
+      r->fds[i] = -1;
+    }
+    r->group = -1;
+    r->totals.counters = 0;
+  }
+#endif
+  return r;
+}
+
+// Read all the counters at once, in the order they were opened
+static bool stats_read(const StatsRecorder *r, uint64_t values[COUNTER_COUNT]) {
+  if (r->group < 0)
+    return false;
+  uint64_t buffer[1 + COUNTER_COUNT];
+  if (read(r->group, buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+    return false;
+  for (size_t i = 0, slot = 0; i < COUNTER_COUNT; ++i) {
+    if (r->fds[i] < 0)
+      continue;
+    if (slot == buffer[0])
+      return false;
+    values[i] = buffer[1 + slot++];
+  }
+  return true;
+}
+
+// Start measuring a phase, doing nothing without a recorder
+static void stats_begin(StatsRecorder *r) {
+  if (!r)
+    return;
+  r->counting = stats_read(r, r->start);
+  r->start_ns = stats_now_ns();
+}
+
+static void stats_end(StatsRecorder *r, Phase phase) {
+  if (!r)
+    return;
+  PhaseStats *p = &r->totals.phases[phase];
+  p->ns += stats_now_ns() - r->start_ns;
+  ++p->calls;
+  uint64_t values[COUNTER_COUNT];
+  if (!r->counting || !stats_read(r, values))
+    return;
+  for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+    if (r->fds[i] >= 0)
+      p->counters[i] += values[i] - r->start[i];
+  }
+}
+
+static void stats_merge(Stats *dst, const Stats *src) {
+  for (size_t i = 0; i < PHASE_COUNT; ++i) {
+    dst->phases[i].calls += src->phases[i].calls;
+    dst->phases[i].ns += src->phases[i].ns;
+    for (size_t j = 0; j < COUNTER_COUNT; ++j)
+      dst->phases[i].counters[j] += src->phases[i].counters[j];
+  }
+  dst->counters |= src->counters;
+  dst->nodes_parsed += src->nodes_parsed;
+  dst->nodes_optimized += src->nodes_optimized;
+}
+
+static void stats_recorder_free(StatsRecorder *r) {
+  if (!r)
+    return;
+  for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+    if (r->fds[i] >= 0)
+      close(r->fds[i]);
+  }
+  free(r);
+}
+
+static void stats_print(FILE *out, const Stats *stats, StatsFormat format) {
+  if (format == STATS_JSON) {
+    fputs("{", out);
+    for (size_t i = 0; i < PHASE_COUNT; ++i) {
+      const PhaseStats *p = &stats->phases[i];
+      fprintf(out, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu", i ? ", " : "",
+              phase_names[i], (unsigned long long)p->calls,
+              (unsigned long long)p->ns);
+      for (size_t j = 0; j < COUNTER_COUNT; ++j) {
+        if (stats->counters & 1u << j)
+          fprintf(out, ", \"%s\": %llu", counter_names[j],
+                  (unsigned long long)p->counters[j]);
       }
-      break;
+      fputs("}", out);
     }
+    if (stats->nodes_parsed > 0)
+      fprintf(out, ", \"nodes\": {\"parsed\": %llu, \"optimized\": %llu}",
+              (unsigned long long)stats->nodes_parsed,
+              (unsigned long long)stats->nodes_optimized);
+    fputs("}\n", out);
+    return;
   }
 
-  Token eof = (Token){
-      .type = TOKEN_EOF, .loc.line = input, .loc.start = curr, .loc.end = curr};
-  arraylist_push(result, eof);
-  return result;
+  fprintf(out, "%-10s %10s %12s %12s", "phase", "calls", "total_ms",
+          "ns_per_call");
+  for (size_t j = 0; j < COUNTER_COUNT; ++j) {
+    if (stats->counters & 1u << j)
+      fprintf(out, " %14s", counter_names[j]);
+  }
+  fputc('\n', out);
+  for (size_t i = 0; i < PHASE_COUNT; ++i) {
+    const PhaseStats *p = &stats->phases[i];
+    fprintf(out, "%-10s %10llu %12.3f %12.0f", phase_names[i],
+            (unsigned long long)p->calls, p->ns * 1e-6,
+            p->calls ? (double)p->ns / p->calls : 0.0);
+    for (size_t j = 0; j < COUNTER_COUNT; ++j) {
+      if (stats->counters & 1u << j)
+        fprintf(out, " %14llu", (unsigned long long)p->counters[j]);
+    }
+    fputc('\n', out);
+  }
+  if (!stats->counters)
+    fputs("Hardware counters are not available, see perf_event_paranoid\n",
+          out);
+  if (stats->nodes_parsed > 0)
+    fprintf(out, "optimizer: %llu nodes parsed, %llu left (%.1f%% removed)\n",
+            (unsigned long long)stats->nodes_parsed,
+            (unsigned long long)stats->nodes_optimized,
+            100.0 * (stats->nodes_parsed - stats->nodes_optimized) /
+                stats->nodes_parsed);
 }
 
 //===----------------------------------------------------------------------===//
-// Parsing
+// Sessions
 //===----------------------------------------------------------------------===//
 
-static Expression *parse_term(Token **tokens);
-static Expression *parse_factor(Token **tokens);
-static Expression *parse_parenthesize_expression(Token **tokens);
-static Expression *parse_expression(Token **tokens);
+static void print_diagnostics(FILE *out, const char *line, size_t size,
+                              const Diagnostic *diagnostics) {
+  for (size_t i = 0; i < arraylist_size(diagnostics); ++i) {
+    const Diagnostic *d = &diagnostics[i];
+    fprintf(out, "\033[31mERROR:\033[0m %s\n%.*s\n", d->message, (int)size,
+            line);
+    for (size_t j = 0; j < d->start; ++j)
+      putc(' ', out);
+    for (size_t j = d->start; j < d->end; ++j)
+      putc('~', out);
+    putc('\n', out);
+  }
+}
+
+typedef enum EvalMode {
+  EVAL_MODE_TREE,
+  EVAL_MODE_FLAT,
+  EVAL_MODE_VM
+} EvalMode;
+
+typedef enum OutputFormat {
+  OUTPUT_ANNOTATED, // Errors underline the echoed line, blank lines are skipped
+  OUTPUT_LINES,     // Exactly one line per input line, for batch and server
+} OutputFormat;
 
-static void parser_error(const char *msg, const Token *token) {
-  printf("\033[31mERROR:\033[0m %s\n%s\n", msg, token->loc.line);
-  for (ptrdiff_t i = 0; i < token->loc.start - token->loc.line; ++i)
-    putc(' ', stdout);
-  for (ptrdiff_t i = 0; i < token->loc.end - token->loc.start; ++i)
-    putc('~', stdout);
-  putc('\n', stdout);
+// State reused from one line to the next. Sessions are independent from each
+// other so that each thread can own one.
+typedef struct Session {
+  EvalMode mode;
+  OutputFormat format;
+  bool color; // Whether errors may be colored
+  Arena arena;
+  Program program;
+  int *stack;
+  FlatTree flat;
+  Evaluator evaluator;
+  Diagnostic *diagnostics;
+  ResultCache cache;
+  char *key;      // Normalized form of the current line
+  bool use_sheet; // Whether variables are available
+  Sheet sheet;
+  size_t pool_threads; // Evaluates large lines in parallel if above 1
+  ForkPool *pool;      // Created on the first large line
+  Optimizer *optimizer; // Rewrites trees before evaluation if not null
+  StatsRecorder *stats; // Measures each phase if not null
+} Session;
+
+static void session_init(Session *s, EvalMode mode, size_t cache_capacity,
+                         bool use_sheet) {
+  *s = (Session){.mode = mode, .use_sheet = use_sheet};
+  cache_init(&s->cache, cache_capacity);
 }
 
-static Expression *parse_factor(Token **const tokens) {
-  Token *curr = *tokens;
-  *tokens += 1;
-  switch (curr->type) {
-  case TOKEN_INTEGER:
-    return expr_integer(curr->integer.value);
-  case TOKEN_PLUS:
-    return expr_unary_plus(parse_term(tokens));
-  case TOKEN_MINUS:
-    return expr_unary_minus(parse_term(tokens));
-  case TOKEN_LPAREN:
-    return parse_parenthesize_expression(tokens);
-  default:
-    parser_error("Unexpected token", curr);
+static void session_enable_optimizer(Session *s) {
+  s->optimizer = calloc(1, sizeof(Optimizer));
+  if (!s->optimizer)
+    die("Failed to allocate memory");
+}
+
+// Lines referring to variables depend on the state of the sheet and must not be
+// cached
+static bool has_identifier(const char *key, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (isalpha((unsigned char)key[i]) || key[i] == '_')
+      return true;
+  }
+  return false;
+}
+
+// Write the diagnostics of the current line. In OUTPUT_LINES format only the
+// first one is written, as "error <start> <end> <message>".
+static void session_print_diagnostics(const Session *s, const char *line,
+                                      size_t size, FILE *out) {
+  if (s->format == OUTPUT_ANNOTATED) {
+    print_diagnostics(out, line, size, s->diagnostics);
+    return;
+  }
+  Diagnostic d = {.message = "Invalid expression", .end = size};
+  if (arraylist_size(s->diagnostics) > 0)
+    d = s->diagnostics[0];
+  fprintf(out, "%s %zu %zu %s\n", s->color ? "\033[31merror\033[0m" : "error",
+          d.start, d.end, d.message);
+}
+
+// Write the output of a line holding nothing to evaluate
+static void session_print_blank(const Session *s, FILE *out) {
+  if (s->format == OUTPUT_LINES)
+    putc('\n', out);
+}
+
+// Replay the result of a line found in the cache
+static void session_print_cached(Session *s, const CacheEntry *entry,
+                                 const char *line, size_t size, FILE *out) {
+  if (entry->valid) {
+    print_number(out, entry->value);
+    return;
+  }
+  arraylist_clear(s->diagnostics);
+  for (size_t i = 0; i < arraylist_size(entry->diagnostics); ++i) {
+    Diagnostic d = entry->diagnostics[i];
+    d.start = original_offset(line, size, d.start);
+    d.end = original_offset(line, size, d.end);
+    arraylist_push(s->diagnostics, d);
+  }
+  session_print_diagnostics(s, line, size, out);
+}
+
+// Evaluate a valid expression. On error, a diagnostic spanning the whole line
+// is added and false is returned.
+static bool session_evaluate(Session *s, const Expression *expr,
+                             const int *env, size_t size, Number *result) {
+  if (s->mode == EVAL_MODE_VM &&
+      compile(&s->program, &s->evaluator.walk, expr)) {
+    if (arraylist_capacity(s->stack) < s->program.max_stack)
+      arraylist_grow(s->stack,
+                     s->program.max_stack - arraylist_capacity(s->stack));
+    int value;
+    if (run(&s->program, s->stack, env, &value)) {
+      *result = number_integer(value);
+      return true;
+    }
+  }
+
+  const char *error;
+  Evaluator *ev = &s->evaluator;
+  ExprTable *dag = s->optimizer ? &s->optimizer->nodes : 0;
+  if (s->mode == EVAL_MODE_FLAT && flat_build(&s->flat, &ev->walk, expr, dag)) {
+    ev->env = env;
+    ev->error = 0;
+    *result = flat_eval(ev, &s->flat);
+    error = ev->error;
+  } else if (s->pool_threads > 1 && size >= PARALLEL_MIN_LINE_SIZE) {
+    if (!s->pool)
+      s->pool = fork_pool_create(s->pool_threads);
+    *result = parallel_eval(s->pool, expr, env, &error);
+  } else {
+    ev->env = env;
+    ev->error = 0;
+    *result = eval(ev, expr);
+    error = ev->error;
+  }
+  if (error) {
+    free_number(result);
+    Diagnostic d = {.message = error, .start = 0, .end = size};
+    arraylist_push(s->diagnostics, d);
+    return false;
+  }
+  return true;
+}
+
+// Return why a definition reading only variables with a value was left
+// without one. The program only bails out, so the tree walker evaluates it
+// again to tell errors from results that are not an int.
+static const char *session_definition_error(Session *s,
+                                            const Expression *expr) {
+  Evaluator *ev = &s->evaluator;
+  ev->env = s->sheet.values;
+  ev->error = 0;
+  Number value = eval(ev, expr);
+  const char *error = ev->error;
+  if (!error && value.type == NUMBER_INTEGER)
+    error = "Intermediate results of definitions must be machine integers";
+  else if (!error)
+    error = "Only machine integers can be assigned to variables";
+  free_number(&value);
+  return error;
+}
+
+static void session_assign(Session *s, const Statement *statement,
+                           const char *line, size_t size, FILE *out) {
+  Sheet *sheet = &s->sheet;
+  const char *error = 0;
+  switch (sheet_assign(sheet, statement->target, statement->expr)) {
+  case ASSIGN_OK:
+    break;
+  case ASSIGN_CIRCULAR:
+    error = "Circular definition";
     break;
+  case ASSIGN_NOT_SCALAR:
+    error = "Only machine integers can be assigned to variables";
+    break;
+  }
+  if (error) {
+    Diagnostic d = {.message = error,
+                    .start = statement->target_loc.start,
+                    .end = statement->target_loc.end};
+    arraylist_push(s->diagnostics, d);
+    session_print_diagnostics(s, line, size, out);
+    return;
+  }
+
+  const Variable *v = &sheet->variables[statement->target];
+  if (v->has_value) {
+    fprintf(out, "%s = %d\n", v->name, sheet->values[statement->target]);
+    return;
   }
-  return expr_invalid();
+  // Reading a variable without a value leaves the definition undefined too
+  for (size_t i = 0; i < arraylist_size(v->dependencies); ++i) {
+    if (!sheet_has_value(sheet, v->dependencies[i])) {
+      fprintf(out, "%s = undefined\n", v->name);
+      return;
+    }
+  }
+  Diagnostic d = {.message = session_definition_error(s, statement->expr),
+                  .start = statement->definition,
+                  .end = size};
+  arraylist_push(s->diagnostics, d);
+  session_print_diagnostics(s, line, size, out);
 }
 
-static Expression *parse_parenthesize_expression(Token **const tokens) {
-  Expression *expr = parse_expression(tokens);
-  if ((*tokens)->type != TOKEN_RPAREN) {
-    parser_error("Expected closing ')' at end of expression", *tokens);
-    expr->valid = false;
+// Evaluate a single line, writing its result or diagnostics to out
+static void session_eval_line(Session *s, const char *line, size_t size,
+                              FILE *out) {
+  uint64_t hash = 0;
+  bool use_cache = s->cache.capacity > 0;
+  if (use_cache) {
+    normalize(line, size, &s->key);
+    if (arraylist_size(s->key) == 0) {
+      session_print_blank(s, out);
+      return;
+    }
+    use_cache = !has_identifier(s->key, arraylist_size(s->key));
+  }
+  if (use_cache) {
+    hash = hash_bytes(s->key, arraylist_size(s->key));
+    const CacheEntry *entry =
+        cache_lookup(&s->cache, s->key, arraylist_size(s->key), hash);
+    if (entry) {
+      session_print_cached(s, entry, line, size, out);
+      return;
+    }
+  }
+
+  MemoryInput input = {.data = line, .size = size};
+  Lexer lexer;
+  stats_begin(s->stats);
+  lexer_init(&lexer, memory_source(&input), &s->arena);
+
+  if (lexer.token.type != TOKEN_EOF) {
+    arraylist_clear(s->diagnostics);
+    Sheet *sheet = s->use_sheet ? &s->sheet : 0;
+    Statement statement =
+        parse_statement(&lexer, &s->arena, sheet, &s->diagnostics);
+    stats_end(s->stats, PHASE_PARSE);
+    bool valid = statement.expr->valid;
+    if (valid && s->optimizer) {
+      stats_begin(s->stats);
+      Expression *expr = optimize(s->optimizer, &s->arena, statement.expr);
+      if (s->stats) {
+        s->stats->totals.nodes_parsed += expr_size(statement.expr);
+        s->stats->totals.nodes_optimized +=
+            opt_count_nodes(s->optimizer, expr);
+      }
+      statement.expr = expr;
+      stats_end(s->stats, PHASE_OPTIMIZE);
+    }
+    Number value = number_integer(0);
+    stats_begin(s->stats);
+    if (statement.target != NO_VARIABLE) {
+      session_assign(s, &statement, line, size, out);
+    } else if (valid) {
+      const int *env = sheet ? sheet->values : 0;
+      valid = session_evaluate(s, statement.expr, env, size, &value);
+    }
+    stats_end(s->stats, PHASE_EVAL);
+    if (statement.target == NO_VARIABLE) {
+      if (valid)
+        print_number(out, value);
+      else
+        session_print_diagnostics(s, line, size, out);
+    }
+
+    if (use_cache) {
+      CacheEntry *entry =
+          cache_insert(&s->cache, s->key, arraylist_size(s->key), hash);
+      entry->valid = valid;
+      entry->value = copy_number(value);
+      for (size_t i = 0; i < arraylist_size(s->diagnostics); ++i) {
+        Diagnostic d = s->diagnostics[i];
+        d.start = normalized_offset(line, size, d.start);
+        d.end = normalized_offset(line, size, d.end);
+        arraylist_push(entry->diagnostics, d);
+      }
+    }
+    free_number(&value);
   } else {
-    ++(*tokens);
-    expr->valid = true;
+    stats_end(s->stats, PHASE_PARSE);
+    session_print_blank(s, out);
   }
-  return expr;
+
+  stats_begin(s->stats);
+  free_lexer(&lexer);
+  arena_reset(&s->arena);
+  stats_end(s->stats, PHASE_FREE);
 }
 
-static Expression *parse_term(Token **const tokens) {
-  Expression *expr = parse_factor(tokens);
+static void free_session(Session *s) {
+  free_sheet(&s->sheet);
+  arraylist_free(s->key);
+  free_cache(&s->cache);
+  arraylist_free(s->diagnostics);
+  arraylist_free(s->stack);
+  free_evaluator(&s->evaluator);
+  free_flat_tree(&s->flat);
+  free_program(&s->program);
+  arena_free(&s->arena);
+  fork_pool_free(s->pool);
+  stats_recorder_free(s->stats);
+  if (s->optimizer) {
+    free_optimizer(s->optimizer);
+    free(s->optimizer);
+  }
+}
 
-  for (bool done = false; !done;) {
-    Token *curr = *tokens;
-    switch (curr->type) {
-    case TOKEN_TIMES:
-      *tokens += 1;
-      expr = expr_mul(expr, parse_factor(tokens));
-      break;
-    case TOKEN_DIVIDE:
-      *tokens += 1;
-      expr = expr_div(expr, parse_factor(tokens));
-      break;
-    default:
-      done = true;
+//===----------------------------------------------------------------------===//
+// Batch mode
+//===----------------------------------------------------------------------===//
+
+// In batch mode, the input is split on line boundaries into one chunk per
+// thread. Each thread writes its results to a memory stream which is copied to
+// the standard output once all the previous chunks have been written, so that
+// results come out in input order. Every input line gives exactly one output
+// line, blank for blank lines, so that results can be matched to their lines.
+
+#define INIT_BATCH_BUFFER_SIZE (64 * 1024)
+
+typedef struct BatchChunk {
+  const char *begin;
+  const char *end;
+  EvalMode mode;
+  size_t cache_capacity;
+  char *output;
+  size_t output_size;
+  size_t line_count;
+  ResultCache cache_stats; // Counters of the chunk's cache once done
+  bool optimize;
+  bool use_stats;
+  bool color;  // Whether the standard output is a terminal
+  Stats stats; // Measurements of the chunk's session once done
+} BatchChunk;
+
+static int batch_worker(void *data) {
+  BatchChunk *chunk = data;
+  FILE *out = open_memstream(&chunk->output, &chunk->output_size);
+  if (!out)
+    die("Failed to allocate memory");
+
+  Session session;
+  session_init(&session, chunk->mode, chunk->cache_capacity, false);
+  session.format = OUTPUT_LINES;
+  session.color = chunk->color;
+  if (chunk->optimize)
+    session_enable_optimizer(&session);
+  if (chunk->use_stats)
+    session.stats = stats_recorder_create();
+  const char *line = chunk->begin;
+  while (line != chunk->end) {
+    const char *line_end = memchr(line, '\n', chunk->end - line);
+    const char *next = line_end ? line_end + 1 : chunk->end;
+    if (!line_end)
+      line_end = chunk->end;
+
+    session_eval_line(&session, line, line_end - line, out);
+    ++chunk->line_count;
+    line = next;
+  }
+
+  chunk->cache_stats = (ResultCache){
+      .capacity = session.cache.capacity,
+      .hits = session.cache.hits,
+      .misses = session.cache.misses,
+      .evictions = session.cache.evictions,
+  };
+  if (session.stats)
+    chunk->stats = session.stats->totals;
+  free_session(&session);
+  fclose(out);
+  return thrd_success;
+}
+
+typedef struct BatchInput {
+  const char *data;
+  size_t size;
+  bool mapped;
+  char *buffer; // Used when the input cannot be mapped
+} BatchInput;
+
+// Read the whole input, mapping it in memory when it is a regular file. Return
+// false if it cannot be read.
+static bool batch_load_input(int fd, BatchInput *input) {
+  *input = (BatchInput){.data = ""};
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0)
+      return true;
+    void *ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+      return false;
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+    *input = (BatchInput){.data = ptr, .size = st.st_size, .mapped = true};
+    return true;
+  }
+
+  // Pipes and terminals cannot be mapped, read them into a buffer instead
+  char *buffer = 0;
+  arraylist_grow(buffer, INIT_BATCH_BUFFER_SIZE);
+  for (;;) {
+    if (arraylist_size(buffer) == arraylist_capacity(buffer))
+      arraylist_grow(buffer, arraylist_capacity(buffer));
+    ssize_t n = read(fd, buffer + arraylist_size(buffer),
+                     arraylist_capacity(buffer) - arraylist_size(buffer));
+    if (n < 0) {
+      arraylist_free(buffer);
+      return false;
+    }
+    if (n == 0)
       break;
+    arraylist_ptr(buffer)->size += n;
+  }
+  *input = (BatchInput){
+      .data = buffer, .size = arraylist_size(buffer), .buffer = buffer};
+  return true;
+}
+
+static void batch_free_input(BatchInput *input) {
+  if (input->mapped)
+    munmap((void *)input->data, input->size);
+  arraylist_free(input->buffer);
+  *input = (BatchInput){0};
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+  struct timespec end;
+  timespec_get(&end, TIME_UTC);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// Evaluate every line of the given file ("-" for the standard input) using
+// thread_count threads. Return the process exit code.
+static int run_batch(const char *path, size_t thread_count, EvalMode mode,
+                     size_t cache_capacity, bool optimize,
+                     StatsFormat stats_format) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+
+  // Reading is measured as a whole, the input being loaded at once
+  StatsRecorder *stats = stats_format ? stats_recorder_create() : 0;
+  stats_begin(stats);
+  BatchInput input;
+  bool loaded = batch_load_input(fd, &input);
+  stats_end(stats, PHASE_READ);
+  if (!loaded) {
+    stats_recorder_free(stats);
+    perror(path);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    return 1;
+  }
+
+  // Split the input in chunks of roughly equal size ending on line boundaries
+  BatchChunk *chunks = calloc(thread_count, sizeof(BatchChunk));
+  thrd_t *threads = calloc(thread_count, sizeof(thrd_t));
+  if (!chunks || !threads)
+    die("Failed to allocate memory");
+  const char *data = input.data;
+  size_t size = input.size;
+  const char *begin = data;
+  bool color = isatty(STDOUT_FILENO);
+  for (size_t i = 0; i < thread_count; ++i) {
+    const char *end = data + size * (i + 1) / thread_count;
+    if (end < begin)
+      end = begin;
+    if (end != data + size) {
+      const char *newline = memchr(end, '\n', data + size - end);
+      end = newline ? newline + 1 : data + size;
     }
+    chunks[i] = (BatchChunk){.begin = begin,
+                             .end = end,
+                             .mode = mode,
+                             .cache_capacity = cache_capacity,
+                             .optimize = optimize,
+                             .use_stats = stats != 0,
+                             .color = color};
+    if (thrd_create(&threads[i], batch_worker, &chunks[i]) != thrd_success)
+      die("Failed to create thread");
+    begin = end;
   }
-  return expr;
+
+  size_t line_count = 0;
+  ResultCache cache_stats = {0};
+  for (size_t i = 0; i < thread_count; ++i) {
+    thrd_join(threads[i], 0);
+    fwrite(chunks[i].output, 1, chunks[i].output_size, stdout);
+    free(chunks[i].output);
+    line_count += chunks[i].line_count;
+    cache_stats.capacity += chunks[i].cache_stats.capacity;
+    cache_stats.hits += chunks[i].cache_stats.hits;
+    cache_stats.misses += chunks[i].cache_stats.misses;
+    cache_stats.evictions += chunks[i].cache_stats.evictions;
+    if (stats)
+      stats_merge(&stats->totals, &chunks[i].stats);
+  }
+  fflush(stdout);
+
+  double seconds = elapsed_seconds(&start);
+  fprintf(stderr, "%zu lines in %.3f s (%.0f lines/s, %zu threads)\n",
+          line_count, seconds, seconds > 0 ? line_count / seconds : 0.0,
+          thread_count);
+  if (cache_stats.capacity > 0)
+    fprintf(stderr,
+            "cache: %zu hits, %zu misses, %zu evictions (%zu entries per "
+            "thread)\n",
+            cache_stats.hits, cache_stats.misses, cache_stats.evictions,
+            cache_capacity);
+  if (stats)
+    stats_print(stderr, &stats->totals, stats_format);
+
+  stats_recorder_free(stats);
+  free(threads);
+  free(chunks);
+  batch_free_input(&input);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return 0;
 }
 
-static Expression *parse_expression(Token **const tokens) {
-  Expression *expr = parse_term(tokens);
+//===----------------------------------------------------------------------===//
+// Server mode
+//===----------------------------------------------------------------------===//
+
+// In server mode, lines are read from clients connected to a Unix domain
+// socket, which may send many of them without waiting for the results. Every
+// line gets exactly one reply line, the same as in batch mode but never
+// colored, so an error costs a short line however long the request. The main
+// thread does all the socket I/O from an epoll loop and hands the complete
+// lines of each read to a pool of worker threads as one job, every worker
+// evaluating with its own session. Jobs are kept in arrival order for each
+// connection and their output is only sent once all the previous ones are done,
+// so results come back in order even though jobs are evaluated concurrently.
+// Variables are not available since any worker may evaluate a line.
 
-  for (bool done = false; !done;) {
-    Token *curr = *tokens;
-    switch (curr->type) {
-    case TOKEN_PLUS:
-      *tokens += 1;
-      expr = expr_add(expr, parse_term(tokens));
-      break;
-    case TOKEN_MINUS:
-      *tokens += 1;
-      expr = expr_sub(expr, parse_term(tokens));
-      break;
-    default:
-      done = true;
+#if CALC_SERVER
+#define SERVER_READ_SIZE (64 * 1024)
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_LINE (1024 * 1024) // Longer lines close the connection
+
+// Bytes of input being evaluated and output waiting to be sent after which a
+// connection is not read anymore until its client catches up
+#define SERVER_MAX_BACKLOG (4 * 1024 * 1024)
+
+typedef struct Connection Connection;
+
+typedef struct ServerJob {
+  Connection *conn;
+  char *input; // Complete lines
+  char *output;
+  size_t output_size;
+  size_t line_count;
+  bool done;                   // Only accessed by the main thread
+  struct ServerJob *next;      // Next job of the same connection
+  struct ServerJob *next_work; // Next job waiting for a worker or done
+} ServerJob;
+
+struct Connection {
+  int fd; // -1 once closed, the connection living on until its jobs are done
+  char *input;         // Start of a line whose end was not received yet
+  char *output;        // Results waiting to be sent
+  size_t output_sent;  // Part of the output already sent
+  size_t backlog;      // Size of the input of the jobs not done yet
+  ServerJob *jobs;     // Jobs in arrival order
+  ServerJob *last_job; // Where new jobs are appended
+  uint32_t events;     // Events currently watched
+  bool eof;            // Whether the client is done sending
+  Connection *prev, *next;
+};
+
+typedef struct Server {
+  int listen_fd;
+  int epoll_fd;
+  int wake_fd;   // Signalled by workers when jobs are done
+  int signal_fd; // Receives the signals stopping the server
+  EvalMode mode;
+  size_t cache_capacity;
+  bool optimize;
+  StatsRecorder *stats; // Measures reads, then gets the totals of workers
+  Connection *connections;
+  Connection *closed; // Connections to free at the end of the iteration
+  Connection **ready; // Connections with jobs done, while collecting them
+  size_t connection_count;
+
+  // Shared with the workers
+  mtx_t lock;
+  cnd_t work_available;
+  ServerJob *work;      // Jobs waiting for a worker
+  ServerJob *last_work; // Where new jobs are appended
+  ServerJob *done;      // Jobs done since the main thread last looked
+  bool stopping;
+  size_t line_count;
+} Server;
+
+static void append_bytes(char **list, const char *data, size_t size) {
+  arraylist_push_n(*list, data, size);
+}
+
+static int server_worker(void *data) {
+  Server *server = data;
+  Session session;
+  session_init(&session, server->mode, server->cache_capacity, false);
+  session.format = OUTPUT_LINES;
+  if (server->optimize)
+    session_enable_optimizer(&session);
+  if (server->stats)
+    session.stats = stats_recorder_create();
+
+  mtx_lock(&server->lock);
+  for (;;) {
+    while (!server->work && !server->stopping)
+      cnd_wait(&server->work_available, &server->lock);
+    if (server->stopping)
       break;
+    ServerJob *job = server->work;
+    server->work = job->next_work;
+    if (!server->work)
+      server->last_work = 0;
+    mtx_unlock(&server->lock);
+
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    if (!out)
+      die("Failed to allocate memory");
+    const char *line = job->input, *end = line + arraylist_size(job->input);
+    while (line != end) {
+      const char *line_end = memchr(line, '\n', end - line);
+      const char *next = line_end ? line_end + 1 : end;
+      if (!line_end)
+        line_end = end;
+      session_eval_line(&session, line, line_end - line, out);
+      ++job->line_count;
+      line = next;
     }
+    fclose(out);
+
+    mtx_lock(&server->lock);
+    server->line_count += job->line_count;
+    bool wake = !server->done;
+    job->next_work = server->done;
+    server->done = job;
+    if (wake && write(server->wake_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+      die("Failed to wake up the server");
   }
-  return expr;
+  if (session.stats)
+    stats_merge(&server->stats->totals, &session.stats->totals);
+  mtx_unlock(&server->lock);
+
+  free_session(&session);
+  return thrd_success;
+}
+
+static void server_submit(Server *server, Connection *conn, char *input) {
+  ServerJob *job = calloc(1, sizeof(ServerJob));
+  if (!job)
+    die("Failed to allocate memory");
+  *job = (ServerJob){.conn = conn, .input = input};
+  if (conn->last_job)
+    conn->last_job->next = job;
+  else
+    conn->jobs = job;
+  conn->last_job = job;
+  conn->backlog += arraylist_size(input);
+
+  mtx_lock(&server->lock);
+  if (server->last_work)
+    server->last_work->next_work = job;
+  else
+    server->work = job;
+  server->last_work = job;
+  cnd_signal(&server->work_available);
+  mtx_unlock(&server->lock);
+}
+
+static void free_server_job(ServerJob *job) {
+  arraylist_free(job->input);
+  free(job->output);
+  free(job);
+}
+
+// Forget a closed connection without any job left. It is only freed at the
+// end of the iteration since pending events may still refer to it.
+static void server_release(Server *server, Connection *conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    server->connections = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  conn->next = server->closed;
+  server->closed = conn;
+}
+
+static void server_close(Server *server, Connection *conn) {
+  if (conn->fd < 0)
+    return;
+  close(conn->fd);
+  conn->fd = -1;
+  arraylist_free(conn->input);
+  arraylist_free(conn->output);
+  if (!conn->jobs)
+    server_release(server, conn);
 }
 
-static Expression *parse(Token *tokens) {
-  Expression *result = parse_expression(&tokens);
-  if (tokens->type != TOKEN_EOF) {
-    parser_error("Unexpected input after expression", tokens);
-    result->valid = false;
+// Send as much of the pending output as the socket accepts
+static void server_write(Server *server, Connection *conn) {
+  while (conn->fd >= 0 && conn->output_sent < arraylist_size(conn->output)) {
+    ssize_t n = send(conn->fd, conn->output + conn->output_sent,
+                     arraylist_size(conn->output) - conn->output_sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        server_close(server, conn);
+      return;
+    }
+    conn->output_sent += n;
   }
-  return result;
+  arraylist_clear(conn->output);
+  conn->output_sent = 0;
 }
 
-//===----------------------------------------------------------------------===//
-// Evaluation
-//===----------------------------------------------------------------------===//
+// Close the connection once everything was answered after the client is done
+// sending, or else watch the events it is ready for
+static void server_update(Server *server, Connection *conn) {
+  if (conn->fd < 0)
+    return;
+  size_t pending = arraylist_size(conn->output) - conn->output_sent;
+  if (conn->eof && !conn->jobs && pending == 0) {
+    server_close(server, conn);
+    return;
+  }
+  uint32_t events = 0;
+  if (!conn->eof && conn->backlog + pending < SERVER_MAX_BACKLOG)
+    events |= EPOLLIN;
+  if (pending > 0)
+    events |= EPOLLOUT;
+  if (events != conn->events) {
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+  }
+}
 
-static int eval(Expression *expr);
+static void server_read(Server *server, Connection *conn) {
+  char buffer[SERVER_READ_SIZE];
+  stats_begin(server->stats);
+  ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+  stats_end(server->stats, PHASE_READ);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      server_close(server, conn);
+    return;
+  }
+  if (n == 0) {
+    // The last line may not end with a newline
+    conn->eof = true;
+    if (arraylist_size(conn->input) > 0) {
+      server_submit(server, conn, conn->input);
+      conn->input = 0;
+    }
+    return;
+  }
 
-static int eval_number(Number n) {
-  switch (n.type) {
-  case NUMBER_INTEGER:
-    return n.integer;
-  default:
-    UNREACHABLE("Unexpected number type");
+  size_t complete = n;
+  while (complete > 0 && buffer[complete - 1] != '\n')
+    --complete;
+  if (complete == 0) {
+    append_bytes(&conn->input, buffer, n);
+    if (arraylist_size(conn->input) > SERVER_MAX_LINE)
+      server_close(server, conn);
+    return;
   }
+  char *input = conn->input;
+  conn->input = 0;
+  append_bytes(&input, buffer, complete);
+  append_bytes(&conn->input, buffer + complete, n - complete);
+  server_submit(server, conn, input);
 }
 
-static int eval_binop(BinaryOp op) {
-  switch (op.op) {
-  case BINARY_OP_ADD:
-    return eval(op.lhs) + eval(op.rhs);
-  case BINARY_OP_SUB:
-    return eval(op.lhs) - eval(op.rhs);
-  case BINARY_OP_MUL:
-    return eval(op.lhs) * eval(op.rhs);
-  case BINARY_OP_DIV:
-    return eval(op.lhs) / eval(op.rhs);
-  default:
-    UNREACHABLE("Unexpected binary operator");
+static void server_accept(Server *server) {
+  for (;;) {
+    int fd = accept(server->listen_fd, 0, 0);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn)
+      die("Failed to allocate memory");
+    *conn = (Connection){.fd = fd, .events = EPOLLIN};
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      perror("epoll_ctl");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->next = server->connections;
+    if (conn->next)
+      conn->next->prev = conn;
+    server->connections = conn;
+    ++server->connection_count;
   }
 }
 
-static int eval_unop(UnaryOp op) {
-  switch (op.op) {
-  case UNARY_OP_PLUS:
-    return eval(op.expr);
-  case UNARY_OP_NEG:
-    return -eval(op.expr);
-  default:
-    UNREACHABLE("Unexpected unary operator");
+// Move the output of jobs done to their connections, in order
+static void server_collect(Server *server) {
+  uint64_t count;
+  if (read(server->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    die("Failed to read the wake-up event");
+  mtx_lock(&server->lock);
+  ServerJob *done = server->done;
+  server->done = 0;
+  mtx_unlock(&server->lock);
+
+  // Draining a connection frees its jobs, including some further down the
+  // list, so the connections are gathered first
+  arraylist_clear(server->ready);
+  for (ServerJob *job = done; job; job = job->next_work) {
+    job->done = true;
+    arraylist_push(server->ready, job->conn);
+  }
+  for (size_t i = 0; i < arraylist_size(server->ready); ++i) {
+    Connection *conn = server->ready[i];
+    bool drained = false;
+    while (conn->jobs && conn->jobs->done) {
+      drained = true;
+      ServerJob *job = conn->jobs;
+      conn->jobs = job->next;
+      if (!conn->jobs)
+        conn->last_job = 0;
+      conn->backlog -= arraylist_size(job->input);
+      if (conn->fd >= 0)
+        append_bytes(&conn->output, job->output, job->output_size);
+      free_server_job(job);
+    }
+    if (conn->fd >= 0) {
+      server_write(server, conn);
+      server_update(server, conn);
+    } else if (drained && !conn->jobs) {
+      // Closed while its jobs were running, it can now be freed
+      server_release(server, conn);
+    }
   }
 }
 
-static int eval(Expression *expr) {
-  switch (expr->type) {
-  case EXPR_NUMBER:
-    return eval_number(expr->number);
-  case EXPR_BINARY_OP:
-    return eval_binop(expr->binary_op);
-  case EXPR_UNARY_OP:
-    return eval_unop(expr->unary_op);
-  default:
-    UNREACHABLE("Unexpected expression type");
+// Free the connections closed during the last iteration, which no event
+// refers to anymore
+static void server_free_closed(Server *server) {
+  while (server->closed) {
+    Connection *conn = server->closed;
+    server->closed = conn->next;
+    free(conn);
+  }
+}
+
+// Create the listening socket, replacing a stale socket left at path. Return
+// -1 on error.
+static int server_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: Socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serve clients on a Unix socket at path using thread_count workers until
+// SIGINT or SIGTERM is received. Return the process exit code.
+static int run_server(const char *path, size_t thread_count, EvalMode mode,
+                      size_t cache_capacity, bool optimize,
+                      StatsFormat stats_format) {
+  Server server = {
+      .mode = mode, .cache_capacity = cache_capacity, .optimize = optimize};
+  server.listen_fd = server_listen(path);
+  if (server.listen_fd < 0)
+    return 1;
+  if (stats_format)
+    server.stats = stats_recorder_create();
+
+  // The signals are blocked before the workers are started so that they are
+  // only ever received through the signalfd
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, &old_signals);
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (server.epoll_fd < 0 || server.wake_fd < 0 || server.signal_fd < 0)
+    die("Failed to set up the event loop");
+  // Events on these descriptors are told apart from those on connections by
+  // pointing to the descriptors themselves
+  int *fds[] = {&server.listen_fd, &server.wake_fd, &server.signal_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = fds[i]};
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, *fds[i], &event) < 0)
+      die("Failed to set up the event loop");
+  }
+
+  if (mtx_init(&server.lock, mtx_plain) != thrd_success ||
+      cnd_init(&server.work_available) != thrd_success)
+    die("Failed to create synchronization primitives");
+  thrd_t *threads = calloc(thread_count, sizeof(thrd_t));
+  if (!threads)
+    die("Failed to allocate memory");
+  for (size_t i = 0; i < thread_count; ++i) {
+    if (thrd_create(&threads[i], server_worker, &server) != thrd_success)
+      die("Failed to create thread");
+  }
+  fprintf(stderr, "Listening on %s (%zu threads)\n", path, thread_count);
+
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+  bool running = true;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  while (running) {
+    int n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR)
+      die("Failed to wait for events");
+    for (int i = 0; i < n; ++i) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &server.listen_fd) {
+        server_accept(&server);
+      } else if (ptr == &server.wake_fd) {
+        server_collect(&server);
+      } else if (ptr == &server.signal_fd) {
+        // Consumed so that it is not delivered once unblocked
+        struct signalfd_siginfo info;
+        if (read(server.signal_fd, &info, sizeof(info)) < 0 && errno != EAGAIN)
+          die("Failed to read the signal");
+        running = false;
+      } else {
+        Connection *conn = ptr;
+        if (conn->fd < 0)
+          continue;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          // The client is gone, the results cannot be delivered anymore
+          server_close(&server, conn);
+          continue;
+        }
+        if (events[i].events & EPOLLIN)
+          server_read(&server, conn);
+        if (events[i].events & EPOLLOUT)
+          server_write(&server, conn);
+        server_update(&server, conn);
+      }
+    }
+    server_free_closed(&server);
+  }
+
+  mtx_lock(&server.lock);
+  server.stopping = true;
+  cnd_broadcast(&server.work_available);
+  mtx_unlock(&server.lock);
+  for (size_t i = 0; i < thread_count; ++i)
+    thrd_join(threads[i], 0);
+  free(threads);
+
+  // Every job still belongs to its connection
+  while (server.connections) {
+    Connection *conn = server.connections;
+    server.connections = conn->next;
+    while (conn->jobs) {
+      ServerJob *job = conn->jobs;
+      conn->jobs = job->next;
+      free_server_job(job);
+    }
+    if (conn->fd >= 0)
+      close(conn->fd);
+    arraylist_free(conn->input);
+    arraylist_free(conn->output);
+    free(conn);
   }
+  server_free_closed(&server);
+  arraylist_free(server.ready);
+
+  double seconds = elapsed_seconds(&start);
+  fprintf(stderr, "%zu lines from %zu connections in %.3f s\n",
+          server.line_count, server.connection_count, seconds);
+  if (server.stats)
+    stats_print(stderr, &server.stats->totals, stats_format);
+  stats_recorder_free(server.stats);
+
+  cnd_destroy(&server.work_available);
+  mtx_destroy(&server.lock);
+  close(server.signal_fd);
+  close(server.wake_fd);
+  close(server.epoll_fd);
+  close(server.listen_fd);
+  unlink(path);
+  sigprocmask(SIG_SETMASK, &old_signals, 0);
+  return 0;
+}
+#else
+static int run_server(const char *path, size_t thread_count, EvalMode mode,
+                      size_t cache_capacity, bool optimize,
+                      StatsFormat stats_format) {
+  (void)path, (void)thread_count, (void)mode, (void)cache_capacity;
+  (void)optimize, (void)stats_format;
+  fprintf(stderr, "Server mode is not supported on this platform\n");
+  return 1;
 }
+#endif // CALC_SERVER
 
 //===----------------------------------------------------------------------===//
 // User interaction
@@ -470,7 +5313,8 @@ char *read_input(size_t size, char s[restrict size], FILE *restrict stream) {
   return result;
 }
 
-void read_input_line(size_t *restrict size, char **input) {
+// Return false once the end of the input has been reached
+bool read_input_line(size_t *restrict size, char **input) {
   printf("> ");
   fflush(stdout);
 
@@ -480,6 +5324,8 @@ void read_input_line(size_t *restrict size, char **input) {
   while (!result) {
     result = read_input(remaining_size, current_input, stdin);
     if (!result) {
+      if (feof(stdin) || ferror(stdin))
+        return (*input)[0] != 0;
       *input = realloc(*input, *size * 2);
       if (!*input)
         die("Failed to allocate memory");
@@ -489,42 +5335,133 @@ void read_input_line(size_t *restrict size, char **input) {
       *size *= 2;
     }
   }
+  return true;
+}
+
+static void usage(const char *program_name) {
+  fprintf(stderr,
+          "Usage: %s [--eval=tree|flat|vm] [--jit] [--optimize] [--cache N] "
+          "[--batch FILE | --serve PATH] [--jobs N] [--stats[=json]]\n"
+          "\n"
+          "  --eval=vm     Compile expressions to bytecode (default)\n"
+          "  --eval=tree   Walk the expression tree, for reference\n"
+          "  --eval=flat   Flatten the expression tree into arrays first\n"
+          "  --jit         Compile frequently recomputed variables to native "
+          "code\n"
+          "  --optimize    Fold constants, simplify identities and share\n"
+          "                repeated subexpressions before evaluating\n"
+          "  --cache N     Remember the results of the last N distinct lines\n"
+          "                (default %d, 0 disables the cache)\n"
+          "  --batch FILE  Evaluate every line of FILE (- for stdin)\n"
+          "  --serve PATH  Evaluate lines sent to a Unix socket at PATH until\n"
+          "                interrupted, with the same output as --batch\n"
+          "  --jobs N      Number of threads used in batch and server modes,\n"
+          "                and to evaluate large lines interactively\n"
+          "  --stats       Print the time spent in each phase at exit, with\n"
+          "                hardware counters when available (=json for JSON)\n"
+          "\n"
+          "In interactive mode, 'cache' prints the cache statistics and "
+          "'exit' quits.\n",
+          program_name, DEFAULT_CACHE_CAPACITY);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  EvalMode mode = EVAL_MODE_VM;
+  const char *batch_path = 0;
+  const char *socket_path = 0;
+  long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  long cache_capacity = DEFAULT_CACHE_CAPACITY;
+  bool use_jit = false;
+  bool optimize = false;
+  StatsFormat stats_format = STATS_NONE;
+#ifdef ALLOC_STATS
+  alloc_stats_print_at_exit();
+#endif
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--eval=tree") == 0) {
+      mode = EVAL_MODE_TREE;
+    } else if (strcmp(argv[i], "--eval=flat") == 0) {
+      mode = EVAL_MODE_FLAT;
+    } else if (strcmp(argv[i], "--eval=vm") == 0) {
+      mode = EVAL_MODE_VM;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      use_jit = true;
+    } else if (strcmp(argv[i], "--optimize") == 0) {
+      optimize = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats_format = STATS_TABLE;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats_format = STATS_JSON;
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache_capacity = strtol(argv[++i], 0, 10);
+      if (cache_capacity < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_path = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      thread_count = strtol(argv[++i], 0, 10);
+      if (thread_count <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (batch_path && socket_path) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (socket_path)
+    return run_server(socket_path, thread_count > 0 ? thread_count : 1, mode,
+                      cache_capacity, optimize, stats_format);
+  if (batch_path)
+    return run_batch(batch_path, thread_count > 0 ? thread_count : 1, mode,
+                     cache_capacity, optimize, stats_format);
+
   puts("Calc - A simple calculator\n"
        "This is free and unencumbered software released into the public "
        "domain.\n");
 
-  bool quit = false;
+  Session session;
+  session_init(&session, mode, cache_capacity, true);
+  session.sheet.use_jit = use_jit;
+  session.pool_threads = thread_count > 0 ? thread_count : 1;
+  if (optimize)
+    session_enable_optimizer(&session);
+  if (stats_format)
+    session.stats = stats_recorder_create();
   size_t input_length = INIT_USER_INPUT_SIZE;
   char *input = malloc(input_length);
   if (!input)
     die("Failed to allocate memory");
 
-  do {
-    read_input_line(&input_length, &input);
-    if (strcmp(input, "exit") == 0) {
-      quit = true;
+  for (;;) {
+    stats_begin(session.stats);
+    bool more = read_input_line(&input_length, &input);
+    stats_end(session.stats, PHASE_READ);
+    if (!more || strcmp(input, "exit") == 0)
+      break;
+    if (strcmp(input, "cache") == 0) {
+      cache_print_stats(&session.cache, stdout);
       continue;
     }
+    session_eval_line(&session, input, strlen(input), stdout);
+  }
 
-    Token *tokens = tokenize(input);
-
-    if (tokens->type != TOKEN_EOF) {
-      Expression *result = parse(tokens);
-      if (result->valid) {
-        printf("%d\n", eval(result));
-      }
-      free_expr(result);
-    }
-
-    arraylist_free(tokens);
-  } while (!quit);
-
+  if (session.stats)
+    stats_print(stderr, &session.stats->totals, stats_format);
+  free_session(&session);
   if (input) {
     free(input);
     input = 0;
   }
   return 0;
 }
+#endif // CALC_NO_MAIN
@@ -0,0 +1,248 @@
+//===----------------------------------------------------------------------===//
+// hashmap-bench - Benchmarks for hashmap
+//
+// Maps of 10^3 up to --max-size random 64-bit keys are filled, searched for
+// present and missing keys, and emptied. The same operations on an arraylist
+// scanned linearly with arraylist_find are timed for comparison, on a sample
+// of the keys since they are quadratic. Every benchmark is reported as one
+// tab-separated line holding the median and 99th percentile of its runs, like
+// calc-bench.
+//
+//===----------------------------------------------------------------------===//
+
+#include "arraylist-algorithm.h"
+#include "arraylist.h"
+#include "bench.h"
+#include "hashmap.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_MAX_SIZE 1000000
+#define DEFAULT_RUNS 5
+#define MIN_SIZE 1000
+
+// Operations timed on linear lists, and the largest list scanned
+#define LINEAR_OPS 1000
+#define LINEAR_MAX_SIZE 100000
+
+#define KEY_EQUAL(a, b) ((a) == (b))
+
+HASHMAP_DEFINE(KeyMap, uint64_t, uint64_t, hashmap_hash_u64, KEY_EQUAL)
+
+// Report a benchmark on maps or lists of n keys, named after n
+static void report_keys(const char *name, size_t n, size_t items,
+                        double *samples) {
+  char full_name[64];
+  snprintf(full_name, sizeof(full_name), "%s.%zu", name, n);
+  bench_report(full_name, "keys", items, samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Hash map
+//===----------------------------------------------------------------------===//
+
+// keys holds n present keys followed by n missing ones
+static void bench_hashmap(const uint64_t *keys, size_t n, size_t runs) {
+  double *samples = 0;
+  uint64_t *hashes = 0;
+  arraylist_init(hashes, n);
+  for (size_t i = 0; i < n; ++i)
+    arraylist_push(hashes, hashmap_hash_u64(keys[i]));
+
+  KeyMap map = {0};
+  for (size_t i = 0; i < runs; ++i) {
+    KeyMap_free(&map);
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j) {
+      bool inserted;
+      KeyMap_insert(&map, keys[j], &inserted)->value = j;
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(map.size == n, "insert.hashmap");
+  }
+  report_keys("insert.hashmap", n, n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j) {
+      KeyMap_Entry *e = KeyMap_find(&map, keys[j]);
+      found += e && e->value == j;
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == n, "lookup.hashmap");
+  }
+  report_keys("lookup.hashmap", n, n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j)
+      found += KeyMap_find_hash(&map, keys[j], hashes[j]) != 0;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == n, "lookup_prehashed.hashmap");
+  }
+  report_keys("lookup_prehashed.hashmap", n, n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j)
+      found += KeyMap_find(&map, keys[n + j]) != 0;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == 0, "lookup_missing.hashmap");
+  }
+  report_keys("lookup_missing.hashmap", n, n, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    if (map.size == 0) {
+      for (size_t j = 0; j < n; ++j) {
+        bool inserted;
+        KeyMap_insert(&map, keys[j], &inserted)->value = j;
+      }
+    }
+    size_t erased = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < n; ++j)
+      erased += KeyMap_erase(&map, keys[j]);
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(erased == n && map.size == 0, "erase.hashmap");
+  }
+  report_keys("erase.hashmap", n, n, samples);
+  KeyMap_free(&map);
+  arraylist_free(hashes);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Linear scan
+//===----------------------------------------------------------------------===//
+
+// Time LINEAR_OPS operations on a list of n keys, each scanning the list
+static void bench_linear(const uint64_t *keys, size_t n, size_t runs) {
+  double *samples = 0;
+  size_t ops = n < LINEAR_OPS ? n : LINEAR_OPS, stride = n / ops;
+  uint64_t *list = 0;
+
+  // Inserting checks that the key is missing then appends it
+  for (size_t i = 0; i < runs; ++i) {
+    arraylist_free(list);
+    arraylist_push_n(list, keys + ops, n - ops);
+    double start = bench_now_ns();
+    for (size_t j = 0; j < ops; ++j) {
+      if (arraylist_find(list, keys[j]) == arraylist_size(list))
+        arraylist_push(list, keys[j]);
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(arraylist_size(list) == n, "insert.linear");
+  }
+  report_keys("insert.linear", n, ops, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < ops; ++j)
+      found += arraylist_find(list, keys[j * stride]) < n;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == ops, "lookup.linear");
+  }
+  report_keys("lookup.linear", n, ops, samples);
+
+  for (size_t i = 0; i < runs; ++i) {
+    size_t found = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < ops; ++j)
+      found += arraylist_find(list, keys[n + j]) < n;
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(found == 0, "lookup_missing.linear");
+  }
+  report_keys("lookup_missing.linear", n, ops, samples);
+
+  // Erasing moves the last key into the place of the erased one
+  for (size_t i = 0; i < runs; ++i) {
+    if (arraylist_size(list) < n) {
+      arraylist_clear(list);
+      arraylist_push_n(list, keys, n);
+    }
+    size_t erased = 0;
+    double start = bench_now_ns();
+    for (size_t j = 0; j < ops; ++j) {
+      size_t k = arraylist_find(list, keys[j * stride]);
+      if (k < arraylist_size(list)) {
+        list[k] = arraylist_pop(list);
+        ++erased;
+      }
+    }
+    arraylist_push(samples, bench_now_ns() - start);
+    bench_check(erased == ops, "erase.linear");
+  }
+  report_keys("erase.linear", n, ops, samples);
+  arraylist_free(list);
+  arraylist_free(samples);
+}
+
+//===----------------------------------------------------------------------===//
+// Driver
+//===----------------------------------------------------------------------===//
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --max-size N   keys of the largest map, from %d by powers of 10 "
+          "(default %d)\n"
+          "  --runs N       runs of each benchmark (default %d)\n",
+          program, MIN_SIZE, DEFAULT_MAX_SIZE, DEFAULT_RUNS);
+  exit(1);
+}
+
+static size_t parse_count(const char *program, const char *arg) {
+  char *end;
+  if (!arg || !isdigit((unsigned char)*arg))
+    usage(program);
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (*end != '\0')
+    usage(program);
+  return value;
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_size = DEFAULT_MAX_SIZE, runs = DEFAULT_RUNS;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : 0;
+    if (strcmp(arg, "--max-size") == 0) {
+      max_size = parse_count(argv[0], value), ++i;
+    } else if (strcmp(arg, "--runs") == 0) {
+      runs = parse_count(argv[0], value), ++i;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (max_size < MIN_SIZE || runs == 0)
+    usage(argv[0]);
+
+  // The splitmix64 finalizer is a bijection, so the keys are distinct
+  uint64_t *keys = 0;
+  arraylist_init(keys, 2 * max_size);
+  for (size_t i = 0; i < 2 * max_size; ++i)
+    arraylist_push(keys, hashmap_hash_u64(i ^ 0x5851f42d4c957f2dull));
+
+  printf("# max_size=%zu runs=%zu\n", max_size, runs);
+  bench_report_header();
+  for (size_t n = MIN_SIZE; n <= max_size; n *= 10) {
+    // Missing keys are taken past the largest map
+    uint64_t *sample = 0;
+    arraylist_push_n(sample, keys, n);
+    arraylist_push_n(sample, keys + max_size, n);
+    bench_hashmap(sample, n, runs);
+    if (n <= LINEAR_MAX_SIZE)
+      bench_linear(sample, n, runs);
+    arraylist_free(sample);
+  }
+
+  arraylist_free(keys);
+  return 0;
+}
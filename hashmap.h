@@ -0,0 +1,257 @@
+//===----------------------------------------------------------------------===//
+// hashmap - Open addressing hash map
+//
+// HASHMAP_DEFINE generates a map type and its functions for one key and value
+// type, with the hash and equality of keys inlined. Like a null arraylist, a
+// zero-initialized map is empty and ready for use.
+//
+// The layout is that of a Swiss table: one control byte per slot tells whether
+// it is empty, deleted or full, and holds 7 bits of the hash of a full slot's
+// key. Slots are probed by groups of 16, whose control bytes are compared to
+// the hash at once with SSE2 unless HASHMAP_NO_SIMD is defined, so that keys
+// are only compared on likely matches. Erased slots go back to empty unless
+// their group has been full, in which case lookups may have probed past it
+// and a tombstone is left.
+//
+// The slots and control bytes are arraylists, allocated like any other list of
+// the translation unit. Pointers to entries are invalidated by insertions.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_HASHMAP_H
+#define INCLUDED_HASHMAP_H
+
+#include "arraylist.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(HASHMAP_NO_SIMD) && defined(__SSE2__)
+#define HASHMAP_SSE2 1
+#include <emmintrin.h>
+#else
+#define HASHMAP_SSE2 0
+#endif
+
+#define HASHMAP_GROUP_SIZE 16
+#define HASHMAP_EMPTY ((uint8_t)0x80)
+#define HASHMAP_DELETED ((uint8_t)0xfe)
+
+// Finalizer of splitmix64, spreading every bit of x over the whole hash
+static inline uint64_t hashmap_hash_u64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static inline uint64_t hashmap_hash_bytes(const void *data, size_t size) {
+  const char *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  uint64_t word = 0;
+  memcpy(&word, p, size);
+  h = (h ^ word) * 0x94d049bb133111ebull;
+  return h ^ (h >> 29);
+}
+
+// Bit i of the result is set when control byte i of the group is byte
+static inline unsigned hashmap_match(const uint8_t *group, uint8_t byte) {
+#if HASHMAP_SSE2
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < HASHMAP_GROUP_SIZE; ++i)
+    mask |= (unsigned)(group[i] == byte) << i;
+  return mask;
+#endif
+}
+
+// Bit i of the result is set when slot i of the group is empty or deleted,
+// the only control bytes with their high bit set
+static inline unsigned hashmap_match_free(const uint8_t *group) {
+#if HASHMAP_SSE2
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < HASHMAP_GROUP_SIZE; ++i)
+    mask |= (unsigned)(group[i] >> 7) << i;
+  return mask;
+#endif
+}
+
+// Number of slots of a map holding at least count entries at half its maximum
+// load of 7/8, so that it can grow by as much again before the next rehash
+static inline size_t hashmap_capacity_for(size_t count) {
+  size_t capacity = HASHMAP_GROUP_SIZE;
+  while (capacity / 16 * 7 < count)
+    capacity *= 2;
+  return capacity;
+}
+
+// Define the map type name, mapping key_type to value_type with the entries
+// of type name_Entry, and its functions:
+// - name_Entry *name_find(const name *m, key_type key), null if missing
+// - name_Entry *name_insert(name *m, key_type key, bool *inserted), returning
+//   the entry of key, adding it with an uninitialized value if missing
+// - bool name_erase(name *m, key_type key), false if missing
+// - the same three suffixed with _hash, taking the hash of key as computed by
+//   hash(key) in addition to it, for keys whose hash is already known
+// - name_Entry *name_next(const name *m, size_t *i), iterating over the
+//   entries from slot 0, or returning null past the last one
+// - name_reserve, name_clear and name_free
+// hash(key) must return a uint64_t and equal(a, b) whether two keys are equal.
+#define HASHMAP_DEFINE(name, key_type, value_type, hash, equal)                \
+  typedef struct name##_Entry {                                                \
+    key_type key;                                                              \
+    value_type value;                                                          \
+  } name##_Entry;                                                              \
+                                                                               \
+  typedef struct name {                                                        \
+    uint8_t *ctrl;         /* Control byte of each slot */                     \
+    name##_Entry *entries; /* Slots */                                         \
+    size_t size;                                                               \
+    size_t growth_left; /* Empty slots that may be filled before a rehash */   \
+  } name;                                                                      \
+                                                                               \
+  static inline name##_Entry *name##_find_hash(const name *m, key_type key,    \
+                                               uint64_t h) {                   \
+    size_t capacity = arraylist_size(m->ctrl);                                 \
+    if (capacity == 0)                                                         \
+      return 0;                                                                \
+    size_t groups = capacity / HASHMAP_GROUP_SIZE;                             \
+    size_t g = (h >> 7) & (groups - 1);                                        \
+    for (size_t step = 1;; g = (g + step++) & (groups - 1)) {                  \
+      const uint8_t *group = m->ctrl + g * HASHMAP_GROUP_SIZE;                 \
+      for (unsigned bits = hashmap_match(group, h & 0x7f); bits;               \
+           bits &= bits - 1) {                                                 \
+        name##_Entry *e =                                                      \
+            &m->entries[g * HASHMAP_GROUP_SIZE + __builtin_ctz(bits)];         \
+        if (equal(e->key, key))                                                \
+          return e;                                                            \
+      }                                                                        \
+      if (hashmap_match(group, HASHMAP_EMPTY))                                 \
+        return 0;                                                              \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* Return the first free slot on the probe sequence of the hash */           \
+  static inline size_t name##_free_slot(const name *m, uint64_t h) {           \
+    size_t groups = arraylist_size(m->ctrl) / HASHMAP_GROUP_SIZE;              \
+    size_t g = (h >> 7) & (groups - 1);                                        \
+    for (size_t step = 1;; g = (g + step++) & (groups - 1)) {                  \
+      unsigned bits = hashmap_match_free(m->ctrl + g * HASHMAP_GROUP_SIZE);    \
+      if (bits)                                                                \
+        return g * HASHMAP_GROUP_SIZE + __builtin_ctz(bits);                   \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* Move every entry to new slots for at least count entries, which also      \
+     drops the tombstones */                                                   \
+  static inline void name##_rehash(name *m, size_t count) {                    \
+    size_t capacity = hashmap_capacity_for(count);                             \
+    name old = *m;                                                             \
+    m->ctrl = 0;                                                               \
+    m->entries = 0;                                                            \
+    arraylist_init(m->ctrl, capacity);                                         \
+    arraylist_init(m->entries, capacity);                                      \
+    arraylist_ptr(m->ctrl)->size = capacity;                                   \
+    arraylist_ptr(m->entries)->size = capacity;                                \
+    memset(m->ctrl, HASHMAP_EMPTY, capacity);                                  \
+    for (size_t i = 0; i < arraylist_size(old.ctrl); ++i) {                    \
+      if (old.ctrl[i] & 0x80)                                                  \
+        continue;                                                              \
+      size_t slot = name##_free_slot(m, hash(old.entries[i].key));             \
+      m->ctrl[slot] = old.ctrl[i];                                             \
+      m->entries[slot] = old.entries[i];                                       \
+    }                                                                          \
+    m->growth_left = capacity / 8 * 7 - m->size;                               \
+    arraylist_free(old.ctrl);                                                  \
+    arraylist_free(old.entries);                                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_Entry *name##_insert_hash(name *m, key_type key,        \
+                                                 uint64_t h, bool *inserted) { \
+    name##_Entry *e = name##_find_hash(m, key, h);                             \
+    *inserted = !e;                                                            \
+    if (e)                                                                     \
+      return e;                                                                \
+    if (m->growth_left == 0)                                                   \
+      name##_rehash(m, m->size + 1);                                           \
+    size_t slot = name##_free_slot(m, h);                                      \
+    if (m->ctrl[slot] == HASHMAP_EMPTY)                                        \
+      --m->growth_left;                                                        \
+    m->ctrl[slot] = h & 0x7f;                                                  \
+    m->entries[slot].key = key;                                                \
+    ++m->size;                                                                 \
+    return &m->entries[slot];                                                  \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_erase_hash(name *m, key_type key, uint64_t h) {    \
+    name##_Entry *e = name##_find_hash(m, key, h);                             \
+    if (!e)                                                                    \
+      return false;                                                            \
+    size_t slot = e - m->entries;                                              \
+    const uint8_t *group =                                                     \
+        m->ctrl + slot / HASHMAP_GROUP_SIZE * HASHMAP_GROUP_SIZE;              \
+    /* A group that still has an empty slot has never been full, so no         \
+       lookup has gone past it */                                              \
+    if (hashmap_match(group, HASHMAP_EMPTY)) {                                 \
+      m->ctrl[slot] = HASHMAP_EMPTY;                                           \
+      ++m->growth_left;                                                        \
+    } else {                                                                   \
+      m->ctrl[slot] = HASHMAP_DELETED;                                         \
+    }                                                                          \
+    --m->size;                                                                 \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_Entry *name##_find(const name *m, key_type key) {       \
+    return name##_find_hash(m, key, hash(key));                                \
+  }                                                                            \
+                                                                               \
+  static inline name##_Entry *name##_insert(name *m, key_type key,             \
+                                            bool *inserted) {                  \
+    return name##_insert_hash(m, key, hash(key), inserted);                    \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_erase(name *m, key_type key) {                     \
+    return name##_erase_hash(m, key, hash(key));                               \
+  }                                                                            \
+                                                                               \
+  static inline name##_Entry *name##_next(const name *m, size_t *i) {          \
+    for (; *i < arraylist_size(m->ctrl); ++*i) {                               \
+      if (!(m->ctrl[*i] & 0x80))                                               \
+        return &m->entries[(*i)++];                                            \
+    }                                                                          \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  /* Make room for count entries in total without rehashing */                 \
+  static inline void name##_reserve(name *m, size_t count) {                   \
+    if (count > m->size + m->growth_left)                                      \
+      name##_rehash(m, count);                                                 \
+  }                                                                            \
+                                                                               \
+  static inline void name##_clear(name *m) {                                   \
+    if (m->ctrl)                                                               \
+      memset(m->ctrl, HASHMAP_EMPTY, arraylist_size(m->ctrl));                 \
+    m->size = 0;                                                               \
+    m->growth_left = arraylist_size(m->ctrl) / 8 * 7;                          \
+  }                                                                            \
+                                                                               \
+  static inline void name##_free(name *m) {                                    \
+    arraylist_free(m->ctrl);                                                   \
+    arraylist_free(m->entries);                                                \
+    m->size = 0;                                                               \
+    m->growth_left = 0;                                                        \
+  }
+
+#endif // INCLUDED_HASHMAP_H
@@ -0,0 +1,90 @@
+#include "libcalc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#define THREAD_COUNT 4
+#define ROW_COUNT 100000
+
+typedef struct {
+  const calc_Expr *expr;
+  int first;
+  long long sum;
+} Job;
+
+int thread_function(void *data) {
+  Job *job = data;
+  int *params = malloc(ROW_COUNT * 2 * sizeof(int));
+  calc_Result *results = malloc(ROW_COUNT * sizeof(calc_Result));
+  if (!params || !results)
+    return thrd_nomem;
+  for (int i = 0; i < ROW_COUNT; ++i) {
+    params[2 * i] = job->first + i % 1000;
+    params[2 * i + 1] = i;
+  }
+
+  // Each thread needs its own evaluator, while the expression is shared
+  calc_Evaluator *ev = calc_evaluator_create();
+  calc_eval_batch(job->expr, ev, params, ROW_COUNT, results);
+  calc_evaluator_free(ev);
+
+  for (int i = 0; i < ROW_COUNT; ++i)
+    if (results[i].status == CALC_OK)
+      job->sum += results[i].value;
+  free(params);
+  free(results);
+  return thrd_success;
+}
+
+static void print_diagnostics(const char *source, calc_Diagnostic *diagnostics,
+                              size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    printf("%s\n%*s^ %s\n", source, (int)diagnostics[i].start, "",
+           diagnostics[i].message);
+}
+
+int main(void) {
+  const char *invalid = "x * (y + ";
+  calc_Diagnostic *diagnostics;
+  size_t count;
+  calc_Expr *expr =
+      calc_compile(invalid, strlen(invalid), &diagnostics, &count);
+  if (!expr) {
+    print_diagnostics(invalid, diagnostics, count);
+    free(diagnostics);
+  }
+
+  const char *source = "x * x + 2 * y - (3 + 4)";
+  expr = calc_compile(source, strlen(source), &diagnostics, &count);
+  if (!expr) {
+    print_diagnostics(source, diagnostics, count);
+    free(diagnostics);
+    return 1;
+  }
+  for (size_t i = 0; i < calc_parameter_count(expr); ++i)
+    printf("Parameter %zu: %s\n", i, calc_parameter_name(expr, i));
+
+  calc_Evaluator *ev = calc_evaluator_create();
+  int params[] = {[0] = 100000, [1] = 1};
+  const char *error;
+  char *text = calc_eval_string(expr, ev, params, &error);
+  printf("x = %d, y = %d: %s\n", params[0], params[1], text ? text : error);
+  free(text);
+  calc_evaluator_free(ev);
+
+  thrd_t threads[THREAD_COUNT];
+  Job jobs[THREAD_COUNT];
+  for (int i = 0; i < THREAD_COUNT; ++i) {
+    jobs[i] = (Job){.expr = expr, .first = i * 1000};
+    thrd_create(&threads[i], thread_function, &jobs[i]);
+  }
+  for (int i = 0; i < THREAD_COUNT; ++i) {
+    thrd_join(threads[i], 0);
+    printf("Thread %d: sum = %lld\n", i, jobs[i].sum);
+  }
+
+  calc_free(expr);
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include "libcalc.h"
+
+#define CALC_NO_MAIN
+#define CALC_LIBRARY
+#include "calc.c"
+
+// Nothing is modified after calc_compile returns, which is what makes sharing
+// an expression between threads safe
+struct calc_Expr {
+  Arena arena;
+  Expression *root;
+  Sheet parameters; // Only used as a table of names
+  Program program;
+  bool compiled; // Whether the program can be run instead of walking the tree
+};
+
+struct calc_Evaluator {
+  Evaluator evaluator;
+  int *stack;
+};
+
+// Parse an expression whose identifiers all name parameters, interned in the
+// given sheet in order of first appearance
+static Expression *parse_formula(const char *input, size_t size, Arena *arena,
+                                 Sheet *sheet, Diagnostic **diagnostics) {
+  MemoryInput memory = {.data = input, .size = size};
+  Lexer lexer;
+  lexer_init(&lexer, memory_source(&memory), arena);
+  Parser p = {.lexer = &lexer,
+              .arena = arena,
+              .diagnostics = diagnostics,
+              .sheet = sheet,
+              .in_definition = true,
+              .list_allocator = arena_list_allocator(arena)};
+  Expression *expr = parse_until_eof(&p, 0);
+  free_lexer(&lexer);
+  return expr;
+}
+
+calc_Expr *calc_compile(const char *source, size_t size,
+                        calc_Diagnostic **diagnostics, size_t *count) {
+  calc_Expr *expr = calloc(1, sizeof(calc_Expr));
+  if (!expr)
+    die("Failed to allocate memory");
+
+  Diagnostic *errors = 0;
+  Expression *root = parse_formula(source, size, &expr->arena,
+                                   &expr->parameters, &errors);
+  if (!root->valid) {
+    size_t error_count = arraylist_size(errors);
+    if (diagnostics) {
+      size_t capacity = error_count > 0 ? error_count : 1;
+      *diagnostics = malloc(capacity * sizeof(calc_Diagnostic));
+      if (!*diagnostics)
+        die("Failed to allocate memory");
+      for (size_t i = 0; i < error_count; ++i)
+        (*diagnostics)[i] = (calc_Diagnostic){.message = errors[i].message,
+                                              .start = errors[i].start,
+                                              .end = errors[i].end};
+    }
+    if (count)
+      *count = error_count;
+    arraylist_free(errors);
+    calc_free(expr);
+    return 0;
+  }
+  arraylist_free(errors);
+  if (count)
+    *count = 0;
+
+  // Constants are folded now rather than on every evaluation
+  Optimizer optimizer = {0};
+  expr->root = optimize(&optimizer, &expr->arena, root);
+  expr->compiled = compile(&expr->program, &optimizer.walk, expr->root);
+  free_optimizer(&optimizer);
+  return expr;
+}
+
+void calc_free(calc_Expr *expr) {
+  if (!expr)
+    return;
+  arena_free(&expr->arena);
+  free_sheet(&expr->parameters);
+  free_program(&expr->program);
+  free(expr);
+}
+
+size_t calc_parameter_count(const calc_Expr *expr) {
+  return arraylist_size(expr->parameters.variables);
+}
+
+const char *calc_parameter_name(const calc_Expr *expr, size_t index) {
+  return expr->parameters.variables[index].name;
+}
+
+size_t calc_parameter_index(const calc_Expr *expr, const char *name) {
+  size_t index = sheet_find(&expr->parameters, name, strlen(name));
+  return index == NO_VARIABLE ? calc_parameter_count(expr) : index;
+}
+
+calc_Evaluator *calc_evaluator_create(void) {
+  calc_Evaluator *ev = calloc(1, sizeof(calc_Evaluator));
+  if (!ev)
+    die("Failed to allocate memory");
+  return ev;
+}
+
+void calc_evaluator_free(calc_Evaluator *ev) {
+  if (!ev)
+    return;
+  free_evaluator(&ev->evaluator);
+  arraylist_free(ev->stack);
+  free(ev);
+}
+
+// Evaluate an expression, first with the program if there is one, falling back
+// to the tree for results that are not ints and for errors
+static Number calc_eval_number(const calc_Expr *expr, calc_Evaluator *ev,
+                               const int *params, const char **error) {
+  *error = 0;
+  if (expr->compiled) {
+    size_t capacity = arraylist_capacity(ev->stack);
+    if (capacity < expr->program.max_stack)
+      arraylist_grow(ev->stack, expr->program.max_stack - capacity);
+    int value;
+    if (run(&expr->program, ev->stack, params, &value))
+      return number_integer(value);
+  }
+
+  Evaluator *evaluator = &ev->evaluator;
+  evaluator->env = params;
+  evaluator->error = 0;
+  Number result = eval(evaluator, expr->root);
+  if (evaluator->error) {
+    free_number(&result);
+    *error = evaluator->error;
+    return number_integer(0);
+  }
+  return result;
+}
+
+calc_Result calc_eval(const calc_Expr *expr, calc_Evaluator *ev,
+                      const int *params) {
+  const char *error;
+  Number n = calc_eval_number(expr, ev, params, &error);
+  if (error)
+    return (calc_Result){.status = CALC_ERROR, .error = error};
+  if (n.type != NUMBER_INTEGER) {
+    free_number(&n);
+    return (calc_Result){.status = CALC_NOT_INT};
+  }
+  return (calc_Result){.status = CALC_OK, .value = n.integer};
+}
+
+char *calc_eval_string(const calc_Expr *expr, calc_Evaluator *ev,
+                       const int *params, const char **error) {
+  Number n = calc_eval_number(expr, ev, params, error);
+  if (*error)
+    return 0;
+
+  char *text;
+  size_t size;
+  FILE *out = open_memstream(&text, &size);
+  if (!out)
+    die("Failed to allocate memory");
+  print_number(out, n);
+  fclose(out);
+  free_number(&n);
+  if (size > 0 && text[size - 1] == '\n')
+    text[size - 1] = 0;
+  return text;
+}
+
+void calc_eval_batch(const calc_Expr *expr, calc_Evaluator *ev,
+                     const int *params, size_t count, calc_Result *results) {
+  size_t stride = calc_parameter_count(expr);
+  for (size_t i = 0; i < count; ++i)
+    results[i] = calc_eval(expr, ev, params + i * stride);
+}
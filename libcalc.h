@@ -0,0 +1,68 @@
+//===----------------------------------------------------------------------===//
+// libcalc - Embeddable calculator library
+//
+// Expressions are compiled once to an immutable calc_Expr, then evaluated any
+// number of times with different parameter values. Every identifier in the
+// source is a parameter, numbered in order of first appearance.
+//
+// A calc_Expr may be shared by any number of threads. A calc_Evaluator holds
+// the scratch space of evaluations and must only be used by one thread at a
+// time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef INCLUDED_LIBCALC_H
+#define INCLUDED_LIBCALC_H
+
+#include <stddef.h>
+
+typedef struct calc_Expr calc_Expr;
+typedef struct calc_Evaluator calc_Evaluator;
+
+// Error found while compiling, covering bytes [start, end) of the source
+typedef struct {
+  const char *message; // Static string
+  size_t start;
+  size_t end;
+} calc_Diagnostic;
+
+typedef enum {
+  CALC_OK,
+  CALC_NOT_INT, // Valid result that is not an int, see calc_eval_string
+  CALC_ERROR
+} calc_Status;
+
+typedef struct {
+  calc_Status status;
+  int value;         // Set when status is CALC_OK
+  const char *error; // Static string, set when status is CALC_ERROR
+} calc_Result;
+
+// Compile the given source. On error, return null and, if diagnostics is not
+// null, store there an array of count diagnostics to be released with free.
+calc_Expr *calc_compile(const char *source, size_t size,
+                        calc_Diagnostic **diagnostics, size_t *count);
+void calc_free(calc_Expr *expr);
+
+size_t calc_parameter_count(const calc_Expr *expr);
+// Return the null-terminated name of the given parameter
+const char *calc_parameter_name(const calc_Expr *expr, size_t index);
+// Return the index of the named parameter, or calc_parameter_count if unknown
+size_t calc_parameter_index(const calc_Expr *expr, const char *name);
+
+calc_Evaluator *calc_evaluator_create(void);
+void calc_evaluator_free(calc_Evaluator *ev);
+
+// Evaluate an expression, params holding one value per parameter
+calc_Result calc_eval(const calc_Expr *expr, calc_Evaluator *ev,
+                      const int *params);
+// Evaluate an expression and return its result as a string to be released with
+// free, or null on error, error then being set to a static string
+char *calc_eval_string(const calc_Expr *expr, calc_Evaluator *ev,
+                       const int *params, const char **error);
+// Evaluate an expression once per row of params, each row holding one value per
+// parameter, storing the results of the count rows in results
+void calc_eval_batch(const calc_Expr *expr, calc_Evaluator *ev,
+                     const int *params, size_t count, calc_Result *results);
+
+#endif // INCLUDED_LIBCALC_H